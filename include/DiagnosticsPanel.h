@@ -0,0 +1,45 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DIAGNOSTICSPANEL_H
+#define DIAGNOSTICSPANEL_H
+
+#include <QDockWidget>
+#include <QTableWidget>
+#include <QList>
+#include "gcode-int.h"
+
+/* Refresh period of the diagnostics panel while it's shown */
+#define DIAGNOSTICS_REFRESH_MS  1000
+
+/*
+ * Non-modal panel with the time every loaded file spent in every phase
+ * (see GPhaseTimes), one row per file.  The render column is the average
+ * time of a frame.
+ */
+class DiagnosticsPanel : public QDockWidget
+{
+    Q_OBJECT
+
+public:
+    DiagnosticsPanel(QWidget *parent = 0);
+
+    void Update(const QList<GCodeInt *> &files);
+
+private:
+    QTableWidget *m_table;
+};
+
+#endif // DIAGNOSTICSPANEL_H
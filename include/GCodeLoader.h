@@ -0,0 +1,111 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODELOADER_H
+#define GCODELOADER_H
+
+#include <QObject>
+#include <QRunnable>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QString>
+#include "gcode-int.h"
+#include "gcode-estimator.h"
+#include "gcode-stats.h"
+
+/*
+ * Limits the memory of the files loading at the same time.  A load waits
+ * until its estimated memory fits in the budget, it's always admitted when
+ * nothing else is loading.
+ */
+class GCodeLoadAdmission
+{
+public:
+    GCodeLoadAdmission(qint64 budget) { m_budget = budget; m_inUse = 0; }
+
+    void Acquire(qint64 bytes, GCodeInt *ginter);
+    void Release(qint64 bytes);
+    void WakeAll();
+
+    /* Half of the physical memory */
+    static qint64 DefaultBudget();
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_released;
+    qint64 m_budget;
+    qint64 m_inUse;
+};
+
+/*
+ * Files loading at the same time at most.  The loads wait for the tasks they
+ * split on the scheduler, so its workers are this many less than the cores.
+ */
+#define LOAD_THREADS    2
+
+/*
+ * Loads a GCode file, it's run by a QThreadPool
+ *
+ * The interpreter belongs to the loader until TakeInterpreter is called, so
+ * a cancelled or failed load is freed with the loader.  While the file is
+ * loading the loader keeps a copy of the trajectory read so far (the preview),
+ * updated every time LoadFile reports progress.
+ */
+class GCodeLoader : public QObject, public QRunnable, public GCodeLoadListener
+{
+    Q_OBJECT
+
+public:
+    GCodeLoader(QString filePath, GCodeLoadAdmission *admission = NULL, QObject *parent = 0);
+    ~GCodeLoader(); //Must not be running
+
+    QString GetFilePath() { return m_filePath; }
+    bool IsLoaded() { return m_loaded; }
+    bool IsCancelled() { return m_ginter != NULL && m_ginter->IsCancelled(); }
+    QString GetErrorMessage() { return m_errorMessage; }
+    const GTimeEstimate &GetTimeEstimate() { return m_timeEstimate; }  //Of a loaded file
+    GCodeInt *TakeInterpreter();
+
+    /* The preview must only be used with the mutex locked */
+    QMutex *GetPreviewMutex() { return &m_previewMutex; }
+    const GTrajectory &GetPreview() { return m_preview; }
+    const GCodeInfo &GetPreviewInfo() { return m_previewInfo; }
+
+    virtual void UpdateProgress(long position, long size);
+    virtual void run();
+
+public slots:
+    void Cancel();
+
+signals:
+    void progress(int permille);
+    void previewUpdated();
+    void finished();
+
+private:
+    QString m_filePath;
+    GCodeInt *m_ginter;
+    GCodeLoadAdmission *m_admission;
+    bool m_loaded;
+    QString m_errorMessage;
+    GTimeEstimate m_timeEstimate;
+
+    QMutex m_previewMutex;
+    GTrajectory m_preview;
+    GCodeInfo m_previewInfo;
+    GMotionStats m_previewStats;    //Of the preview points, only used by the worker thread
+};
+
+#endif // GCODELOADER_H
@@ -18,8 +18,17 @@
 
 #include <QtGui/QMainWindow>
 #include <QLabel>
+#include <QMap>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
 #include "ui_MCBGenerator.h"
 
+class GCodeLoader;
+class GCodeLoadAdmission;
+class DiagnosticsPanel;
+struct GTimeEstimate;
+
 class PCBMillingGenerator : public QMainWindow
 {
 	Q_OBJECT
@@ -37,10 +46,22 @@ public slots:
 	void OnShowProbePointsTriggered(bool checked);
 	void OnShowDrillSpotsTriggered(bool checked);
 	void OnAddAutolevelGcodeTriggered();
+	void OnExportTrajectoryTriggered();
+	void OnSetParameterTriggered();
 	void ShowGerberToGCodeDialog();
 
+protected:
+	void dragEnterEvent(QDragEnterEvent *e);
+	void dropEvent(QDropEvent *e);
+
+private slots:
+	void FileLoadProgress(int permille);
+	void FileLoaded();
+	void UpdateDiagnostics();
+
 private:
-	void LoadGCodeFile(QString filePath);
+	void LoadGCodeFiles(QStringList filePaths);
+	void AddLoadedFile(QListWidgetItem *item, QString filePath, GCodeInt *ginter, const GTimeEstimate &estimate);
 
 	GCodeInt *GetSelectedListFileItem()
 	{
@@ -58,6 +79,11 @@ private:
 
 	Ui::PCBMillingGeneratorClass ui;
     QLabel *statusLabel;
+    QMap<GCodeLoader *, QListWidgetItem *> m_loading; //Files being loaded and their item in lstFile
+    QThreadPool m_loadPool;
+    GCodeLoadAdmission *m_loadAdmission;
+    DiagnosticsPanel *m_diagnostics;
+    QTimer m_diagnosticsTimer;
 };
 
 #endif // PCBMILLINGGENERATOR_H
@@ -0,0 +1,103 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODE_ARC_H
+#define GCODE_ARC_H
+#include <vector>
+#include <map>
+#include "gcode-int.h"
+
+using namespace std;
+
+/* Most segments an arc is split in, per turn */
+#define ARC_MAX_SEGMENTS_PER_TURN   4096
+
+/* Tolerance levels kept by a GArcCache */
+#define ARC_CACHE_MAX_LEVELS        4
+
+/* Arcs tessellated by a task at least in GArcCache::Prepare */
+#define ARC_CACHE_MIN_ARCS_PER_TASK 256
+
+/*
+ * Arc of a G02/G03 command from 'start' to 'end', with the center given by
+ * I/J (relative to the start) or by R.  Returns false if the arc is not
+ * valid, e.g. R with the same start and end.  A radius slightly too short
+ * for the distance between the ends is taken as a half circle.
+ */
+bool ComputeArc(GCodeCommand &cmd, const Position &start, const Position &end, GArc &arc);
+
+/* Bounding box of an arc, ends included */
+void GetArcBounds(const GArc &arc, const Position &start, const Position &end,
+                  Real &minX, Real &minY, Real &maxX, Real &maxY);
+
+/* Segments needed to keep the distance between the arc and its chords under 'tolerance' */
+int ArcSegmentCount(const GArc &arc, const Position &start, Real tolerance);
+
+/*
+ * Points of an arc with a chord error under 'tolerance', the start is not
+ * included and the last point is the end.  The radius goes linearly from the
+ * start radius to the end radius, so the last point is exactly the end even
+ * if the I/J center is a bit off.
+ */
+void TessellateArc(const GArc &arc, const Position &start, const Position &end, Real tolerance, vector<Position> &points);
+
+/*
+ * Tessellations of the arcs of a trajectory
+ *
+ * The tolerance is rounded down to a power of two, so small zoom changes use
+ * the same points.  Every arc is tessellated the first time it's asked for
+ * at a level, the arcs never asked for (e.g. out of sight) cost nothing.
+ * The points are dropped when the trajectory changes (GTrajectory::GetRevision).
+ */
+class GArcCache
+{
+public:
+    GArcCache() { m_useCount = 0; m_revision = 0; }
+
+    /*
+     * Points of arc 'index' of 'trajectory' as TessellateArc gives them (X and Y only).
+     * The spans are valid until the next call.
+     */
+    void GetPoints(const GTrajectory &trajectory, unsigned int index, Real tolerance, GSpan<double> &xs, GSpan<double> &ys);
+
+    /*
+     * Tessellates the arcs 'indexes' of 'trajectory' that are missing at the
+     * level of 'tolerance', in tasks of the GTaskScheduler.  The arcs about to
+     * be drawn are prepared together, GetPoints then finds them.
+     */
+    void Prepare(const GTrajectory &trajectory, const vector<unsigned int> &indexes, Real tolerance, GTaskPriority priority);
+
+    void Clear() { m_levels.clear(); }
+    size_t GetMemoryUsage();
+
+private:
+    struct Level
+    {
+        vector<unsigned int> first;     //Index of the first point of every arc
+        vector<unsigned int> count;     //Points of every arc, 0 if it's not tessellated yet
+        vector<double> x;
+        vector<double> y;
+        unsigned long lastUse;
+    };
+
+    Level &GetLevel(const GTrajectory &trajectory, Real tolerance, int &exponent);
+
+    map<int, Level> m_levels;           //By the tolerance exponent
+    unsigned long m_useCount;
+    unsigned long m_revision;           //Of the trajectory the points are from
+    vector<Position> m_points;          //Tessellation buffer
+};
+
+#endif
@@ -16,15 +16,16 @@
 #ifndef GCODEAUTOLEVELLER_H
 #define GCODEAUTOLEVELLER_H
 
-#include <QMap>
-#include <QDebug>
 #include <map>
 #include <cmath>
 #include <string>
 #include <list>
+#include <vector>
+#include <cstring>
 #include "gcode-lexer.h"
 #include "gcode-int.h"
 #include "gcode-ir.h"
+#include "gcode-emitter.h"
 
 using namespace std;
 
@@ -60,13 +61,50 @@ struct AutolevellerInfo
     double ProbeSpeed;        //Probe Speed Units (inches or mm) per Minute
 };
 
+/* Statements split by a task at least in SplitSegments */
+#define AL_SPLIT_MIN_STMTS_PER_TASK (32 * 1024)
+
+/* Chord error of the arcs split by the autoleveller */
+#define AL_ARC_TOLERANCE_MM         0.01
+#define AL_ARC_TOLERANCE_INCHES     0.0004
+
+/* Kind of statements produced by the autoleveller */
+enum AutolevelledKind { AL_VERBATIM, AL_ZADJUSTED, AL_SEGMENT, AL_ARC_SEGMENT, AL_ARC_VERBATIM };
+
+/*
+ * Autoleveller output statement.  Input commands are never copied, 'cmd' points
+ * to the statement owned by the interpreter:
+ *   AL_VERBATIM:  'cmd' is written as it is, copied from the file when it can.
+ *   AL_ZADJUSTED: 'cmd' is written with its Z replaced by the Z compensation.
+ *   AL_SEGMENT:   Piece of a split 'cmd', only the end point and the F argument
+ *                 (on the first piece) are written.
+ *   AL_ARC_SEGMENT: Piece of a split arc, written like AL_SEGMENT but as a G01.
+ *   AL_ARC_VERBATIM: Arc 'cmd' written as it is, with its G02/G03 even if it
+ *                 had none (the split arcs before it leave the machine in G01).
+ */
+struct AutolevelledStmt
+{
+    GCodeCommand *cmd;
+    Real x, y;
+    unsigned int zcomp;         //Index in m_zcomps, identical compensations are shared
+    unsigned char kind;
+    bool withFeed;
+};
+
+inline bool operator==(const ZCompensation &zc1, const ZCompensation &zc2)
+{
+    return memcmp(zc1.params, zc2.params, sizeof(zc1.params)) == 0 &&
+           memcmp(zc1.weights, zc2.weights, sizeof(zc1.weights)) == 0 &&
+           zc1.depth == zc2.depth;
+}
+
 class AutolevellerListener {
 
 public:
     virtual void UpdateProgress(int value) = 0;
 };
 
-class GCodeAutoleveller
+class GCodeAutoleveller: public GCodeStreamConsumer
 {
 public:
     GCodeAutoleveller(GCodeInt *ginter);
@@ -75,27 +113,101 @@ public:
 
         if (m_cellParams != 0)
             delete [] m_cellParams;
+
+        if (!m_isPart)
+            m_ginter->SetAutolevellerMemory(0);
     }
 
-    void SplitSegments(AutolevellerListener *listener = NULL);
-    void GenerateAutolevellingGCode(const char *outfile_path, AutolevellerListener *listener = NULL);
-    int GetOutputSize() { return m_outStmtList.size(); }
+    /*
+     * Splits the moves of a loaded file, the statements are split in parts
+     * by 'tasks' tasks of the GTaskScheduler (0 for one per thread).  The
+     * output is the same as if they were split in one go.
+     */
+    void SplitSegments(AutolevellerListener *listener = NULL, unsigned int tasks = 0);
+
+    /* Returns false with the error in 'diagnostics' */
+    bool GenerateAutolevellingGCode(const char *outfile_path, GDiagnostics &diagnostics, AutolevellerListener *listener = NULL);
+
+    /*
+     * SplitSegments and GenerateAutolevellingGCode for a file that is only
+     * streamed (GCodeInt::StreamFile), it must have been streamed once for
+     * the board area.  The file is streamed twice more: the probed cells are
+     * written before the moves, they're found in the first pass.  Only a
+     * window of split statements is kept, the listener gets the statement
+     * being written.
+     */
+    bool StreamAutolevellingGCode(const char *outfile_path, GDiagnostics &diagnostics, AutolevellerListener *listener = NULL);
+    bool ConsumeWindow(GCodeInt *ginter, unsigned long firstStatement, size_t firstPoint);
+
+    int GetOutputSize() { return m_streamedOutput + m_outStmtList.size(); }
+
+    /* Z compensations computed / stored, identical ones are shared (in a window when streaming) */
+    double GetZCompensationDedupRatio() {
+        size_t stored = m_streamedZComps + m_zcomps.size();
+
+        return (stored == 0)? 1.0 : (double)m_zcompRequests / stored;
+    }
 
     AutolevellerInfo *GetAutolevellerInfo() { return &m_AInfo; }
 
+    /* Bytes used by the split statements, the Z compensations and the grid */
+    size_t GetMemoryUsage();
+
 private:
-    string GetInterpolationFormula(Real x, Real y, bool isLinearMotionCommand);
-    void DistanceSplit(Real from_x, Real from_y, GCodeCommand *gcmd);
+    GCodeAutoleveller(const GCodeAutoleveller &parent);
+
+    void InitGrid();
+    void SplitStatements(unsigned long firstStatement, size_t firstPoint, AutolevellerListener *listener);
+    void SplitRange(GCodeCursor &cursor, int last, unsigned long firstStatement, AutolevellerListener *listener);
+    void SplitPart(int first, int last);
+    void MergePart(GCodeAutoleveller &part);
+    void EmitStatements(GCodeEmitter &outs, AutolevellerListener *listener);
+    void EmitHeader(GCodeEmitter &outs);
+    unsigned int GetZCompensation(Real x, Real y, bool isLinearMotionCommand);
+    unsigned int InternZCompensation(const ZCompensation &zcomp);
+    void DistanceSplit(Real from_x, Real from_y, Real to_x, Real to_y, GCodeCommand *gcmd, int kind, bool withFeed);
+    void SplitArc(GCodeCommand *gcmd, const GArc &arc, const Position &end);
+    void EmitStatement(GCodeEmitter &outs, AutolevelledStmt &stmt);
+    unsigned int EmitSourceRun(GCodeEmitter &outs, unsigned int first);
+
+    /* The text of 'cmd' in m_source to copy, NULL if it can't be copied */
+    const char *GetSourceText(GCodeCommand *cmd) {
+        return (cmd->GetSourceLength() == 0)? NULL : m_source.Get(cmd->GetSourceOffset(), cmd->GetSourceLength());
+    }
+
+    /* Trajectory point in the units of the program */
+    Position GetFilePosition(const GTrajectory &trajectory, unsigned int index) {
+        Position p = trajectory.GetPosition(index);
+
+        p.x /= m_unitScale;
+        p.y /= m_unitScale;
+        p.z /= m_unitScale;
+
+        return p;
+    }
+
+    void AddStatement(int kind, GCodeCommand *gcmd) {
+        AutolevelledStmt stmt;
+
+        stmt.kind = kind;
+        stmt.cmd = gcmd;
+        stmt.x = stmt.y = 0;
+        stmt.withFeed = false;
+        m_outStmtList.push_back(stmt);
+    }
 
     void SplitIfNeeded(GCodeCommand *gcmd) {
         if (pos.z >= 0 || !gcmd->HasArgument('X') || !gcmd->HasArgument('Y')) {
-            m_outStmtList.push_back(gcmd);
+            AddStatement(AL_VERBATIM, gcmd);
         } else {
 
             /*
              * We now have a start and end position, we can call our recursive routine...
              */
-            DistanceSplit(pos.x, pos.y, gcmd);
+            Real to_x = gcmd->GetArgumentValue('X');
+            Real to_y = gcmd->GetArgumentValue('Y');
+
+            DistanceSplit(pos.x, pos.y, to_x, to_y, gcmd, AL_ZADJUSTED, gcmd->HasArgument('F'));
         }
     }
 
@@ -142,16 +254,32 @@ private:
 
         ref_x = (int)floor(zero_x / m_AInfo.Gx);
         ref_y = (int)floor(zero_y / m_AInfo.Gy);
+
+        /* Points outside the board (e.g. a rapid before a drill) use the nearest cell */
+        if (ref_x < 0) ref_x = 0;
+        if (ref_x > m_AInfo.GridMaxX) ref_x = m_AInfo.GridMaxX;
+        if (ref_y < 0) ref_y = 0;
+        if (ref_y > m_AInfo.GridMaxY) ref_y = m_AInfo.GridMaxY;
     }
 
     int *m_cellParams; //GCode parameters associated with every cell in the Grid
     int m_nextParamNumber;
     GCodeInt *m_ginter;
-    list<GCodeStmt *> *m_inStmtList;
-    list<GCodeStmt *>  m_outStmtList;
+    vector<AutolevelledStmt> m_outStmtList;
+    vector<ZCompensation> m_zcomps;     //Unique Z compensations
+    vector<unsigned int> m_zcompTable;  //Hash table of m_zcomps indexes (plus one, zero is empty)
+    unsigned long m_zcompRequests;
+    unsigned long m_streamedZComps;     //Stored in the windows already consumed
     GCodeInfo *m_GInfo;
     AutolevellerInfo m_AInfo;
     Position pos;
+    Real m_unitScale;           //GCodeInfo::UnitScale
+    vector<Position> m_arcPoints;       //Tessellation of the arc being split
+    GCodeEmitter *m_streamOut;          //Of the streaming pass that writes, NULL in the first one
+    AutolevellerListener *m_streamListener;
+    unsigned long m_streamedOutput;     //Statements written by StreamAutolevellingGCode
+    bool m_isPart;                      //Of SplitSegments, its cells are numbered by their index plus one
+    GCodeSource m_source;               //File of the statements while they're written, closed if it changed
 };
 
 #endif // GCODEAUTOLEVELLER_H
@@ -0,0 +1,55 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODE_DIAGNOSTICS_H
+#define GCODE_DIAGNOSTICS_H
+#include <string>
+#include <sstream>
+
+using namespace std;
+
+/*
+ * Diagnostics sink
+ *
+ * Error messages of a job (loading, autolevelling, exporting a file...).
+ * The caller of every job gives it one of its own, the lexer, the parser and
+ * the autoleveller working for the job write there, so the jobs running at
+ * the same time, even on the same file, don't mix their messages.  It's
+ * written like an ostream, one message per line.
+ */
+class GDiagnostics
+{
+public:
+	template <class T>
+	GDiagnostics &operator<<(const T &value) { m_text << value; return *this; }
+
+	/* endl, hex... */
+	GDiagnostics &operator<<(ostream &(*manipulator)(ostream &)) { m_text << manipulator; return *this; }
+	GDiagnostics &operator<<(ios_base &(*manipulator)(ios_base &)) { m_text << manipulator; return *this; }
+
+	bool HasMessages() { return m_text.tellp() > 0; }
+	string GetText() { return m_text.str(); }
+
+	void Clear() {
+		m_text.str("");
+		m_text.clear();
+		m_text.setf(ios_base::dec, ios_base::basefield);
+	}
+
+private:
+	stringstream m_text;
+};
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODE_EMITTER_H
+#define GCODE_EMITTER_H
+
+#include <string>
+#include <cstring>
+#include <vector>
+#include "gcode-ir.h"
+
+using namespace std;
+
+/* Number formats supported by the emitter */
+#define NUMFMT_GENERAL      0   // Like printf("%g"), this is what an ostream does by default
+#define NUMFMT_FIXED        1   // Always 'precision' decimals
+#define NUMFMT_SHORTEST     2   // Fixed, without trailing zeros (or decimal point)
+
+#define EMIT_BUF_SIZE   (1 << 20)
+
+/* Bytes of the source file read at once, see GCodeSource */
+#define SOURCE_WINDOW_SIZE  (4 << 20)
+
+/*
+ * GCode Emitter
+ *
+ * Formats statements and numbers straight into a reusable buffer, the buffer is
+ * written to the output file in big blocks.  When no file is open the emitter
+ * just accumulates the text in memory (see ToString).
+ *
+ * The default number format (NUMFMT_GENERAL, precision 6) produces exactly the
+ * same text as streaming the values through a stringstream.
+ */
+class GCodeEmitter
+{
+public:
+    GCodeEmitter();
+    ~GCodeEmitter();
+
+    bool Open(const char *filePath);    //The caller reports the errors, see GDiagnostics
+    bool Close();
+    bool Flush();
+    bool HasError() { return m_error; }
+
+    void SetNumberFormat(int format, int precision) {
+        m_numFormat = format;
+        m_precision = precision;
+    }
+    int GetNumberFormat() { return m_numFormat; }
+    int GetPrecision() { return m_precision; }
+
+    void Write(const char *str, size_t len) {
+        if (m_len + len > m_capacity)
+            MakeRoom(len);
+
+        memcpy(&m_buf[m_len], str, len);
+        m_len += len;
+    }
+
+    /* Straight to the file when it doesn't fit in the buffer, e.g. a run of a GCodeSource */
+    void WriteBlock(const char *data, size_t len);
+
+    void Write(const char *str) { Write(str, strlen(str)); }
+    void Write(const string &str) { Write(str.data(), str.length()); }
+
+    void WriteChar(char ch) {
+        if (m_len + 1 > m_capacity)
+            MakeRoom(1);
+
+        m_buf[m_len++] = ch;
+    }
+
+    void WriteInt(long value);
+    void WriteReal(Real value) { WriteReal(value, m_numFormat, m_precision); }
+    void WriteReal(Real value, int format, int precision);
+
+    void EmitExpr(GExpr *expr);
+    void EmitZCompensation(const ZCompensation &zcomp);
+    void EmitCommand(GCodeCommand *cmd, const ZCompensation *zcomp = NULL);
+
+    /* Emits a batch of commands, one per line */
+    template <class Iterator>
+    void EmitCommands(Iterator first, Iterator last) {
+        while (first != last) {
+            EmitCommand(*first);
+            WriteChar('\n');
+            first++;
+        }
+    }
+
+    GCodeEmitter &operator<<(const char *str) { Write(str); return *this; }
+    GCodeEmitter &operator<<(const string &str) { Write(str); return *this; }
+    GCodeEmitter &operator<<(char ch) { WriteChar(ch); return *this; }
+    GCodeEmitter &operator<<(int value) { WriteInt(value); return *this; }
+    GCodeEmitter &operator<<(long value) { WriteInt(value); return *this; }
+    GCodeEmitter &operator<<(double value) { WriteReal(value); return *this; }
+    GCodeEmitter &operator<<(Real value) { WriteReal(value); return *this; }
+
+    /* Text accumulated by a memory emitter */
+    const char *GetBuffer() { return m_buf; }
+    size_t GetLength() { return m_len; }
+    string ToString() { return string(m_buf, m_len); }
+
+    static int FormatReal(char *out, Real value, int format, int precision);
+    static long RoundReal(Real value, int decimals);
+
+private:
+    void MakeRoom(size_t len);
+    bool WriteFile(const char *data, size_t len);
+
+    char *m_buf;
+    size_t m_len;
+    size_t m_capacity;
+    int m_fhandle;
+    bool m_error;
+    int m_numFormat;
+    int m_precision;
+};
+
+/*
+ * What tells a file changed: its size, the time it was last modified (in
+ * nanoseconds where the system keeps them) and its inode, a file replaced by
+ * another one of the same size within a second is told apart too.
+ */
+struct GFileStamp
+{
+    long long size;
+    long long time;
+    unsigned long long inode;
+
+    GFileStamp() { size = time = -1; inode = 0; }
+
+    /* Of the open file 'fhandle', false if it can't be read */
+    bool Read(int fhandle);
+
+    bool operator==(const GFileStamp &other) const {
+        return size == other.size && time == other.time && inode == other.inode;
+    }
+    bool operator!=(const GFileStamp &other) const { return !(*this == other); }
+};
+
+/*
+ * Source file of a program.  The statements that are not changed are copied
+ * from it (see GCodeCommand::GetSourceOffset), in runs as long as the lines
+ * follow each other in the file, so they keep their text and cost what a copy
+ * does.  It's read with read() in windows of SOURCE_WINDOW_SIZE, as the
+ * statements come in the order of the file, not mapped: a file truncated
+ * while it's mapped faults the copy, here it's a short read and the rest of
+ * the statements are formatted.
+ */
+class GCodeSource
+{
+public:
+    GCodeSource() { m_fhandle = -1; m_windowStart = 0; }
+    ~GCodeSource() { Close(); }
+
+    bool Open(const char *filePath);
+    void Close();
+
+    bool IsOpen() { return m_fhandle != -1; }
+    long long GetSize() { return m_stamp.size; }
+    const GFileStamp &GetStamp() { return m_stamp; }
+
+    bool Contains(long long offset, size_t length) {
+        return m_fhandle != -1 && offset >= 0 && offset + (long long)length <= m_stamp.size;
+    }
+
+    /*
+     * The 'length' bytes from 'offset', valid until the next call.  NULL if
+     * they're not in the file or can't be read anymore.
+     */
+    const char *Get(long long offset, size_t length);
+
+private:
+    int m_fhandle;
+    GFileStamp m_stamp;
+    vector<char> m_window;
+    long long m_windowStart;        //Offset of m_window in the file
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODE_ESTIMATOR_H
+#define GCODE_ESTIMATOR_H
+#include <vector>
+#include <map>
+#include "gcode-int.h"
+
+using namespace std;
+
+/* Segments planned at a time, the block arrays stay in the cache */
+#define ESTIMATOR_BLOCK_SIZE    2048
+
+/* Machine used for the estimate, the units are the units of the file */
+struct GMachineInfo
+{
+    double RapidRate;           //Units per minute
+    double MaxFeedRate;         //Units per minute, also used when there is no F
+    double Acceleration;        //Units per second squared
+    double JunctionDeviation;   //Units, sets the cornering speed like Grbl does
+    double ToolChangeTime;      //Seconds
+};
+
+/* Machining time, in seconds */
+struct GTimeEstimate
+{
+    double Total;
+    double Rapid;               //G00
+    double Cutting;             //G01, G02, G03
+    double Drilling;            //G81, G82 cycles
+    double Probing;             //Probe cycles of autolevelled files
+    double ToolChanges;         //M06
+    map<int, double> ToolTime;  //Motion time with every tool, tool 0 is the one before the first M06
+    int EstimateTime;           //Milliseconds taken by the estimate
+};
+
+/*
+ * Machining time estimator
+ *
+ * Plans the trajectory like a motion controller: every move accelerates and
+ * decelerates at a constant rate (trapezoidal profile) and the speed at the
+ * junction of two moves is limited by the angle between them (junction
+ * deviation).  The drill and probe cycles stop the machine, their time is
+ * computed from the cycle moves.
+ *
+ * The trajectory is planned in blocks of ESTIMATOR_BLOCK_SIZE segments: the
+ * geometry, junction speeds and segment times are straight loops over
+ * contiguous arrays the compiler can vectorise, only the speed propagation
+ * (a backward and a forward pass) is sequential.  The geometry is computed
+ * once, in the backward pass, which keeps the length and the nominal speed
+ * of every segment for the forward one.
+ */
+class GCodeTimeEstimator
+{
+public:
+    GCodeTimeEstimator(GCodeInt *ginter);
+
+    GMachineInfo *GetMachineInfo() { return &m_MInfo; }
+    void Estimate(GTimeEstimate &estimate);
+
+private:
+    /* Drill or probe cycle, the machine stops before and after it */
+    struct Stop
+    {
+        unsigned int point;
+        Position after;         //Machine position at the end of the cycle
+        double time;
+    };
+
+    void PlanStops();
+    void ComputeBlock(size_t first, size_t last);
+    double MoveTime(double length, double speed);
+
+    GCodeInt *m_ginter;
+    GMachineInfo m_MInfo;
+    vector<Stop> m_stops;
+    vector<float> m_entryMax;   //Highest entry speed of every segment squared, from the backward pass
+    vector<double> m_segLength; //Of every segment, from the backward pass
+    vector<double> m_segSpeed;
+
+    /*
+     * Block arrays, index 0 is the segment before the block (a stop for the
+     * first block) and index 'n' the last segment of the block
+     */
+    vector<double> m_px, m_py, m_pz;        //Points, index 'j' is where segment 'j' starts
+    vector<double> m_length;
+    vector<double> m_speed;     //Nominal speed, units per second
+    vector<double> m_inX, m_inY, m_inZ;     //Direction at the start
+    vector<double> m_outX, m_outY, m_outZ;  //Direction at the end
+    vector<double> m_junction;  //Highest speed at the start, squared
+
+    /* Forward pass, index 'k' is the segment of point 'first + k' */
+    vector<double> m_entry;     //Squared speeds
+    vector<double> m_exit;
+    vector<double> m_time;
+};
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODE_EXPORT_H
+#define GCODE_EXPORT_H
+#include <string>
+#include "gcode-int.h"
+
+using namespace std;
+
+/* Points converted at once for the columns that aren't stored like they're written */
+#define EXPORT_CHUNK_POINTS     (64 * 1024)
+
+/*
+ * Writes the trajectory of a loaded file in NumPy format, a file per column
+ * named '<prefix><column>.npy' (numpy.load, pandas.DataFrame of them):
+ *   x, y, z   float64   Position after the move, in the units of the trajectory
+ *   feed      float32   Feed rate in effect
+ *   kind      uint8     GSegmentKind
+ *   source    uint32    Index of the statement
+ *   line      uint32    Line of the statement in the file, 0 for the probe cycles or if it's not known
+ * The columns are copied straight from the arrays of GTrajectory, x, y and z
+ * are converted in chunks if Real isn't a double.  Returns false with the
+ * error in 'diagnostics'.
+ */
+bool ExportTrajectory(GCodeInt *ginter, const string &prefix, GDiagnostics &diagnostics);
+
+#endif
@@ -18,8 +18,14 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
 #include "gcode-parser.h"
 #include "gcode-ir.h"
+#include "gcode-timing.h"
+#include "gcode-tasks.h"
+#include "gcode-emitter.h"
 
 using namespace std;
 
@@ -35,7 +41,9 @@ struct Position {
 
 struct GCodeInfo
 {
-    int UnitType; //Milimiters by default
+    int UnitType; //Milimiters by default, the units of the trajectory, probe points and everything below
+    int SourceUnitType; //Units of the program (G20/G21), the statements and the autoleveller output are in them
+    Real UnitScale; //Trajectory value = program value * UnitScale, 1 unless the file was normalised
     Position Pos;
     
     /* Board boundaries */
@@ -46,76 +54,702 @@ struct GCodeInfo
 
     //Route Depth
     Real MillRouteDepth;    
+
+    //Motion statistics, see GMotionStats
+    Real CutLength;                 //G01, G02, G03
+    Real RapidLength;               //G00
+    unsigned long RapidCount;
+    unsigned long CutCount;         //Straight cuts
+    unsigned long ArcCount;
+    unsigned long DrillCount;
+    unsigned long ProbeCount;
+    Real MinZ;                      //Of the moves and drills
+    Real MaxZ;
+    map<float, Real> FeedHistogram; //Cut length at every feed rate
+
+    //Load statistics
+    unsigned long ExprCount;        //Expressions parsed
+    unsigned long UniqueExprCount;  //Expressions stored, identical ones are shared
+    unsigned long StatementCount;   //Commands, also of a streamed file
+    int LoadTime;                   //Milliseconds
+};
+
+/*
+ * Memory used by a loaded file, in bytes.  Sizes are computed from the data
+ * structures, the allocator overhead is not included.
+ */
+struct GCodeMemoryUsage
+{
+    size_t Statements;      //Statement objects and the statement list
+    size_t Expressions;     //Expression pool
+    size_t Arguments;       //Command arguments
+    size_t Strings;         //Command names and the file path
+    size_t Parameters;      //Parameter tables, names included
+    size_t ProbePoints;
+    size_t Trajectory;
+    size_t Autoleveller;    //Buffers of the autoleveller working on the file, if any
+
+    size_t Total() const {
+        return Statements + Expressions + Arguments + Strings + Parameters + ProbePoints + Trajectory + Autoleveller;
+    }
+};
+
+/*
+ * GCode parameters
+ *
+ * Numbered parameters are kept in an array indexed by the parameter number,
+ * any other name goes to a hash table.  Reading a parameter that was never
+ * set gives 0.
+ */
+class GParameterTable
+{
+public:
+	GParameterTable(): m_values(PARAM_MAX_NUMBER + 1, 0), m_isSet(PARAM_MAX_NUMBER + 1, false) { }
+
+	Real Get(GVarRefExpr *vref) {
+		int number = vref->GetNumber();
+
+		return (number != 0)? m_values[number] : GetNamed(vref->GetVarName());
+	}
+
+	Real Get(const string &var) {
+		int number = ParameterNumber(var);
+
+		return (number != 0)? m_values[number] : GetNamed(var);
+	}
+
+	void Set(const string &var, Real value) {
+		int number = ParameterNumber(var);
+
+		if (number != 0) {
+			m_values[number] = value;
+			m_isSet[number] = true;
+		} else
+			m_named[var] = value;
+	}
+
+	/* Back to not assigned */
+	void Unset(const string &var) {
+		int number = ParameterNumber(var);
+
+		if (number != 0) {
+			m_values[number] = 0;
+			m_isSet[number] = false;
+		} else
+			m_named.erase(var);
+	}
+
+	bool IsSet(const string &var) {
+		int number = ParameterNumber(var);
+
+		return (number != 0)? m_isSet[number] : m_named.find(var) != m_named.end();
+	}
+
+	/* Values of the numbered parameters, indexed by number (unset ones are 0) */
+	const Real *GetValues() { return &m_values[0]; }
+
+	void Clear() {
+		m_values.assign(m_values.size(), 0);
+		m_isSet.assign(m_isSet.size(), false);
+		m_named.clear();
+	}
+
+	size_t GetMemoryUsage();
+
+private:
+	Real GetNamed(const string &var) {
+		unordered_map<string, Real>::iterator it = m_named.find(var);
+
+		return (it != m_named.end())? it->second : 0;
+	}
+
+	vector<Real> m_values;
+	vector<bool> m_isSet;
+	unordered_map<string, Real> m_named;
+};
+
+/*
+ * Dependencies of the parameters, built by LoadFile for GCodeInt::SetParameter
+ *
+ * The readers of a parameter are the indexes of the commands (in the statement
+ * list) whose arguments read it, in order.  A derived parameter is one whose
+ * assignments read other parameters, their expressions are kept to compute
+ * it again.  A point of the program is given by the commands and the
+ * assignments before it.
+ */
+class GParameterDeps
+{
+public:
+	GParameterDeps() { m_assignments = 0; m_reassigned = false; }
+
+	/* Commands are added in order, a command reading a parameter twice is kept once */
+	void AddReader(GVarRefExpr *vref, unsigned int stmt) {
+		vector<unsigned int> &readers = GetParameter(vref->GetNumber(), vref->GetVarName()).readers;
+
+		if (readers.empty() || readers.back() != stmt)
+			readers.push_back(stmt);
+	}
+
+	/* Assignment of 'var' after 'stmt' commands, 'expr' is kept if it reads parameters */
+	void AddAssignment(const string &var, GExpr *expr, bool readsParameters, unsigned int stmt);
+
+	/* Assignments added so far */
+	unsigned long GetAssignmentCount() { return m_assignments; }
+
+	/* Whether every command reads the last values (see HasLastValue), no parameter is assigned again nor after a command read it */
+	bool CommandsReadLastValues() { return !m_reassigned; }
+
+	/* Times 'var' is assigned, 'stmt' and 'order' give the point of the first assignment */
+	unsigned int GetAssignments(const string &var, unsigned int &stmt, unsigned long &order);
+
+	/* 'var' isn't computed from the others anymore, e.g. it was set by SetParameter */
+	void SetConstant(const string &var) { m_derived.erase(var); }
+
+	/* Commands that read 'var', NULL if none */
+	const vector<unsigned int> *GetReaders(const string &var);
+
+	/*
+	 * Derived parameters computed from 'var' (itself aside), even through other
+	 * ones, in the order they were assigned, with the expression of their last
+	 * assignment reading parameters.
+	 */
+	void GetDerivedFrom(const string &var, vector<pair<string, GExpr *> > &derived);
+
+	/*
+	 * Whether 'vref' read after 'stmt' commands and 'order' assignments reads the
+	 * last value of its parameter: it's never assigned, or once before.  A
+	 * command reads after every assignment before it, its 'order' is ~0UL.
+	 */
+	bool HasLastValue(GVarRefExpr *vref, unsigned int stmt, unsigned long order) {
+		int number = vref->GetNumber();
+		const Parameter *param;
+
+		if (number != 0)
+			param = m_numbered.empty()? NULL : &m_numbered[number];
+		else {
+			unordered_map<string, Parameter>::iterator it = m_named.find(vref->GetVarName());
+
+			param = (it != m_named.end())? &it->second : NULL;
+		}
+
+		if (param == NULL || param->assignments == 0)
+			return true;
+
+		return param->assignments == 1 && param->stmt <= stmt && param->order < order;
+	}
+
+	void Clear() {
+		m_numbered.clear();
+		m_named.clear();
+		m_derived.clear();
+		m_assignments = 0;
+		m_reassigned = false;
+	}
+
+	size_t GetMemoryUsage();
+
+private:
+	struct Parameter {
+		vector<unsigned int> readers;
+		unsigned int assignments;
+		unsigned int stmt;      //Of the first assignment
+		unsigned long order;
+
+		Parameter() { assignments = stmt = 0; order = 0; }
+	};
+
+	struct Derived {
+		vector<GExpr *> exprs;  //Of the assignments reading parameters
+		unsigned long order;    //Of the last one
+	};
+
+	Parameter &GetParameter(int number, const string &var) {
+		if (number == 0)
+			return m_named[var];
+
+		/* Most files use a few parameters, the table is allocated with the first one */
+		if (m_numbered.empty())
+			m_numbered.resize(PARAM_MAX_NUMBER + 1);
+
+		return m_numbered[number];
+	}
+
+	vector<Parameter> m_numbered;   //Indexed by parameter number
+	unordered_map<string, Parameter> m_named;
+	unordered_map<string, Derived> m_derived;
+	unsigned long m_assignments;
+	bool m_reassigned;
+};
+
+/* O100 call whose arguments read parameters, SetParameter evaluates it again */
+struct GProbeCall
+{
+	size_t point;                           //In the trajectory
+	list<Position>::iterator probePoint;
+	GExpr *args[4];                         //X, Y, traverse height and probe speed (NULL if it's not given)
+	unsigned int stmt;                      //Point of the program, see GParameterDeps
+	unsigned long order;
+};
+
+/* Read-only view of a contiguous array */
+template <class T>
+class GSpan
+{
+public:
+	GSpan(const T *data, size_t size) { m_data = data; m_size = size; }
+
+	const T &operator[](size_t index) const { return m_data[index]; }
+	size_t Size() const { return m_size; }
+	bool Empty() const { return m_size == 0; }
+	const T *begin() const { return m_data; }
+	const T *end() const { return m_data + m_size; }
+
+private:
+	const T *m_data;
+	size_t m_size;
+};
+
+/* SEG_PROBE is a probe cycle (O100 call), its point is the probed X,Y at the traverse height */
+enum GSegmentKind { SEG_RAPID, SEG_CUT, SEG_DRILL, SEG_ARC, SEG_PROBE };
+
+/*
+ * Arc on the XY plane (G02/G03) ending at trajectory point 'point', it starts
+ * at the point before.  The sweep is in radians, negative clockwise, and can
+ * be more than a turn.  Z goes linearly from the start to the end (helix).
+ */
+struct GArc
+{
+	Real cx, cy;
+	Real sweep;
+	unsigned int point;
+};
+
+/* Tool 'tool' is loaded (M06) before trajectory point 'point' */
+struct GToolChange
+{
+	unsigned int point;
+	int tool;
+};
+
+/*
+ * Absolute trajectory of a program
+ *
+ * One point for every motion or drill command, the point is the position after
+ * the command and 'source' the index of the command in the statement list.
+ * Every field is kept in its own array, so the consumers only touch what they
+ * need.  The points of kind SEG_ARC have their arc in GetArcs, in the same
+ * order.  'feed' is the feed rate in effect (the probe speed for SEG_PROBE).
+ */
+class GTrajectory
+{
+public:
+	GTrajectory() { m_revision = 0; }
+
+	void Add(const Position &pos, int kind, unsigned int source, float feed) {
+		m_x.push_back(pos.x);
+		m_y.push_back(pos.y);
+		m_z.push_back(pos.z);
+		m_kind.push_back(kind);
+		m_source.push_back(source);
+		m_feed.push_back(feed);
+	}
+
+	void AddArc(const Position &pos, GArc arc, unsigned int source, float feed) {
+		arc.point = Size();
+		m_arcs.push_back(arc);
+		Add(pos, SEG_ARC, source, feed);
+	}
+
+	void AddToolChange(int tool) {
+		GToolChange change;
+
+		change.point = Size();
+		change.tool = tool;
+		m_toolChanges.push_back(change);
+	}
+
+	/* Moves point 'index', its kind doesn't change */
+	void SetPoint(size_t index, const Position &pos, float feed) {
+		m_x[index] = pos.x;
+		m_y[index] = pos.y;
+		m_z[index] = pos.z;
+		m_feed[index] = feed;
+		m_revision++;
+	}
+
+	/* Replaces the arc 'index' of GetArcs */
+	void SetArc(size_t index, const GArc &arc) { m_arcs[index] = arc; m_revision++; }
+
+	/* Changes with SetPoint and SetArc, what's computed from the points (e.g. a GArcCache) is stale then */
+	unsigned long GetRevision() const { return m_revision; }
+
+	/* Appends the points of 'trajectory' from 'first' on */
+	void Append(const GTrajectory &trajectory, size_t first);
+
+	/* Multiplies the coordinates and the feed rates from point 'first' on by 'factor', e.g. to convert the units */
+	void Scale(Real factor, size_t first = 0) { Scale(factor, first, Size()); }
+
+	/* Same for the points 'first' to 'last' - 1, the ranges can be scaled at the same time */
+	void Scale(Real factor, size_t first, size_t last);
+
+	void Clear() {
+		m_x.clear();
+		m_y.clear();
+		m_z.clear();
+		m_kind.clear();
+		m_source.clear();
+		m_feed.clear();
+		m_arcs.clear();
+		m_toolChanges.clear();
+	}
+
+	/* Releases the room left by the growth of the arrays */
+	void Shrink() {
+		m_x.shrink_to_fit();
+		m_y.shrink_to_fit();
+		m_z.shrink_to_fit();
+		m_kind.shrink_to_fit();
+		m_source.shrink_to_fit();
+		m_feed.shrink_to_fit();
+		m_arcs.shrink_to_fit();
+		m_toolChanges.shrink_to_fit();
+	}
+
+	size_t Size() const { return m_kind.size(); }
+
+	GSpan<Real> GetX() const { return GSpan<Real>(m_x.data(), m_x.size()); }
+	GSpan<Real> GetY() const { return GSpan<Real>(m_y.data(), m_y.size()); }
+	GSpan<Real> GetZ() const { return GSpan<Real>(m_z.data(), m_z.size()); }
+	GSpan<unsigned char> GetKind() const { return GSpan<unsigned char>(m_kind.data(), m_kind.size()); }
+	GSpan<unsigned int> GetSource() const { return GSpan<unsigned int>(m_source.data(), m_source.size()); }
+	GSpan<float> GetFeed() const { return GSpan<float>(m_feed.data(), m_feed.size()); }
+	GSpan<GArc> GetArcs() const { return GSpan<GArc>(m_arcs.data(), m_arcs.size()); }
+	GSpan<GToolChange> GetToolChanges() const { return GSpan<GToolChange>(m_toolChanges.data(), m_toolChanges.size()); }
+
+	Position GetPosition(size_t index) const {
+		Position pos;
+
+		pos.x = m_x[index];
+		pos.y = m_y[index];
+		pos.z = m_z[index];
+
+		return pos;
+	}
+
+	/* Where the motion to point 'index' starts, the program starts at 0,0,0 and the probe cycles don't move it */
+	Position GetStartPosition(size_t index) const {
+		while (index > 0 && m_kind[index - 1] == SEG_PROBE)
+			index--;
+
+		return (index == 0)? Position() : GetPosition(index - 1);
+	}
+
+	size_t GetMemoryUsage() const {
+		return (m_x.capacity() + m_y.capacity() + m_z.capacity()) * sizeof(Real) +
+			   m_kind.capacity() * sizeof(unsigned char) + m_source.capacity() * sizeof(unsigned int) +
+			   m_feed.capacity() * sizeof(float) + m_arcs.capacity() * sizeof(GArc) +
+			   m_toolChanges.capacity() * sizeof(GToolChange);
+	}
+
+private:
+	vector<Real> m_x;
+	vector<Real> m_y;
+	vector<Real> m_z;
+	vector<unsigned char> m_kind;
+	vector<unsigned int> m_source;
+	vector<float> m_feed;
+	vector<GArc> m_arcs;
+	vector<GToolChange> m_toolChanges;
+	unsigned long m_revision;
+};
+
+/* LoadFile reports the progress at most every LOAD_PROGRESS_BYTES and LOAD_PROGRESS_MS */
+#define LOAD_PROGRESS_BYTES     (256 * 1024)
+#define LOAD_PROGRESS_MS        100
+
+/* LoadFile times the lexing, parsing and evaluation of one statement in LOAD_TIMING_SAMPLE */
+#define LOAD_TIMING_SAMPLE      64
+
+/* Commands evaluated again by a task at least in GCodeInt::SetParameter */
+#define REEVAL_MIN_STMTS_PER_TASK       (16 * 1024)
+
+/* Points scaled by a task at least when the units are normalised */
+#define NORMALISE_MIN_POINTS_PER_TASK   (256 * 1024)
+
+/* Memory estimated for loading a file, per byte of the file (measured with GetMemoryUsage) */
+#define LOAD_MEMORY_PER_FILE_BYTE   16
+
+/* Physical memory of the machine in bytes, 0 if it's not known */
+long long GetPhysicalMemory();
+
+class GCodeLoadListener
+{
+public:
+    virtual ~GCodeLoadListener() { }
+    virtual void UpdateProgress(long position, long size) = 0;
 };
 
+/* Commands kept by GCodeInt::StreamFile before handing them to the consumer */
+#define STREAM_WINDOW_STATEMENTS    4096
+
+/* Memory estimated for streaming a file, whatever its size (measured with a window of 4096) */
+#define STREAM_MEMORY_BYTES         (16 * 1024 * 1024)
+
+class GCodeInt;
+
+/*
+ * Consumer of GCodeInt::StreamFile
+ *
+ * While ConsumeWindow runs, the statement list and the trajectory of the
+ * interpreter only hold a window of the file: 'firstStatement' is the index
+ * of its first command in the file, and its points start at 'firstPoint'
+ * (the point before is where the first move starts, it's the last one of the
+ * previous window).  Everything is freed when it returns, false stops the
+ * streaming.
+ */
+class GCodeStreamConsumer
+{
+public:
+    virtual ~GCodeStreamConsumer() { }
+    virtual bool ConsumeWindow(GCodeInt *ginter, unsigned long firstStatement, size_t firstPoint) = 0;
+};
+
+/* Moves 'pos' to the end of a motion command, in the units of the program */
+inline void MoveTo(GCodeCommand &cmd, Position &pos)
+{
+	if (cmd.HasArgument('X'))
+		pos.x = cmd.GetArgumentValue('X');
+
+	if (cmd.HasArgument('Y'))
+		pos.y = cmd.GetArgumentValue('Y');
+
+	if (cmd.HasArgument('Z'))
+		pos.z = cmd.GetArgumentValue('Z');
+}
+
+struct GMotionStats;
+
 class GCodeInt
 {
 public:
 	GCodeInt(string filePath);
 	~GCodeInt(void);
-	bool LoadFile();
-	bool ExecuteNextStatement();
-	Position GetCurrentPos() { return m_currentPos; }
+
+	/* The errors go to 'diagnostics', every job (load, autolevel, export...) has its own, see GDiagnostics */
+	bool LoadFile(GDiagnostics &diagnostics, GCodeLoadListener *listener = NULL) {
+		return ReadFile(diagnostics, listener, NULL, false);
+	}
+
+	/*
+	 * Reads the file like LoadFile but without keeping it, for programs too
+	 * big for the memory: the commands are handed to 'consumer' (if any) in
+	 * windows of STREAM_WINDOW_STATEMENTS and freed, so the memory used
+	 * doesn't depend on the size of the file.  GCodeInfo gets the units, the
+	 * board area and the statistics like LoadFile does, nothing else is kept
+	 * (statements, trajectory, probe points, parameter dependencies).  The
+	 * units of every window are those in effect when it ends.  A file can be
+	 * streamed as many times as needed.
+	 */
+	bool StreamFile(GDiagnostics &diagnostics, GCodeStreamConsumer *consumer = NULL, GCodeLoadListener *listener = NULL) {
+		return ReadFile(diagnostics, listener, consumer, true);
+	}
+
+	/*
+	 * Makes LoadFile convert the geometry (trajectory, probe points, board
+	 * area and statistics) to 'unitType', so files in different units can be
+	 * used together.  The statements keep the units of the program.
+	 * UNIT_FILE (the default) leaves the units of the file.
+	 */
+	void SetCanonicalUnits(int unitType) { m_canonicalUnits = unitType; }
+
+	/* Multiplier from 'unitType' to the canonical units, e.g. for the trajectory while it's loaded */
+	Real GetUnitScale(int unitType);
+
+	/*
+	 * What-if change of a parameter: 'var' takes 'value' for the whole program,
+	 * like the parameters assigned from it.  Only the commands and the probe
+	 * cycles that read them are evaluated again, in 'tasks' tasks (0 for one
+	 * per thread of the GTaskScheduler), then the points of the trajectory that
+	 * moved and the statistics are updated.  The values are computed from the
+	 * last values of the parameters, so it returns false (with the reason in
+	 * 'diagnostics') when one of them reads a parameter that isn't assigned
+	 * once before it, when an arc became valid or invalid, or when the program
+	 * doesn't use 'var'.  The file has to be loaded again then to see the change,
+	 * nothing was changed.
+	 */
+	bool SetParameter(const string &var, Real value, GDiagnostics &diagnostics, unsigned int tasks = 0);
+
+	/* Makes LoadFile stop and fail (or not start), it can be called from any thread */
+	void Cancel() { m_cancel.Cancel(); }
+	bool IsCancelled() { return m_cancel.IsCancelled(); }
+
 	bool HasProbePoints() { return !probePoints->empty(); }
 	int GetMeasureUnits() { return gi.UnitType; }
 	list<Position> *GetProbePoints() { return probePoints; }
 	bool HasStatements() { return !slist.empty(); }
-	GCodeCommand *GetCurrentCommand() { return m_curCmd; }
 	GCodeInfo *GetGCodeInfo() { return &gi; }
 	string GetFilePath() { return m_filePath; }
     int GetStatementCount() { return slist.size(); }
-	void Init();
+	GCodeStmt *GetStatement(unsigned int index) { return slist[index]; }
 
-private:
+	/* Built by LoadFile, the statements don't change after that */
+	const GTrajectory &GetTrajectory() { return m_trajectory; }
 
-    void moveToWithEval(GCodeCommand &cmd, Position &pos) {
+	GCodeMemoryUsage GetMemoryUsage();
 
-		if (cmd.HasArgument('X')) {
-			Real value = EvalExpr(cmd.GetArgument('X'));
-			pos.x = value;
-		}
+	/* Time spent on the file by every phase, the consumers (autoleveller, renderer) add theirs */
+	GPhaseTimes &GetPhaseTimes() { return m_phaseTimes; }
 
-		if (cmd.HasArgument('Y')) {
-			Real value = EvalExpr(cmd.GetArgument('Y'));
-			pos.y = value;
-		}
-
-		if (cmd.HasArgument('Z')) {
-			Real value = EvalExpr(cmd.GetArgument('Z'));
-			pos.z = value;
-		}
-	}
+	void SetAutolevellerMemory(size_t bytes) { m_autolevellerMemory = bytes; }
 
-    void moveTo(GCodeCommand &cmd, Position &pos) {
+	/*
+	 * Opens the file the statements were read from, to copy them (see
+	 * GCodeCommand::GetSourceOffset).  Fails if it changed since then.
+	 */
+	bool OpenSource(GCodeSource &source);
 
-        if (cmd.HasArgument('X')) {
-            Real value = cmd.GetArgument('X')->GetValue();
-            pos.x = value;
-        }
+private:
+	struct LoadVisitor;
 
-        if (cmd.HasArgument('Y')) {
-            Real value = cmd.GetArgument('Y')->GetValue();
-            pos.y = value;
-        }
+    void EvalArguments(GCodeCommand &cmd) {
+        vector<GArgument> &args = cmd.GetArguments();
 
-        if (cmd.HasArgument('Z')) {
-            Real value = cmd.GetArgument('Z')->GetValue();
-            pos.z = value;
-        }
+        for (unsigned int i = 0; i < args.size(); i++)
+            args[i].value = EvalExpr(args[i].expr);
     }
 
+	bool ReadFile(GDiagnostics &diagnostics, GCodeLoadListener *listener, GCodeStreamConsumer *consumer, bool streaming);
+	bool FlushWindow(GCodeStreamConsumer *consumer, LoadVisitor &loader, GMotionStats &stats);
 	Real EvalExpr(GExpr *expr);
+	void EvalCommands(const vector<unsigned int> &stmts, size_t first, size_t last);
+	bool ReadsLastValues(GExpr *expr, unsigned int stmt, unsigned long order);
+	bool ReadLastValues(const vector<unsigned int> &stmts, size_t first, size_t last);
+	bool UpdateTrajectory(unsigned int first, unsigned int last);
+	void UpdateProbes(const vector<GProbeCall *> &probes);
 
 	string m_filePath;
 	ifstream m_in;
 	GCodeParser *m_gparser;
-	map<string, Real> gparameters;	//Symbol table to store the value of GCODE parameters
-	Position m_currentPos;
+	GExprPool m_exprPool;	//Expressions of every statement in the file
+	GParameterTable gparameters;	//Symbol table to store the value of GCODE parameters
+	GParameterDeps m_paramDeps;
+	vector<GProbeCall> m_probeCalls;
 	GCodeInfo gi;
-	GCodeCommand *m_curCmd;
 	list<Position> *probePoints;
-	list<GCodeStmt *> slist;
-	list<GCodeStmt *>::iterator itCurrentStmt;
+	vector<GCodeStmt *> slist;
+	GTrajectory m_trajectory;
+	size_t m_autolevellerMemory;
+	GPhaseTimes m_phaseTimes;
+	int m_canonicalUnits;
+	unsigned long m_streamOffset;	//Of the window in the file, see StreamFile
+	unsigned long m_streamExprs, m_streamUniqueExprs;
+	GCancelToken m_cancel;             //Also of the tasks of the file
+	GFileStamp m_sourceStamp;	//Of the file when it was read, see OpenSource
+};
+
+/*
+ * Read-only cursor over the statements of a loaded program and their points
+ * in the trajectory
+ *
+ * Every consumer walks the program with a cursor of its own.  The cursors
+ * don't change the interpreter, so any number of them can be used at the
+ * same time from any thread without locks, as long as the program isn't
+ * loaded again or changed (SetParameter) meanwhile.
+ */
+class GCodeCursor
+{
+public:
+	GCodeCursor(GCodeInt *ginter, size_t firstPoint = 0) : m_sources(NULL, 0), m_kinds(NULL, 0), m_arcs(NULL, 0) {
+		m_ginter = ginter;
+		Reset(firstPoint);
+	}
+
+	/*
+	 * Back to the start of the program, its points start at 'firstPoint' of
+	 * the trajectory (the window of a streamed file, see GCodeStreamConsumer)
+	 */
+	void Reset(size_t firstPoint = 0);
+
+	/*
+	 * Moves to the next statement, GetCommand is NULL if it's not a command.
+	 * Defined here so the traversal loops can inline it.
+	 */
+	bool Next() {
+		if (m_index >= m_count)
+			return false;
+
+		m_cmd = StmtCast<GCodeCommand>(m_ginter->GetStatement(m_index));
+		m_kind = -1;
+		m_arc = NULL;
+
+		/* The probe cycles are not statements, Next doesn't stop at them */
+		while (m_point < m_sources.Size() && m_kinds[m_point] == SEG_PROBE)
+			m_point++;
+
+		if (m_point < m_sources.Size() && m_sources[m_point] == m_index) {
+			m_kind = m_kinds[m_point];
+
+			if (m_kind == SEG_ARC)
+				m_arc = &m_arcs[m_arcIndex++];
+
+			m_last = m_point++;
+		}
+
+		m_index++;
+		return true;
+	}
+
+	/* Next goes to the statement 'index', in O(log n) */
+	bool Seek(unsigned int index);
+
+	/* Index of the statement Next goes to */
+	unsigned int GetIndex() { return m_index; }
+
+	/* Trajectory point of the next statement that has one */
+	size_t GetPoint() { return m_point; }
+
+	GCodeCommand *GetCommand() { return m_cmd; }
+
+	/* GSegmentKind of the point of the statement, -1 if it has none */
+	int GetKind() { return m_kind; }
+
+	/* Arc of the statement if it's SEG_ARC, in the units of the trajectory */
+	const GArc *GetArc() { return m_arc; }
+
+	/* Position after the statement (the last point), in the units of the program */
+	Position GetPosition() {
+		Position p;
+
+		if (m_last == NO_POINT) {
+			p.reset();
+			return p;
+		}
+
+		p = m_ginter->GetTrajectory().GetPosition(m_last);
+		p.x /= m_scale;
+		p.y /= m_scale;
+		p.z /= m_scale;
+
+		return p;
+	}
+
+private:
+	static const size_t NO_POINT = (size_t)-1;
+
+	GCodeInt *m_ginter;
+	GSpan<unsigned int> m_sources;
+	GSpan<unsigned char> m_kinds;
+	GSpan<GArc> m_arcs;
+	Real m_scale;
+	unsigned int m_count;
+	unsigned int m_index;
+	size_t m_first;		//Point of the first statement, see Reset
+	size_t m_point;
+	size_t m_last;		//Point of the position, NO_POINT before the first one
+	unsigned int m_arcIndex;
+	GCodeCommand *m_cmd;
+	int m_kind;
+	const GArc *m_arc;
 };
 
 #endif
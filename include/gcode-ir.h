@@ -28,18 +28,23 @@ enum GExprKind { ADD_EXPR, SUB_EXPR, MUL_EXPR, DIV_EXPR, NUMBER_EXPR, VREF_EXPR
 enum GStmtKind { ASSIGN_STMT, COMMAND_STMT, SUBDECL_STMT, SUBCALL_STMT };
 typedef long double Real;
 
+/* Bytes a string keeps on the heap, short strings are stored inside the object */
+inline size_t StringHeapBytes(const string &str)
+{
+	const char *data = str.data();
+	const char *obj = (const char *)&str;
+
+	return (data >= obj && data < obj + sizeof(string))? 0 : str.capacity() + 1;
+}
+
 //GCode Expression
+//Expressions are immutable and owned by the GExprPool that created them
 class GExpr
 {
 public:
     virtual ~GExpr() { }
 	virtual int GetKind() = 0;
-	virtual GExpr *Clone() = 0;
 	virtual string ToString() = 0;
-    Real GetValue() { return value; }
-    void SetValue(Real value) { this->value = value; }
-protected:
-    Real value;
 };
 
 class GBinaryExpr: public GExpr
@@ -49,17 +54,9 @@ public:
 		this->expr1 = expr1;
 		this->expr2 = expr2;
 	}
-	~GBinaryExpr() { 
-		if (expr1 != 0)
-			delete expr1;
-		if (expr2 != 0)
-			delete expr2; 
-	}
 
 	GExpr *GetLExpr() { return expr1; }
 	GExpr *GetRExpr() { return expr2; }
-	void SetLExpr(GExpr *expr) { expr1 = expr; }
-	void SetRExpr(GExpr *expr) { expr2 = expr;}
 
 protected:
 	GExpr *expr1;
@@ -72,7 +69,6 @@ public:
 	GAddExpr(GExpr *expr1, GExpr *expr2): GBinaryExpr(expr1, expr2) {}
 
 	int GetKind() { return ADD_EXPR; }
-	GExpr *Clone()  { return new GAddExpr(expr1->Clone(), expr2->Clone()); }
 	string ToString() { return "(" + expr1->ToString() + " + " + expr2->ToString() + ")"; }
 };
 
@@ -82,7 +78,6 @@ public:
 	GSubExpr(GExpr *expr1, GExpr *expr2): GBinaryExpr(expr1, expr2) {}
 
 	int GetKind() { return SUB_EXPR; }
-	GExpr *Clone()  { return new GSubExpr(expr1->Clone(), expr2->Clone()); }
 	string ToString() { return "(" + expr1->ToString() + " - " + expr2->ToString() + ")"; }
 };
 
@@ -92,7 +87,6 @@ public:
 	GMulExpr(GExpr *expr1, GExpr *expr2): GBinaryExpr(expr1, expr2) {}
 
 	int GetKind() { return MUL_EXPR; }
-	GExpr *Clone()  { return new GMulExpr(expr1->Clone(), expr2->Clone()); }
 	string ToString() { return "(" + expr1->ToString() + " * " + expr2->ToString() + ")"; }
 };
 
@@ -102,17 +96,16 @@ public:
 	GDivExpr(GExpr *expr1, GExpr *expr2): GBinaryExpr(expr1, expr2) {}
 
 	int GetKind() { return DIV_EXPR; }
-	GExpr *Clone()  { return new GDivExpr(expr1->Clone(), expr2->Clone()); }
 	string ToString() { return "(" + expr1->ToString() + " / " + expr2->ToString() + ")"; }
 };
 
 class GNumberExpr:  public GExpr
 {
 public:
-	GNumberExpr(long double value) { this->value = value; }
+	GNumberExpr(Real value) { this->value = value; }
 
 	int GetKind() { return NUMBER_EXPR; }
-	GExpr *Clone()  { return new GNumberExpr(value); }
+	Real GetValue() { return value; }
 
 	string ToString() {
 		stringstream ss;
@@ -120,70 +113,157 @@ public:
 		ss << value;
 		return ss.str();
 	}
+
+private:
+	Real value;
 };
 
+/* Highest numbered parameter, like LinuxCNC */
+#define PARAM_MAX_NUMBER    5399
+
+/*
+ * Number of a numbered parameter ("#1" to "#5399"), 0 for any other name.
+ * Only the canonical spelling is numbered, "#02000" is still another parameter.
+ */
+inline int ParameterNumber(const string &var)
+{
+	if (var.length() < 2 || var.length() > 5 || var[0] != '#' || var[1] == '0')
+		return 0;
+
+	int number = 0;
+
+	for (unsigned int i = 1; i < var.length(); i++) {
+		if (var[i] < '0' || var[i] > '9')
+			return 0;
+
+		number = number * 10 + (var[i] - '0');
+	}
+
+	return (number <= PARAM_MAX_NUMBER)? number : 0;
+}
+
 class GVarRefExpr: public GExpr
 {
 public:
-	GVarRefExpr(string var) { this->var = var; }
+	GVarRefExpr(string var) { this->var = var; this->number = ParameterNumber(var); }
 
 	int GetKind() { return VREF_EXPR; }
-	string GetVarName() { return var; }
-	GExpr *Clone()  { return new GVarRefExpr(var); }
+	const string &GetVarName() { return var; }
+	int GetNumber() { return number; }
 	string ToString() { return var; }
 
 private:
 	string var;
+	int number;     //See ParameterNumber
+};
+
+/*
+ * Expression pool
+ *
+ * Hash-conses expressions: structurally identical expressions are created once
+ * and shared, so two expressions from the same pool are equal only if they are
+ * the same pointer.  The pool owns every expression it returns.
+ */
+class GExprPool
+{
+public:
+	GExprPool();
+	~GExprPool() { Clear(); }
+
+	GExpr *Number(Real value);
+	GExpr *VarRef(const string &var);
+	GExpr *Binary(int kind, GExpr *lexpr, GExpr *rexpr);
+	void Clear();
+
+	unsigned long GetRequestCount() { return m_requests; }
+	unsigned long GetNodeCount() { return m_count; }
+	double GetDedupRatio() { return (m_count == 0)? 1.0 : (double)m_requests / m_count; }
+	size_t GetMemoryUsage();
+
+private:
+	template <class Match>
+	GExpr *Find(size_t hash, size_t &index, Match match);
+	void Grow();
+	static size_t Hash(GExpr *expr);
+
+	vector<GExpr *> m_table;		//Open addressing hash table
+	vector<unsigned int> m_tags;	//Upper hash bits of every slot
+	unsigned long m_count;
+	unsigned long m_requests;
+};
+
+/* Milling depth parameter added to a Z compensation */
+#define ZDEPTH_ENGRAVING    0   // #3
+#define ZDEPTH_DRILLSPOT    1   // #7
+
+/*
+ * Z compensation for a point, the probed heights of the four nearest grid cells
+ * weighted for a bilinear interpolation plus the milling depth.  It's written as
+ *      "w0*#p0 + w1*#p1 + w2*#p2 + w3*#p3 + #3"
+ * The weights are kept in thousandths, that's the precision used in the output.
+ */
+struct ZCompensation
+{
+    int params[4];              //Parameter numbers of the cells, any grid size
+    short weights[4];
+    unsigned char depth;
+
+    int GetDepthParameter() const { return (depth == ZDEPTH_DRILLSPOT)? 7 : 3; }
 };
 
 //Gcode Stamement base class
+//The kind is stored in the statement, use StmtCast or GStmtVisitor to get the actual statement
 class GCodeStmt
 {
 public:
     virtual ~GCodeStmt() { }
-	virtual int GetKind() = 0;
+	int GetKind() { return kind; }
     virtual GCodeStmt *Clone() = 0;
+
+protected:
+	GCodeStmt(int kind) { this->kind = kind; }
+
+private:
+	int kind;
 };
 
 class GCodeAssign: public GCodeStmt
 {
 public:
-	GCodeAssign(string var, GExpr *expr) { this->var = var; this->rvalue = expr; }
-	~GCodeAssign() { delete rvalue; }
+	static const int Kind = ASSIGN_STMT;
+
+	GCodeAssign(string var, GExpr *expr): GCodeStmt(Kind) { this->var = var; this->rvalue = expr; }
 	string GetVariable() { return var; }
 	GExpr *GetExpr() { return rvalue; }
-	int GetKind( ) { return ASSIGN_STMT; }
-    GCodeStmt *Clone() { return new GCodeAssign(var, rvalue->Clone()); }
+    GCodeStmt *Clone() { return new GCodeAssign(var, rvalue); }
 
 private:
 	string var;
 	GExpr *rvalue;
 };
 
+//Command argument
+struct GArgument
+{
+	char name;
+	GExpr *expr;
+	Real value;     //Value of the expression, set when the command is evaluated
+};
+
 class GCodeCommand: public GCodeStmt
 {
 public:
-	GCodeCommand() {
-        name = "";
-        zformula = "";
-        argNameList = "";
-    }
+	static const int Kind = COMMAND_STMT;
 
-    GCodeCommand(int commndID, Real x, Real y) {
-        opcode = commndID;
-        argNameList = "XY";
-		arguments['X'] = new GNumberExpr(x);
-        arguments['Y'] = new GNumberExpr(y);
-        zformula = "";
+	GCodeCommand(): GCodeStmt(Kind) {
+        name = "";
+        sourceOffset = 0;
+        sourceLength = 0;
     }
 
-	~GCodeCommand() { FreeArguments(); }
-
-	int GetKind() { return COMMAND_STMT; }
-
 	int GetOpcode() { return opcode; }
 	void SetOpcode(int opcode) { this->opcode = opcode; }
-	string GetName() { return name; }
+	const string &GetName() { return name; }
 	void SetName(string name) { this->name = name; }
 	bool IsA(int commandID) { return opcode == commandID; }
     bool IsMotionCommand() { return ((opcode != G82) && (opcode != G81)) && (HasArgument('X') || HasArgument('Y') || HasArgument('Z')); }
@@ -191,48 +271,60 @@ public:
 	void SetArgument(char argName, GExpr *expr) {
 		argName = toupper(argName);
 
-		if (arguments.find(argName) == arguments.end())
-			argNameList += argName;
+		GArgument *arg = FindArgument(argName);
+
+		if (arg == NULL) {
+			GArgument newArg;
+
+			newArg.name = argName;
+			newArg.value = 0;
+			arguments.push_back(newArg);
+			arg = &arguments.back();
+		}
 
-		arguments[argName] = expr;
+		arg->expr = expr;
 	}
 
-	bool HasArgument(char argName) { return arguments.find(toupper(argName)) != arguments.end(); }
-	GExpr *GetArgument(char argName) { return arguments[toupper(argName)]; }
-    
-    void setZFormula(string &zformula) {
-        if (!HasArgument('Z'))
-            argNameList += "Z";
-        
-        this->zformula = zformula;
+	bool HasArgument(char argName) { return FindArgument(toupper(argName)) != NULL; }
+
+	GExpr *GetArgument(char argName) {
+		GArgument *arg = FindArgument(toupper(argName));
+
+		return (arg != NULL)? arg->expr : NULL;
+	}
+
+	Real GetArgumentValue(char argName) {
+		GArgument *arg = FindArgument(toupper(argName));
+
+		return (arg != NULL)? arg->value : 0;
+	}
+
+	//Arguments in the order they were written
+	vector<GArgument> &GetArguments() { return arguments; }
+
+    /*
+     * Bytes of the file the command was read from, its first token to its
+     * last one.  The emitter copies them instead of formatting the command
+     * when it's not changed (see GCodeSource).  The length is 0 if the
+     * command was not read from a file.
+     */
+    void SetSource(long long offset, unsigned int length) {
+        sourceOffset = offset;
+        sourceLength = length;
     }
+    long long GetSourceOffset() { return sourceOffset; }
+    unsigned int GetSourceLength() { return sourceLength; }
     
     void Clear() {
-        FreeArguments();
         name = "";
-        zformula = "";
-        argNameList = "";
-    }
-    
-    void operator=(GCodeCommand &cmd) {
-        this->Clear();
-        this->opcode = cmd.opcode;
-        this->name = cmd.name;
-        this->argNameList = cmd.argNameList;
-        this->zformula = cmd.zformula;
-        
-        for (unsigned int i = 0; i < cmd.argNameList.length(); i++ ) {
-                char argName = cmd.argNameList[i];
-                GExpr *value = cmd.arguments[argName]->Clone();
-        
-                arguments[argName] = value;
-        }
+        arguments.clear();
+        sourceLength = 0;
     }
     
     GCodeStmt *Clone() {
         GCodeCommand *result = new GCodeCommand();
 
-        *result = *this; //User operator =
+        *result = *this; //Expressions are shared
 
         return result;
     }
@@ -240,44 +332,30 @@ public:
     string ToString();
 
 private:
-	void FreeArguments() {
-		map<char, GExpr *>::iterator it = arguments.begin();
-
-		while (it != arguments.end()) {
-			GExpr *expr = it->second;
-
-			delete expr;
-			it++;
+	GArgument *FindArgument(char argName) {
+		for (unsigned int i = 0; i < arguments.size(); i++) {
+			if (arguments[i].name == argName)
+				return &arguments[i];
 		}
-		arguments.clear();
+
+		return NULL;
 	}
 
 	int opcode;
+	unsigned int sourceLength;
+	long long sourceOffset;
 	string name;
-	string zformula;     //Interpolation Formula for Z Coordinate
-	string argNameList;  //Argument Names
-	map<char, GExpr *> arguments;
+	vector<GArgument> arguments;
 };
 
 class GCodeSubCall: public GCodeStmt
 {
 public:
-	GCodeSubCall() { name = ""; subId = 0; }
-	GCodeSubCall(string name, int subId) { this->name = name; this->subId = subId; }
+	static const int Kind = SUBCALL_STMT;
 
-	~GCodeSubCall() {
-		vector<GExpr *>::iterator it = arguments.begin();
-		while (it != arguments.end() ) {
-			GExpr *expr = *it;
-
-			delete expr;
-			
-			it++;
-		}
-		arguments.clear();
-	}
+	GCodeSubCall(): GCodeStmt(Kind) { name = ""; subId = 0; }
+	GCodeSubCall(string name, int subId): GCodeStmt(Kind) { this->name = name; this->subId = subId; }
 
-	int GetKind() { return SUBCALL_STMT; }
 	int GetSubID() { return subId; }
 	void SetSubID(int subId) { this->subId = subId; }
 	string GetName() { return name; }
@@ -288,14 +366,8 @@ public:
 
     GCodeStmt *Clone() {
         GCodeSubCall *result = new GCodeSubCall();
-        result->subId = subId;
-        result->name = name;
 
-        vector<GExpr *>::iterator it = arguments.begin();
-        while (it != arguments.end()) {
-            GExpr *expr = *it;
-            result->arguments.push_back(expr->Clone());
-        }
+        *result = *this; //Expressions are shared
 
         return result;
     }
@@ -306,4 +378,43 @@ private:
 	vector<GExpr *> arguments;
 };
 
+/* Checked downcast, returns NULL if the statement is not a 'T' */
+template <class T>
+inline T *StmtCast(GCodeStmt *stmt)
+{
+	return (stmt->GetKind() == T::Kind)? static_cast<T *>(stmt) : NULL;
+}
+
+/*
+ * Statement visitor
+ *
+ * 'Derived' hides the Visit functions for the statements it's interested in,
+ * the others are ignored.  Dispatching is a switch on the statement kind with
+ * no virtual calls, so the calls get inlined in the traversal loops.
+ */
+template <class Derived>
+class GStmtVisitor
+{
+public:
+	void Visit(GCodeStmt *stmt) {
+		Derived *self = static_cast<Derived *>(this);
+
+		switch (stmt->GetKind()) {
+			case ASSIGN_STMT: self->VisitAssign(*static_cast<GCodeAssign *>(stmt)); break;
+			case COMMAND_STMT: self->VisitCommand(*static_cast<GCodeCommand *>(stmt)); break;
+			case SUBCALL_STMT: self->VisitSubCall(*static_cast<GCodeSubCall *>(stmt)); break;
+		}
+	}
+
+	template <class Iterator>
+	void VisitAll(Iterator first, Iterator last) {
+		for (; first != last; first++)
+			Visit(*first);
+	}
+
+	void VisitAssign(GCodeAssign &) { }
+	void VisitCommand(GCodeCommand &) { }
+	void VisitSubCall(GCodeSubCall &) { }
+};
+
 #endif
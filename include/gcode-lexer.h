@@ -22,6 +22,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <chrono>
+#include "gcode-diagnostics.h"
 
 #ifdef _MSC_VER
 #include <io.h>
@@ -47,11 +49,14 @@ typedef long double Real;
 /* Common GCodes definitions */
 #define G00		_G(0)
 #define G01		_G(1)
+#define G02		_G(2)
+#define G03		_G(3)
 #define G20		_G(20)
 #define G21		_G(21)
 #define G38_2	__G(38, 2)
 #define G82		_G(82)
 #define G81		_G(81)
+#define M06		_M(6)
 
 #define GNOP			0x3FFF
 
@@ -64,6 +69,9 @@ typedef long double Real;
 #define TOK_RARGUMENT		(7 << 16)
 #define TOK_SARGUMENT		(8 << 16)
 #define TOK_TARGUMENT		(9 << 16)
+#define TOK_IARGUMENT		(10 << 16)
+#define TOK_JARGUMENT		(11 << 16)
+#define TOK_KARGUMENT		(12 << 16)
 #define TOK_LINENUMBER	(20 << 16)
 #define TOK_VAR			(21 << 16)
 #define TOK_OPEQ		(22 << 16)
@@ -88,9 +96,16 @@ typedef long double Real;
 class GCodeLexer
 {
 public:
-	GCodeLexer(int fhandle) { 
+	GCodeLexer(int fhandle, GDiagnostics *diagnostics) { 
 		m_fhandle = fhandle; 
+		m_diagnostics = diagnostics;
 		m_lineNumber = 1; 
+		m_bytesRead = 0;
+		m_readSeconds = 0;
+		m_lexSeconds = 0;
+		m_timedTokens = 0;
+		m_timing = false;
+		m_tokenStart = m_tokenEnd = m_previousTokenEnd = 0;
 		FillBuffer(1);
 		FillBuffer(2);
 		ptr = &buf1[0];
@@ -99,11 +114,55 @@ public:
 
 	Real GetRealValue() { return m_value.m_realValue; }
 	Real GetIntValue() { return m_value.m_intValue; }
-	string GetLexeme() { return m_tokenLexeme.str(); }
+	const string &GetLexeme() { return m_tokenLexeme; }
 	int GetLineNumber() { return m_lineNumber; }
-	int NextToken();
+	GDiagnostics &GetDiagnostics() { return *m_diagnostics; }
+	long GetBytesRead() { return m_bytesRead; }	//Read ahead, not lexed
+
+	/* Offset in the file of the next character to scan */
+	long long GetOffset() {
+		if (ptr >= &buf1[0] && ptr < &buf1[BUF_SIZE])
+			return m_bufferOffset[0] + (ptr - &buf1[0]);
+
+		return m_bufferOffset[1] + (ptr - &buf2[0]);
+	}
+
+	/* Where the last token scanned starts in the file, and where the one before it ends (see GCodeCommand::SetSource) */
+	long long GetTokenStart() { return m_tokenStart; }
+	long long GetPreviousTokenEnd() { return m_previousTokenEnd; }
+
+	/*
+	 * Time spent reading the file, and lexing the tokens scanned while the
+	 * timing is on (without the reads).  Timing every token costs about as
+	 * much as lexing it, LoadFile only does it for a sample of the statements.
+	 */
+	double GetReadSeconds() { return m_readSeconds; }
+	double GetLexSeconds() { return m_lexSeconds; }
+	unsigned long GetTimedTokens() { return m_timedTokens; }
+	void SetTiming(bool timing) { m_timing = timing; }
+
+	int NextToken() {
+		int token;
+
+		m_previousTokenEnd = m_tokenEnd;
+
+		if (!m_timing)
+			token = ScanToken();
+		else {
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			double readSeconds = m_readSeconds;
+
+			token = ScanToken();
+			m_lexSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count() - (m_readSeconds - readSeconds);
+			m_timedTokens++;
+		}
+
+		m_tokenEnd = GetOffset();
+		return token;
+	}
 
 private:
+	int ScanToken();
 	string ParseInt();
 	Real ParseReal();
 
@@ -111,7 +170,16 @@ private:
 		int bytes_read;
 
 		char *bptr = (buffNumber == 1)? &buf1[0] : &buf2[0];
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+		/* The buffers are filled in turns, each one follows the other in the file */
+		m_bufferOffset[buffNumber - 1] = m_bytesRead;
+
 		bytes_read = read(m_fhandle, bptr, BUF_SIZE);
+		m_readSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if (bytes_read > 0)
+			m_bytesRead += bytes_read;
 
 		if (bytes_read < BUF_SIZE)
 			bptr[bytes_read] = EOF;
@@ -152,7 +220,7 @@ private:
 			ptr--;
 	};
 
-	stringstream m_tokenLexeme;
+	string m_tokenLexeme;
 	
 	union {
 		int m_intValue;
@@ -164,7 +232,17 @@ private:
 	char *ptr;
 	bool fillInactiveBuffer;
 	int m_lineNumber;
+	long m_bytesRead;
+	long long m_bufferOffset[2];	//In the file, of buf1 and buf2
+	long long m_tokenStart;
+	long long m_tokenEnd;
+	long long m_previousTokenEnd;
+	double m_readSeconds;
+	double m_lexSeconds;
+	unsigned long m_timedTokens;
+	bool m_timing;
 	char m_currentCh;
+	GDiagnostics *m_diagnostics;	//Of the file being read
 	int m_fhandle; //ifstream is slow for file access, maybe later I'll try memory mapped files
 };
 
@@ -28,6 +28,9 @@ using namespace std;
 /* Supported measurement units */
 #define UNIT_INCHES     0
 #define UNIT_MM         1
+#define UNIT_FILE       -1  //No conversion, see GCodeInt::SetCanonicalUnits
+
+#define MM_PER_INCH     25.4
 
 class GCodeLexer;
 
@@ -35,7 +38,7 @@ class GCodeLexer;
 class GCodeParser
 {
 public:
-    GCodeParser(GCodeLexer *lexer) { m_lexer = lexer; m_lastCommand = GNOP; }
+    GCodeParser(GCodeLexer *lexer, GExprPool *pool) { m_lexer = lexer; m_pool = pool; m_lastCommand = GNOP; }
     ~GCodeParser() { }
 	bool ParseAll(list<GCodeStmt *> &slist);
 	void Init() { m_currentToken = m_lexer->NextToken(); SkipEOL(); }
@@ -60,6 +63,7 @@ private:
 
 	/* Member fields */
 	GCodeLexer *m_lexer;
+	GExprPool *m_pool;		//Expressions are created here
 	int m_currentToken;
     int m_lastCommand;
 };
@@ -0,0 +1,57 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODE_STATS_H
+#define GCODE_STATS_H
+#include <map>
+#include "gcode-int.h"
+
+using namespace std;
+
+/* Points reduced by a task at least, smaller trajectories are done in the calling thread */
+#define STATS_MIN_POINTS_PER_TASK       (64 * 1024)
+
+/*
+ * Statistics of a range of trajectory points
+ *
+ * Add goes over the points in order and can be called again with the points
+ * that follow.  Ranges computed apart (e.g. by different tasks) are joined
+ * with Merge, in the order of the trajectory.  The feed histogram is
+ * accumulated in runs of the same feed, the map is only touched when the
+ * feed changes.
+ */
+struct GMotionStats
+{
+    /* Moves below Z 0 (arcs with their bounds), drills and probe points */
+    Real BoardMinX, BoardMinY, BoardMaxX, BoardMaxY;
+    Real RouteDepth;                    //Z of the last move below 0
+    bool HasRouteDepth;
+    Real MinZ, MaxZ;
+    Real CutLength, RapidLength;
+    unsigned long Count[SEG_PROBE + 1]; //By GSegmentKind
+    map<float, Real> FeedLength;        //Cut length at every feed rate
+
+    GMotionStats() { Clear(); }
+
+    void Clear();
+    void Add(const GTrajectory &trajectory, size_t first, size_t last);
+    void Merge(const GMotionStats &next);   //'next' comes after the points of this one
+    void Store(GCodeInfo &gi) const;
+};
+
+/* Statistics of the whole trajectory, split in 'tasks' tasks (0 for one per thread of the GTaskScheduler) */
+void ComputeMotionStats(const GTrajectory &trajectory, GMotionStats &stats, unsigned int tasks = 0);
+
+#endif
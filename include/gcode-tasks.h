@@ -0,0 +1,153 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODE_TASKS_H
+#define GCODE_TASKS_H
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+
+/* Threads of the scheduler at most */
+#define TASK_MAX_THREADS    256
+
+/* The queued tasks of a priority go ahead of those of the priorities after it */
+enum GTaskPriority
+{
+    TASK_INTERACTIVE,   //Rendering, the user is waiting
+    TASK_NORMAL,
+    TASK_BATCH,         //Whole files of a batch
+    TASK_PRIORITY_COUNT
+};
+
+/* Set from any thread, the tasks that didn't start yet are dropped and the running ones can poll it */
+class GCancelToken
+{
+public:
+    GCancelToken() { m_cancelled = false; }
+
+    void Cancel() { m_cancelled = true; }
+    void Reset() { m_cancelled = false; }
+    bool IsCancelled() const { return m_cancelled; }
+
+private:
+    atomic<bool> m_cancelled;
+};
+
+class GTaskGroup;
+
+/* Work of a group, run once by any thread */
+struct GTask
+{
+    function<void()> work;
+    GTaskGroup *group;
+};
+
+/*
+ * Tasks waited for together
+ *
+ * The tasks run at the priority of the group, by default the priority of the
+ * task that creates it (TASK_NORMAL out of the scheduler), so the work split
+ * by a batch task stays batch work.  Wait runs the queued tasks of the group
+ * in the calling thread, so a group can be waited for from within a task and
+ * everything still runs when the scheduler has no workers.
+ */
+class GTaskGroup
+{
+public:
+    GTaskGroup(GCancelToken *token = NULL);
+    GTaskGroup(GTaskPriority priority, GCancelToken *token = NULL);
+    ~GTaskGroup() { Wait(); }
+
+    void Run(const function<void()> &work);
+    void Wait();
+
+    bool IsCancelled() { return m_token != NULL && m_token->IsCancelled(); }
+    GTaskPriority GetPriority() { return m_priority; }
+
+private:
+    friend class GTaskScheduler;
+
+    GTaskPriority m_priority;
+    GCancelToken *m_token;
+    atomic<unsigned int> m_pending;     //Tasks run but not finished
+};
+
+/*
+ * Work-stealing task scheduler, one for the process
+ *
+ * Load, split and render share its threads instead of starting their own, so
+ * the CPU-bound work never has more threads than cores.  The caller of
+ * GTaskGroup::Wait works too, there is one worker less than threads.  Every
+ * worker has a deque per priority: it takes the last task it queued (the
+ * data is still in its cache) and the idle workers steal the oldest ones of
+ * the others.  The tasks queued by the threads out of the scheduler (GUI,
+ * loaders) are shared by all of them.
+ */
+class GTaskScheduler
+{
+public:
+    static GTaskScheduler &Get();
+
+    /* Threads of the scheduler, 0 for one per core, TASK_MAX_THREADS at most.  Only before the first Get */
+    static void SetThreadCount(unsigned int threads);
+
+    /* Threads working on the tasks, the waiting one included */
+    unsigned int GetThreadCount() { return m_workers.size() + 1; }
+
+    /*
+     * Parts worth splitting 'size' items in, at most one per thread and
+     * 'minPerTask' items each at least (0 for as many as the threads)
+     */
+    unsigned int GetTaskCount(size_t size, size_t minPerTask, unsigned int tasks = 0);
+
+    /* Priority of the task running in the calling thread, TASK_NORMAL out of a task */
+    static GTaskPriority GetCurrentPriority();
+
+private:
+    friend class GTaskGroup;
+
+    struct Worker
+    {
+        mutex lock;
+        deque<GTask *> tasks[TASK_PRIORITY_COUNT];
+    };
+
+    GTaskScheduler(unsigned int threads);
+    ~GTaskScheduler();
+
+    void Submit(GTask *task);
+    GTask *Take(int self, GTaskGroup *group);
+    GTask *TakeFrom(Worker &worker, int priority, bool newest, GTaskGroup *group);
+    void Execute(GTask *task);
+    void Wait(GTaskGroup *group);
+    void WorkerLoop(int self);
+    void Signal();
+
+    vector<Worker *> m_workers;
+    Worker m_shared;                    //Queued by the threads out of the scheduler
+    vector<thread> m_threads;
+    mutex m_sleepLock;
+    condition_variable m_wake;
+    unsigned long m_generation;         //Changes when a task is queued or a group finishes
+    bool m_stop;
+};
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GCODE_TIMING_H
+#define GCODE_TIMING_H
+#include <chrono>
+
+using namespace std;
+
+/* Phases of the processing of a file */
+enum GPhase
+{
+    PHASE_READ,         //File reads
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_EVAL,         //Expressions, arguments and trajectory
+    PHASE_NORMALISE,    //Unit conversion
+    PHASE_STATS,
+    PHASE_ESTIMATE,
+    PHASE_SPLIT,        //Autoleveller
+    PHASE_EMIT,
+    PHASE_RENDER,
+    PHASE_COUNT
+};
+
+inline const char *GetPhaseName(int phase)
+{
+    static const char *names[PHASE_COUNT] = {
+        "read", "lex", "parse", "eval", "normalise", "stats", "estimate", "split", "emit", "render"
+    };
+
+    return names[phase];
+}
+
+/* Time spent by a file in every phase, and how many times the phase ran (e.g. frames rendered) */
+struct GPhaseTimes
+{
+    double Seconds[PHASE_COUNT];
+    unsigned long Runs[PHASE_COUNT];
+
+    GPhaseTimes() { Clear(); }
+
+    void Clear() {
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            Seconds[phase] = 0;
+            Runs[phase] = 0;
+        }
+    }
+
+    void Add(int phase, double seconds) {
+        Seconds[phase] += seconds;
+        Runs[phase]++;
+    }
+
+    double Total() const {
+        double total = 0;
+
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+            total += Seconds[phase];
+
+        return total;
+    }
+};
+
+/* Adds the time from its construction to its destruction to a phase */
+class GPhaseTimer
+{
+public:
+    GPhaseTimer(GPhaseTimes &times, int phase): m_times(times) {
+        m_phase = phase;
+        m_start = chrono::steady_clock::now();
+    }
+
+    ~GPhaseTimer() {
+        m_times.Add(m_phase, GetSeconds());
+    }
+
+    double GetSeconds() {
+        return chrono::duration<double>(chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    GPhaseTimes &m_times;
+    int m_phase;
+    chrono::steady_clock::time_point m_start;
+};
+
+#endif
@@ -21,6 +21,9 @@
 #include <list>
 #include "gcode-int.h"
 
+class GCodeLoader;
+class GArcCache;
+
 struct GPlotterInfo
 {
 	GCodeInfo *ginfo; //Board Info
@@ -29,6 +32,7 @@ struct GPlotterInfo
 	double m_dpuY; // Dots per UNIT on Y axis
 	bool showProbePoints; 
 	bool showDrillSpots; 
+	GArcCache *arcCache; //Arc tessellations, shared by the copies of the GPlotterInfo
 };
 
 class QRenderArea : public QWidget
@@ -41,6 +45,10 @@ public:
 	void AddFileToPlot(GCodeInt *ginter);
 	void RemoveFileFromPlot(GCodeInt *ginter);
 
+	/* Geometry of a file still loading */
+	void AddPreviewToPlot(GCodeLoader *loader);
+	void RemovePreviewFromPlot(GCodeLoader *loader);
+
 	void SetShowProbePoints(GCodeInt *ginter, bool showProbePoints) {
 		int index;
 		GPlotterInfo &gp = GetPlotInfo(ginter, index);
@@ -79,10 +87,14 @@ protected:
 	void mouseReleaseEvent(QMouseEvent *e);
 	void wheelEvent(QWheelEvent *e);
 	void PlotGCode(QPainter &painter, GPlotterInfo &gp);
+	void PlotTrajectory(QPainter &painter, const GTrajectory &trajectory, GArcCache &arcCache, double s_dpuX, double s_dpuY, bool showDrillSpots);
+	void PlotPreview(QPainter &painter, GCodeLoader *loader);
 	GPlotterInfo &GetPlotInfo(GCodeInt *ginter, int &index);
+	void GetDotsPerUnit(double &dpuX, double &dpuY);
 
 public slots:
 		void ZoomToFit();
+		void PreviewUpdated();
 
 private:
 	bool dragStarted;
@@ -90,6 +102,8 @@ private:
 	double m_scale;
 	int m_originX, m_originY;
 	QList<GPlotterInfo> m_listPlot; //File list to plot in the render area
+	QList<GCodeLoader *> m_listPreview; //Files being loaded
+	GCodeInfo m_previewInfo; //Board info of the preview when there is nothing else to plot
 	GPlotterInfo m_currPlot;
 };
 
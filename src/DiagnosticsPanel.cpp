@@ -0,0 +1,68 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QHeaderView>
+#include <QFileInfo>
+#include <QStringList>
+#include "DiagnosticsPanel.h"
+
+DiagnosticsPanel::DiagnosticsPanel(QWidget *parent)
+    : QDockWidget(tr("Diagnostics"), parent)
+{
+    QStringList headers;
+
+    headers << tr("File");
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+        headers << QString(GetPhaseName(phase)) + ((phase == PHASE_RENDER)? " (ms/frame)" : " (ms)");
+    headers << tr("total (ms)");
+
+    m_table = new QTableWidget(0, headers.size(), this);
+    m_table->setHorizontalHeaderLabels(headers);
+    m_table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    m_table->verticalHeader()->hide();
+
+    setObjectName("diagnosticsPanel");
+    setWidget(m_table);
+}
+
+void DiagnosticsPanel::Update(const QList<GCodeInt *> &files)
+{
+    m_table->setRowCount(files.size());
+
+    for (int row = 0; row < files.size(); row++) {
+        GPhaseTimes &times = files[row]->GetPhaseTimes();
+        QString filePath = QString::fromStdString(files[row]->GetFilePath());
+        QTableWidgetItem *item = new QTableWidgetItem(QFileInfo(filePath).fileName());
+
+        item->setToolTip(filePath);
+        m_table->setItem(row, 0, item);
+
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            double ms = times.Seconds[phase] * 1000;
+
+            if (phase == PHASE_RENDER && times.Runs[phase] != 0)
+                ms /= times.Runs[phase];
+
+            item = new QTableWidgetItem(QString::number(ms, 'f', 1));
+            item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+            m_table->setItem(row, phase + 1, item);
+        }
+
+        /* The frames are drawn again and again, they aren't part of the processing of the file */
+        item = new QTableWidgetItem(QString::number((times.Total() - times.Seconds[PHASE_RENDER]) * 1000, 'f', 1));
+        item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+        m_table->setItem(row, PHASE_COUNT + 1, item);
+    }
+}
@@ -40,8 +40,10 @@ DialogAutolevel::DialogAutolevel(QWidget *parent, GCodeInt *gi):
     ui->pb1->setRange(0, 100);
     ui->pb1->setValue(0);
 
-	double boardWidth = ginfo->BoardMaxX - ginfo->BoardMinX;
-	double boardHeight = ginfo->BoardMaxY - ginfo->BoardMinY;
+	/* The autoleveller works in the units of the program, the board area can be normalised */
+	double boardWidth = (ginfo->BoardMaxX - ginfo->BoardMinX) / ginfo->UnitScale;
+	double boardHeight = (ginfo->BoardMaxY - ginfo->BoardMinY) / ginfo->UnitScale;
+	double engravingDepth = ginfo->MillRouteDepth / ginfo->UnitScale;
 	QString boardSize = QString::number(boardWidth) + " x " + QString::number(boardHeight);
 
     QString strIFilePath = QString::fromStdString(gi->GetFilePath());
@@ -55,11 +57,11 @@ DialogAutolevel::DialogAutolevel(QWidget *parent, GCodeInt *gi):
 
     ui->txtOutputFile->setText(outputFilePath);
 
-    if (ginfo->UnitType == UNIT_INCHES) {
+    if (ginfo->SourceUnitType == UNIT_INCHES) {
         ui->rbInches->setChecked(true);
 
         ui->txtGridSize->setValue(0.2);
-        ui->txtEngDepth->setValue(ginfo->MillRouteDepth);
+        ui->txtEngDepth->setValue(engravingDepth);
         ui->txtMaxDepth->setValue(-0.039);
         ui->txtTraverseHeight->setValue(0.02);
         ui->txtTraverseSpeed->setValue(15.7);
@@ -71,7 +73,7 @@ DialogAutolevel::DialogAutolevel(QWidget *parent, GCodeInt *gi):
         ui->rbMM->setChecked(true);
 
         ui->txtGridSize->setValue(5.0);
-        ui->txtEngDepth->setValue(ginfo->MillRouteDepth);
+        ui->txtEngDepth->setValue(engravingDepth);
         ui->txtMaxDepth->setValue(-1.0);
         ui->txtTraverseHeight->setValue(0.5);
         ui->txtTraverseSpeed->setValue(400);
@@ -120,7 +122,12 @@ void DialogAutolevel::pbAutolevelClicked()
      ui->pb1->setMaximum(gal->GetOutputSize() - 1);
      ui->pb1->setValue(0);
 
-     gal->GenerateAutolevellingGCode(outFileName.toStdString().c_str(), this);
+     GDiagnostics diagnostics;
+
+     if (!gal->GenerateAutolevellingGCode(outFileName.toStdString().c_str(), diagnostics, this)) {
+         QMessageBox::critical(this, "Error", QString::fromStdString(diagnostics.GetText()), QMessageBox::Ok);
+         return;
+     }
 
      QMessageBox::information(this, "Information", "File Generated Successfully !!", QMessageBox::Ok);
 }
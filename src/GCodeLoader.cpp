@@ -0,0 +1,150 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QMutexLocker>
+#include <QFileInfo>
+#include <sstream>
+#include "GCodeLoader.h"
+#include "gcode-estimator.h"
+
+using namespace std;
+
+void GCodeLoadAdmission::Acquire(qint64 bytes, GCodeInt *ginter)
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (m_inUse > 0 && m_inUse + bytes > m_budget && !ginter->IsCancelled())
+        m_released.wait(&m_mutex);
+
+    m_inUse += bytes;
+}
+
+void GCodeLoadAdmission::Release(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_inUse -= bytes;
+    m_released.wakeAll();
+}
+
+void GCodeLoadAdmission::WakeAll()
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_released.wakeAll();
+}
+
+qint64 GCodeLoadAdmission::DefaultBudget()
+{
+    long long memory = GetPhysicalMemory();
+
+    return (memory > 0)? memory / 2 : (qint64)1 << 30;
+}
+
+GCodeLoader::GCodeLoader(QString filePath, GCodeLoadAdmission *admission, QObject *parent)
+    : QObject(parent)
+{
+    m_filePath = filePath;
+    m_ginter = new GCodeInt(filePath.toStdString());
+    m_ginter->SetCanonicalUnits(UNIT_MM);   //Every file is drawn at the same scale
+    m_admission = admission;
+    m_loaded = false;
+
+    /* The owner deletes the loader when it's finished */
+    setAutoDelete(false);
+}
+
+GCodeLoader::~GCodeLoader()
+{
+    if (m_ginter != NULL)
+        delete m_ginter;
+}
+
+void GCodeLoader::Cancel()
+{
+    if (m_ginter == NULL)
+        return;
+
+    m_ginter->Cancel();
+
+    /* It could be waiting to be admitted */
+    if (m_admission != NULL)
+        m_admission->WakeAll();
+}
+
+GCodeInt *GCodeLoader::TakeInterpreter()
+{
+    GCodeInt *ginter = m_ginter;
+
+    m_ginter = NULL;
+
+    return ginter;
+}
+
+void GCodeLoader::run()
+{
+    qint64 memory = QFileInfo(m_filePath).size() * LOAD_MEMORY_PER_FILE_BYTE;
+    GDiagnostics diagnostics;
+
+    if (m_admission != NULL)
+        m_admission->Acquire(memory, m_ginter);
+
+    m_loaded = m_ginter->LoadFile(diagnostics, this);
+
+    if (m_admission != NULL)
+        m_admission->Release(memory);
+
+    /* Still in the worker thread, it's quick but it goes over the whole trajectory */
+    if (m_loaded) {
+        GCodeTimeEstimator estimator(m_ginter);
+
+        estimator.Estimate(m_timeEstimate);
+    }
+
+    if (!m_loaded)
+        m_errorMessage = QString::fromStdString(diagnostics.GetText());
+
+    emit finished();
+}
+
+/* Called by LoadFile in the worker thread, the trajectory doesn't change meanwhile */
+void GCodeLoader::UpdateProgress(long position, long size)
+{
+    const GTrajectory &trajectory = m_ginter->GetTrajectory();
+    const GCodeInfo &gi = *m_ginter->GetGCodeInfo();
+    size_t first = m_preview.Size();
+
+    /* In mm like the loaded files, LoadFile only converts the trajectory at the end */
+    {
+        QMutexLocker locker(&m_previewMutex);
+
+        m_preview.Append(trajectory, first);
+        m_preview.Scale(m_ginter->GetUnitScale(gi.UnitType), first);
+    }
+
+    /* The board area of the preview, LoadFile only computes it at the end.  Only this thread changes the preview */
+    m_previewStats.Add(m_preview, first, m_preview.Size());
+
+    {
+        QMutexLocker locker(&m_previewMutex);
+
+        m_previewInfo = gi;
+        m_previewInfo.UnitType = UNIT_MM;
+        m_previewStats.Store(m_previewInfo);
+    }
+
+    emit progress((size == 0)? 1000 : (int)(position * 1000 / size));
+    emit previewUpdated();
+}
@@ -14,30 +14,176 @@
  */
 
 #include <QFileDialog>
+#include <QFileInfo>
 #include <QMessageBox>
+#include <QInputDialog>
+#include <QDragEnterEvent>
+#include <QDropEvent>
+#include <QMimeData>
+#include <QUrl>
 #include <QString>
 #include <QLabel>
+#include <QThread>
 #include <string>
 #include <sstream>
 #include "gcode-int.h"
+#include "gcode-estimator.h"
+#include "gcode-export.h"
+#include "gcode-tasks.h"
 #include "MCBGenerator.h"
 #include "DialogAutolevel.h"
 #include "DialogGerber2GCode.h"
+#include "GCodeLoader.h"
+#include "DiagnosticsPanel.h"
 
 using namespace std;
 
-extern stringstream out_err;
+static inline QString MegaBytes(size_t bytes)
+{
+    return QString::number(bytes / (1024.0 * 1024.0), 'f', 1);
+}
+
+static QString DurationText(double seconds)
+{
+    int s = qRound(seconds);
+
+    return QString("%1:%2:%3").arg(s / 3600).arg((s / 60) % 60, 2, 10, QChar('0')).arg(s % 60, 2, 10, QChar('0'));
+}
+
+static QString TimeEstimateText(const GTimeEstimate &estimate)
+{
+    QString text = "Machining time " + DurationText(estimate.Total) +
+                   " (rapids " + DurationText(estimate.Rapid) +
+                   ", cutting " + DurationText(estimate.Cutting) +
+                   ", drilling " + DurationText(estimate.Drilling);
+
+    if (estimate.Probing != 0)
+        text += ", probing " + DurationText(estimate.Probing);
+
+    if (estimate.ToolChanges != 0)
+        text += ", tool changes " + DurationText(estimate.ToolChanges);
+
+    text += ")";
+
+    /* Only worth it with more than one tool */
+    if (estimate.ToolTime.size() > 1) {
+        for (map<int, double>::const_iterator it = estimate.ToolTime.begin(); it != estimate.ToolTime.end(); it++)
+            text += "\n    T" + QString::number(it->first) + ": " + DurationText(it->second);
+    }
+
+    return text;
+}
+
+static QString MotionStatsText(const GCodeInfo &gi)
+{
+    QString units = " mm";   //The files are loaded in mm, see GCodeLoader
+    QString text = "Cut length " + QString::number((double)gi.CutLength, 'f', 1) + units +
+                   ", rapids " + QString::number((double)gi.RapidLength, 'f', 1) + units +
+                   ", Z " + QString::number((double)gi.MinZ, 'f', 3) + " to " + QString::number((double)gi.MaxZ, 'f', 3) + "\n" +
+                   "Moves: " + QString::number(gi.RapidCount) + " rapids, " + QString::number(gi.CutCount) + " cuts, " +
+                   QString::number(gi.ArcCount) + " arcs, " + QString::number(gi.DrillCount) + " drills";
+
+    if (gi.ProbeCount != 0)
+        text += ", " + QString::number(gi.ProbeCount) + " probes";
+
+    for (map<float, Real>::const_iterator it = gi.FeedHistogram.begin(); it != gi.FeedHistogram.end(); it++)
+        text += "\n    F" + QString::number(it->first) + ": " + QString::number((double)it->second, 'f', 1) + units;
+
+    return text;
+}
+
+static QString FileToolTipText(const QString &filePath, const GCodeInfo &gi, const GTimeEstimate &estimate)
+{
+    double dedupRatio = (gi.UniqueExprCount == 0)? 1.0 : (double)gi.ExprCount / gi.UniqueExprCount;
+
+    return filePath + "\n" +
+           "Loaded in " + QString::number(gi.LoadTime) + "ms, " +
+           "expressions: " + QString::number(gi.ExprCount) + " (" + QString::number(gi.UniqueExprCount) + " stored, " +
+           "dedup ratio " + QString::number(dedupRatio, 'f', 2) + ")\n" +
+           MotionStatsText(gi) + "\n" +
+           TimeEstimateText(estimate);
+}
+
+static QString MemoryUsageText(const GCodeMemoryUsage &usage)
+{
+    QString text = "Memory " + MegaBytes(usage.Total()) + " MB (statements " + MegaBytes(usage.Statements) +
+                   ", expressions " + MegaBytes(usage.Expressions) +
+                   ", arguments " + MegaBytes(usage.Arguments) +
+                   ", strings " + MegaBytes(usage.Strings + usage.Parameters) +
+                   ", probe points " + MegaBytes(usage.ProbePoints) +
+                   ", trajectory " + MegaBytes(usage.Trajectory);
+
+    if (usage.Autoleveller != 0)
+        text += ", autoleveller " + MegaBytes(usage.Autoleveller);
+
+    return text + ")";
+}
 
 PCBMillingGenerator::PCBMillingGenerator(QWidget *parent, Qt::WFlags flags)
 	: QMainWindow(parent, flags)
 {
+    int cores = qMax(1, QThread::idealThreadCount());
+    int loaders = qMin(LOAD_THREADS, cores);
+
+    /*
+     * A loader counts as the thread waiting for its tasks, with the workers of
+     * the scheduler there is a thread per core.  Before the first render uses it.
+     */
+    m_loadPool.setMaxThreadCount(loaders);
+    GTaskScheduler::SetThreadCount(qMax(1, cores - loaders + 1));
+
 	ui.setupUi(this);
     statusLabel = new QLabel("");
     ui.statusBar->addWidget(statusLabel);
+    setAcceptDrops(true);
+
+    m_loadAdmission = new GCodeLoadAdmission(GCodeLoadAdmission::DefaultBudget());
+
+    m_diagnostics = new DiagnosticsPanel(this);
+    m_diagnostics->hide();
+    addDockWidget(Qt::BottomDockWidgetArea, m_diagnostics);
+
+    QMenu *viewMenu = new QMenu(tr("View"), ui.menuBar);
+
+    viewMenu->addAction(m_diagnostics->toggleViewAction());
+    ui.menuBar->insertMenu(ui.menuHelp->menuAction(), viewMenu);
+
+    /* The render times change with every frame, the panel is refreshed while it's shown */
+    connect(&m_diagnosticsTimer, SIGNAL(timeout()), this, SLOT(UpdateDiagnostics()));
+    m_diagnosticsTimer.start(DIAGNOSTICS_REFRESH_MS);
 }
 
 PCBMillingGenerator::~PCBMillingGenerator()
 {
+	QList<GCodeLoader *> loaders = m_loading.keys();
+
+	for (int i = 0; i < loaders.size(); i++)
+		loaders[i]->Cancel();
+
+	m_loadPool.waitForDone();
+
+	for (int i = 0; i < loaders.size(); i++)
+		delete loaders[i];
+
+	delete m_loadAdmission;
+}
+
+void PCBMillingGenerator::UpdateDiagnostics()
+{
+	if (!m_diagnostics->isVisible())
+		return;
+
+	QList<GCodeInt *> files;
+
+	for (int i = 0; i < ui.lstFile->count(); i++) {
+		GCodeInt *ginter = (GCodeInt *)ui.lstFile->item(i)->data(Qt::UserRole).value<void *>();
+
+		/* Still loading */
+		if (ginter != NULL)
+			files.append(ginter);
+	}
+
+	m_diagnostics->Update(files);
 }
 
 void PCBMillingGenerator::ListFileItemChanged(QListWidgetItem *item)
@@ -63,7 +209,7 @@ void PCBMillingGenerator::ListFileItemSelectionChanged()
         return;
 
     QString filePath = QString::fromStdString(ginter->GetFilePath());
-    statusLabel->setText(filePath);
+    statusLabel->setText(filePath + "    " + MemoryUsageText(ginter->GetMemoryUsage()));
 }
 
 void PCBMillingGenerator::ShowContextMenuForListFile(const QPoint &pos)
@@ -79,13 +225,20 @@ void PCBMillingGenerator::ShowContextMenuForListFile(const QPoint &pos)
 	bool showPP = false;
 	bool showDP = false;
 
+	QMenu contextMenu(tr("List File Context Menu"), this);
+
+	/* Still loading, it can only be cancelled */
+	if (ginter == NULL) {
+		contextMenu.addAction(ui.actionClose_File);
+		contextMenu.exec(ui.lstFile->mapToGlobal(pos));
+		return;
+	}
+
 	if (itemIsChecked) {
 		showPP = ui.renderArea->GetShowProbePointsStatus(ginter);
 		showDP = ui.renderArea->GetShowDrillSpotsStatus(ginter);
 	}
 
-	QMenu contextMenu(tr("List File Context Menu"), this);
-
 	if (!ginter->HasProbePoints()) {
 		QAction *actionAddPP = new QAction(tr("Add Autolevel GCODE"), this);
 		connect(actionAddPP, SIGNAL(triggered()), this, SLOT(OnAddAutolevelGcodeTriggered()));
@@ -93,6 +246,16 @@ void PCBMillingGenerator::ShowContextMenuForListFile(const QPoint &pos)
 		contextMenu.addAction(actionAddPP);
 	}
 
+	QAction *actionSetParameter = new QAction(tr("Set Parameter..."), this);
+	connect(actionSetParameter, SIGNAL(triggered()), this, SLOT(OnSetParameterTriggered()));
+
+	contextMenu.addAction(actionSetParameter);
+
+	QAction *actionExport = new QAction(tr("Export Trajectory..."), this);
+	connect(actionExport, SIGNAL(triggered()), this, SLOT(OnExportTrajectoryTriggered()));
+
+	contextMenu.addAction(actionExport);
+
 	if (itemIsChecked && ginter->HasProbePoints()) {
 		QAction *actionShowPP = new QAction(tr("Probe Points"), this);
 		actionShowPP->setCheckable(true);
@@ -121,9 +284,85 @@ void PCBMillingGenerator::OnAddAutolevelGcodeTriggered()
 {
     GCodeInt *ginter = GetSelectedListFileItem();
 
+    if (ginter == NULL)
+        return;
+
     DialogAutolevel *dlg = new DialogAutolevel(this, ginter);
 
     dlg->exec();
+
+    /* The autoleveller keeps the whole split output, release it */
+    delete dlg;
+    ListFileItemSelectionChanged();
+}
+
+/* The columns are written next to the name chosen, board.npy gives board.x.npy, board.y.npy... */
+void PCBMillingGenerator::OnExportTrajectoryTriggered()
+{
+    GCodeInt *ginter = GetSelectedListFileItem();
+
+    if (ginter == NULL)
+        return;
+
+    QFileInfo fileInfo(QString::fromStdString(ginter->GetFilePath()));
+    QString fileName = QFileDialog::getSaveFileName(this,
+                                tr("Export Trajectory"),
+                                fileInfo.absolutePath() + "/" + fileInfo.completeBaseName() + ".npy",
+                                tr("NumPy Files (*.npy)"));
+
+    if (fileName.isEmpty())
+        return;
+
+    if (fileName.endsWith(".npy", Qt::CaseInsensitive))
+        fileName.chop(4);
+
+    GDiagnostics diagnostics;
+
+    if (!ExportTrajectory(ginter, fileName.toStdString() + ".", diagnostics))
+        QMessageBox::critical(this, "Error", QString::fromStdString(diagnostics.GetText()), QMessageBox::Ok);
+    else
+        statusLabel->setText(tr("Trajectory exported to %1.*.npy").arg(fileName));
+}
+
+/* What-if change of a parameter, e.g. "#3 = -0.2" for a deeper engraving, without loading the file again */
+void PCBMillingGenerator::OnSetParameterTriggered()
+{
+    GCodeInt *ginter = GetSelectedListFileItem();
+
+    if (ginter == NULL)
+        return;
+
+    bool ok;
+    QString text = QInputDialog::getText(this, tr("Set Parameter"), tr("Parameter = value:"), QLineEdit::Normal, "#3 = ", &ok);
+    int equal = text.indexOf('=');
+
+    if (!ok || text.isEmpty())
+        return;
+
+    QString name = text.left(equal).trimmed();
+    double value = text.mid(equal + 1).trimmed().toDouble(&ok);
+
+    if (equal <= 0 || name.isEmpty() || !ok) {
+        QMessageBox::critical(this, "Error", tr("%1 is not parameter = value").arg(text), QMessageBox::Ok);
+        return;
+    }
+
+    GDiagnostics diagnostics;
+
+    if (!ginter->SetParameter(name.toStdString(), value, diagnostics)) {
+        QMessageBox::critical(this, "Error", QString::fromStdString(diagnostics.GetText()), QMessageBox::Ok);
+        return;
+    }
+
+    GCodeTimeEstimator estimator(ginter);
+    GTimeEstimate estimate;
+
+    estimator.Estimate(estimate);
+
+    ui.lstFile->selectedItems().first()->setData(Qt::ToolTipRole,
+            FileToolTipText(QString::fromStdString(ginter->GetFilePath()), *ginter->GetGCodeInfo(), estimate));
+    ui.renderArea->update();
+    statusLabel->setText(tr("%1 set to %2").arg(name).arg(value));
 }
 
 void PCBMillingGenerator::OnShowProbePointsTriggered(bool checked)
@@ -133,6 +372,9 @@ void PCBMillingGenerator::OnShowProbePointsTriggered(bool checked)
 
 	GCodeInt *ginter = GetSelectedListFileItem();
 
+	if (ginter == NULL)
+		return;
+
 	ui.renderArea->SetShowProbePoints(ginter, checked);		
 }
 
@@ -145,6 +387,9 @@ void PCBMillingGenerator::OnShowDrillSpotsTriggered(bool checked)
 	QVariant v = item->data(Qt::UserRole);
 	GCodeInt *ginter = (GCodeInt *)v.value<void *>();
 
+	if (ginter == NULL)
+		return;
+
 	ui.renderArea->SetShowDrillSpots(ginter, checked);		
 }
 
@@ -159,50 +404,134 @@ void PCBMillingGenerator::CloseSelectedFile()
 	QVariant v = item->data(Qt::UserRole);
 	GCodeInt *ginter = (GCodeInt *)v.value<void *>();
 
+	/* Still loading, the item is removed when the loader finishes */
+	if (ginter == NULL) {
+		GCodeLoader *loader = m_loading.key(item, NULL);
+
+		if (loader != NULL)
+			loader->Cancel();
+		return;
+	}
+
 	ui.renderArea->RemoveFileFromPlot(ginter);
 	ui.lstFile->model()->removeRow(selectedItems.at(0).row());
 
 	delete ginter;
 }
 
-void PCBMillingGenerator::LoadGCodeFile(QString filePath)
+/*
+ * The files are loaded by the thread pool, their geometry is shown as it's read.
+ * The items are added to the file list right away, in the order of the files,
+ * and show the progress until the file is loaded.
+ */
+void PCBMillingGenerator::LoadGCodeFiles(QStringList filePaths)
 {
-	string filp = filePath.toStdString();
-	GCodeInt *ginter = new GCodeInt(filp);
+	for (int i = 0; i < filePaths.size(); i++) {
+		QString filePath = filePaths[i];
+		GCodeLoader *loader = new GCodeLoader(filePath, m_loadAdmission, this);
+		QListWidgetItem *item = new QListWidgetItem(QFileInfo(filePath).fileName() + " (waiting)", ui.lstFile);
 
-	if ( !ginter->LoadFile() ) {
-		string msg = out_err.str();
-		
-		QMessageBox::critical( this, "Error loading GCODE file", QString::fromStdString(msg) );
-		delete ginter;
+		item->setData(Qt::ToolTipRole, filePath);
+		item->setData(Qt::UserRole, qVariantFromValue((void *)NULL));
+		item->setForeground(Qt::gray);
 
-	} else {
-		QFileInfo fileInfo(filePath);
+		connect(loader, SIGNAL(progress(int)), this, SLOT(FileLoadProgress(int)));
+		connect(loader, SIGNAL(finished()), this, SLOT(FileLoaded()));
 
-		QListWidgetItem *item = new QListWidgetItem(fileInfo.fileName(), ui.lstFile);
-		item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+		m_loading.insert(loader, item);
+		ui.renderArea->AddPreviewToPlot(loader);
+		m_loadPool.start(loader);
+	}
+}
 
-		item->setData(Qt::ToolTipRole, filePath);
-		QVariant v = qVariantFromValue((void *)ginter);
-		item->setData(Qt::UserRole, v);
-		 
-		item->setCheckState(Qt::Checked);
-		ui.lstFile->addItem(item);
+void PCBMillingGenerator::FileLoadProgress(int permille)
+{
+	GCodeLoader *loader = qobject_cast<GCodeLoader *>(sender());
+
+	if (loader == NULL || !m_loading.contains(loader))
+		return;
+
+	QListWidgetItem *item = m_loading.value(loader);
+
+	item->setText(QFileInfo(loader->GetFilePath()).fileName() + " (" + QString::number(permille / 10) + "%)");
+}
+
+void PCBMillingGenerator::FileLoaded()
+{
+	GCodeLoader *loader = qobject_cast<GCodeLoader *>(sender());
+
+	if (loader == NULL || !m_loading.contains(loader))
+		return;
+
+	QListWidgetItem *item = m_loading.take(loader);
+
+	ui.renderArea->RemovePreviewFromPlot(loader);
+
+	if (loader->IsLoaded())
+		AddLoadedFile(item, loader->GetFilePath(), loader->TakeInterpreter(), loader->GetTimeEstimate());
+	else {
+		delete item;
+
+		if (!loader->IsCancelled())
+			QMessageBox::critical( this, "Error loading GCODE file", loader->GetErrorMessage() );
 	}
+
+	/* Frees the interpreter of a failed load */
+	loader->deleteLater();
+}
+
+void PCBMillingGenerator::AddLoadedFile(QListWidgetItem *item, QString filePath, GCodeInt *ginter, const GTimeEstimate &estimate)
+{
+	GCodeInfo *gi = ginter->GetGCodeInfo();
+
+	item->setText(QFileInfo(filePath).fileName());
+	item->setForeground(ui.lstFile->palette().text());
+	item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+
+	item->setData(Qt::ToolTipRole, FileToolTipText(filePath, *gi, estimate));
+	QVariant v = qVariantFromValue((void *)ginter);
+	item->setData(Qt::UserRole, v);
+	 
+	/* Adds the file to the plot, see ListFileItemChanged */
+	item->setCheckState(Qt::Checked);
 }
 
 void PCBMillingGenerator::OpenGcodeFile()
 {
 	QFileDialog::Options options;
      QString selectedFilter;
-     QString fileName = QFileDialog::getOpenFileName(this,
-                                 tr("QFileDialog::getOpenFileName()"),
-                                 "Open GCODE File",
+     QStringList fileNames = QFileDialog::getOpenFileNames(this,
+                                 tr("Open GCODE Files"),
+                                 "",
                                  tr("GCode File (*.nc *.tap *.ngc);;All Files (*)"),
                                  &selectedFilter,
                                  options);
-     if (!fileName.isEmpty())
-		 LoadGCodeFile(fileName);
+     if (!fileNames.isEmpty())
+		 LoadGCodeFiles(fileNames);
+}
+
+void PCBMillingGenerator::dragEnterEvent(QDragEnterEvent *e)
+{
+	if (e->mimeData()->hasUrls())
+		e->acceptProposedAction();
+}
+
+void PCBMillingGenerator::dropEvent(QDropEvent *e)
+{
+	QList<QUrl> urls = e->mimeData()->urls();
+	QStringList filePaths;
+
+	for (int i = 0; i < urls.size(); i++) {
+		QString filePath = urls[i].toLocalFile();
+
+		if (!filePath.isEmpty())
+			filePaths.append(filePath);
+	}
+
+	if (!filePaths.isEmpty()) {
+		LoadGCodeFiles(filePaths);
+		e->acceptProposedAction();
+	}
 }
 
 void PCBMillingGenerator::ShowGerberToGCodeDialog()
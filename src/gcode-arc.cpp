@@ -0,0 +1,318 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include "gcode-arc.h"
+
+using namespace std;
+
+static const Real ARC_PI = 3.14159265358979323846264338327950288L;
+
+/* How much shorter than half the distance between the ends R can be */
+#define ARC_RADIUS_TOLERANCE    0.001
+
+static inline Real Radius(const GArc &arc, const Position &pos)
+{
+    Real dx = pos.x - arc.cx;
+    Real dy = pos.y - arc.cy;
+
+    return sqrt(dx * dx + dy * dy);
+}
+
+bool ComputeArc(GCodeCommand &cmd, const Position &start, const Position &end, GArc &arc)
+{
+    bool clockwise = cmd.IsA(G02);
+
+    if (cmd.HasArgument('R')) {
+        Real r = cmd.GetArgumentValue('R');
+        Real dx = end.x - start.x;
+        Real dy = end.y - start.y;
+        Real d = sqrt(dx * dx + dy * dy);
+
+        if (d == 0 || fabs(r) * 2 < d * (1 - ARC_RADIUS_TOLERANCE))
+            return false;
+
+        Real h2 = r * r - d * d / 4;
+        Real h = (h2 > 0)? sqrt(h2) : 0;
+
+        /* Under half a turn the center is on the left of the chord going counterclockwise, a negative R is over half a turn */
+        Real side = (clockwise? -1 : 1) * ((r < 0)? -1 : 1);
+
+        arc.cx = start.x + dx / 2 - side * h * dy / d;
+        arc.cy = start.y + dy / 2 + side * h * dx / d;
+    } else {
+        if (!cmd.HasArgument('I') && !cmd.HasArgument('J'))
+            return false;
+
+        arc.cx = start.x + cmd.GetArgumentValue('I');
+        arc.cy = start.y + cmd.GetArgumentValue('J');
+    }
+
+    if (Radius(arc, start) == 0)
+        return false;
+
+    Real a0 = atan2(start.y - arc.cy, start.x - arc.cx);
+    Real a1 = atan2(end.y - arc.cy, end.x - arc.cx);
+    Real sweep = a1 - a0;
+
+    /* The same start and end is a full circle */
+    if (clockwise) {
+        if (sweep >= 0)
+            sweep -= 2 * ARC_PI;
+    } else {
+        if (sweep <= 0)
+            sweep += 2 * ARC_PI;
+    }
+
+    /* P is the number of turns */
+    if (cmd.HasArgument('P')) {
+        int turns = (int)floor(cmd.GetArgumentValue('P') + 0.5);
+
+        if (turns > 1)
+            sweep += (clockwise? -1 : 1) * 2 * ARC_PI * (turns - 1);
+    }
+
+    arc.sweep = sweep;
+
+    return true;
+}
+
+void GetArcBounds(const GArc &arc, const Position &start, const Position &end,
+                  Real &minX, Real &minY, Real &maxX, Real &maxY)
+{
+    static const int dirX[4] = { 1, 0, -1, 0 };
+    static const int dirY[4] = { 0, 1, 0, -1 };
+    Real r = max(Radius(arc, start), Radius(arc, end));
+
+    minX = min(start.x, end.x);
+    minY = min(start.y, end.y);
+    maxX = max(start.x, end.x);
+    maxY = max(start.y, end.y);
+
+    /* The quadrant points the arc goes through */
+    Real a0 = atan2(start.y - arc.cy, start.x - arc.cx);
+    Real lo = min(a0, a0 + arc.sweep);
+    Real hi = max(a0, a0 + arc.sweep);
+    long first = (long)ceil(lo / (ARC_PI / 2));
+    long last = (long)floor(hi / (ARC_PI / 2));
+
+    if (last - first > 3)
+        last = first + 3;
+
+    for (long k = first; k <= last; k++) {
+        int quadrant = (int)(((k % 4) + 4) % 4);
+        Real x = arc.cx + r * dirX[quadrant];
+        Real y = arc.cy + r * dirY[quadrant];
+
+        minX = min(minX, x);
+        minY = min(minY, y);
+        maxX = max(maxX, x);
+        maxY = max(maxY, y);
+    }
+}
+
+int ArcSegmentCount(const GArc &arc, const Position &start, Real tolerance)
+{
+    Real r = Radius(arc, start);
+    Real turns = fabs(arc.sweep) / (2 * ARC_PI);
+    Real step = ARC_PI / 2;
+
+    /* The chord of an angle 'step' is 'r * (1 - cos(step / 2))' away from the arc */
+    if (tolerance < r)
+        step = min(step, 2 * acos(1 - tolerance / r));
+
+    Real count = ceil(fabs(arc.sweep) / step);
+    Real maxCount = ceil(turns * ARC_MAX_SEGMENTS_PER_TURN);
+
+    return (int)max((Real)1, min(count, maxCount));
+}
+
+void TessellateArc(const GArc &arc, const Position &start, const Position &end, Real tolerance, vector<Position> &points)
+{
+    int count = ArcSegmentCount(arc, start, tolerance);
+    Real r0 = Radius(arc, start);
+    Real r1 = Radius(arc, end);
+    Real a0 = atan2(start.y - arc.cy, start.x - arc.cx);
+
+    points.clear();
+    points.reserve(count);
+
+    for (int i = 1; i < count; i++) {
+        Real t = (Real)i / count;
+        Real a = a0 + arc.sweep * t;
+        Real r = r0 + (r1 - r0) * t;
+        Position p;
+
+        p.x = arc.cx + r * cos(a);
+        p.y = arc.cy + r * sin(a);
+        p.z = start.z + (end.z - start.z) * t;
+        points.push_back(p);
+    }
+
+    points.push_back(end);
+}
+
+/* Level of 'tolerance', the least recently used one is dropped to make room */
+GArcCache::Level &GArcCache::GetLevel(const GTrajectory &trajectory, Real tolerance, int &exponent)
+{
+    size_t arcCount = trajectory.GetArcs().Size();
+
+    /* The arcs moved, e.g. GCodeInt::SetParameter */
+    if (trajectory.GetRevision() != m_revision) {
+        m_levels.clear();
+        m_revision = trajectory.GetRevision();
+    }
+
+    /* 'tolerance' is at least 2^(exponent - 1) */
+    frexp(tolerance, &exponent);
+
+    map<int, Level>::iterator it = m_levels.find(exponent);
+
+    if (it == m_levels.end()) {
+        if (m_levels.size() >= ARC_CACHE_MAX_LEVELS) {
+            map<int, Level>::iterator lru = m_levels.begin();
+
+            for (map<int, Level>::iterator lt = m_levels.begin(); lt != m_levels.end(); lt++) {
+                if (lt->second.lastUse < lru->second.lastUse)
+                    lru = lt;
+            }
+
+            m_levels.erase(lru);
+        }
+
+        it = m_levels.insert(make_pair(exponent, Level())).first;
+    }
+
+    Level &level = it->second;
+
+    level.lastUse = ++m_useCount;
+
+    if (level.count.size() != arcCount) {
+        level.first.resize(arcCount, 0);
+        level.count.resize(arcCount, 0);
+    }
+
+    return level;
+}
+
+void GArcCache::GetPoints(const GTrajectory &trajectory, unsigned int index, Real tolerance, GSpan<double> &xs, GSpan<double> &ys)
+{
+    GSpan<GArc> arcs = trajectory.GetArcs();
+    int exponent;
+    Level &level = GetLevel(trajectory, tolerance, exponent);
+
+    if (level.count[index] == 0) {
+        const GArc &arc = arcs[index];
+
+        TessellateArc(arc, trajectory.GetStartPosition(arc.point), trajectory.GetPosition(arc.point),
+                      ldexp((Real)1, exponent - 1), m_points);
+
+        level.first[index] = level.x.size();
+        level.count[index] = m_points.size();
+
+        for (unsigned int i = 0; i < m_points.size(); i++) {
+            level.x.push_back((double)m_points[i].x);
+            level.y.push_back((double)m_points[i].y);
+        }
+    }
+
+    xs = GSpan<double>(&level.x[level.first[index]], level.count[index]);
+    ys = GSpan<double>(&level.y[level.first[index]], level.count[index]);
+}
+
+/* Every task tessellates a range of the missing arcs apart, they're appended to the level in order */
+void GArcCache::Prepare(const GTrajectory &trajectory, const vector<unsigned int> &indexes, Real tolerance, GTaskPriority priority)
+{
+    struct Part
+    {
+        vector<unsigned int> count;
+        vector<double> x;
+        vector<double> y;
+    };
+
+    GSpan<GArc> arcs = trajectory.GetArcs();
+    int exponent;
+    Level &level = GetLevel(trajectory, tolerance, exponent);
+    vector<unsigned int> missing;
+
+    for (unsigned int i = 0; i < indexes.size(); i++) {
+        if (level.count[indexes[i]] == 0)
+            missing.push_back(indexes[i]);
+    }
+
+    if (missing.empty())
+        return;
+
+    size_t size = missing.size();
+    unsigned int tasks = GTaskScheduler::Get().GetTaskCount(size, ARC_CACHE_MIN_ARCS_PER_TASK);
+    vector<Part> parts(tasks);
+    Real levelTolerance = ldexp((Real)1, exponent - 1);
+    GTaskGroup group(priority);
+
+    auto tessellate = [&](unsigned int t) {
+        Part &part = parts[t];
+        vector<Position> points;
+
+        for (size_t i = size * t / tasks; i < size * (t + 1) / tasks; i++) {
+            const GArc &arc = arcs[missing[i]];
+
+            TessellateArc(arc, trajectory.GetStartPosition(arc.point), trajectory.GetPosition(arc.point),
+                          levelTolerance, points);
+            part.count.push_back(points.size());
+
+            for (unsigned int j = 0; j < points.size(); j++) {
+                part.x.push_back((double)points[j].x);
+                part.y.push_back((double)points[j].y);
+            }
+        }
+    };
+
+    for (unsigned int t = 1; t < tasks; t++)
+        group.Run([&tessellate, t]() { tessellate(t); });
+
+    tessellate(0);
+    group.Wait();
+
+    size_t arc = 0;
+
+    for (unsigned int t = 0; t < tasks; t++) {
+        Part &part = parts[t];
+        size_t first = level.x.size();
+
+        for (unsigned int i = 0; i < part.count.size(); i++, arc++) {
+            level.first[missing[arc]] = first;
+            level.count[missing[arc]] = part.count[i];
+            first += part.count[i];
+        }
+
+        level.x.insert(level.x.end(), part.x.begin(), part.x.end());
+        level.y.insert(level.y.end(), part.y.begin(), part.y.end());
+    }
+}
+
+size_t GArcCache::GetMemoryUsage()
+{
+    size_t bytes = m_points.capacity() * sizeof(Position);
+
+    for (map<int, Level>::iterator it = m_levels.begin(); it != m_levels.end(); it++) {
+        Level &level = it->second;
+
+        bytes += (level.first.capacity() + level.count.capacity()) * sizeof(unsigned int) +
+                 (level.x.capacity() + level.y.capacity()) * sizeof(double);
+    }
+
+    return bytes;
+}
@@ -14,27 +14,47 @@
  */
 
 #include <cmath>
+#include <cstring>
+#include <climits>
 #include <limits>
 #include <sstream>
-#include <QFile>
-#include <QTextStream>
+#include <algorithm>
 #include "gcode-autoleveller.h"
+#include "gcode-emitter.h"
+#include "gcode-arc.h"
 
 using namespace std;
 
-extern stringstream out_err;
-
 #ifdef _MSC_VER
 #define isinf(x) (!_finite(x))
 #endif
 
+/* Weights are written with 3 decimals, this is what we keep */
+static inline short WeightToThousandths(Real weight)
+{
+    long w = GCodeEmitter::RoundReal(weight, 3);
+
+    /* Only points way outside of the board get here */
+    if (w > SHRT_MAX) w = SHRT_MAX;
+    if (w < SHRT_MIN) w = SHRT_MIN;
+
+    return (short)w;
+}
+
 GCodeAutoleveller::GCodeAutoleveller(GCodeInt *ginter) {
     m_ginter = ginter;
     m_GInfo = ginter->GetGCodeInfo();
     m_nextParamNumber = 2000;
     m_cellParams = 0;
-
-    if (m_GInfo->UnitType == UNIT_INCHES) {
+    m_zcompRequests = 0;
+    m_streamedZComps = 0;
+    m_unitScale = 1;
+    m_streamOut = NULL;
+    m_streamListener = NULL;
+    m_streamedOutput = 0;
+    m_isPart = false;
+
+    if (m_GInfo->SourceUnitType == UNIT_INCHES) {
         m_AInfo.ClearHeight = 0.47244;
         m_AInfo.InitialProbeZ = -0.1969;
     }
@@ -44,11 +64,31 @@ GCodeAutoleveller::GCodeAutoleveller(GCodeInt *ginter) {
     }
 }
 
-void GCodeAutoleveller::DistanceSplit(Real from_x, Real from_y, GCodeCommand *gcmd)
+/* Part of the statements of SplitSegments, with the grid of 'parent' */
+GCodeAutoleveller::GCodeAutoleveller(const GCodeAutoleveller &parent)
 {
-    Real to_x = gcmd->GetArgument('X')->GetValue();
-    Real to_y = gcmd->GetArgument('Y')->GetValue();
+    int cellCount = (parent.m_AInfo.GridMaxX + 1) * (parent.m_AInfo.GridMaxY + 1);
+
+    m_ginter = parent.m_ginter;
+    m_GInfo = parent.m_GInfo;
+    m_AInfo = parent.m_AInfo;
+    m_unitScale = parent.m_unitScale;
+    m_nextParamNumber = 0;
+    m_zcompRequests = 0;
+    m_streamedZComps = 0;
+    m_streamOut = NULL;
+    m_streamListener = NULL;
+    m_streamedOutput = 0;
+    m_isPart = true;
+
+    /* Every cell has a variable, MergePart gives the parameters */
+    m_cellParams = new int[cellCount];
+    for (int i = 0; i < cellCount; i++)
+        m_cellParams[i] = i + 1;
+}
 
+void GCodeAutoleveller::DistanceSplit(Real from_x, Real from_y, Real to_x, Real to_y, GCodeCommand *gcmd, int kind, bool withFeed)
+{
     Real dist_x = to_x - from_x;
     Real dist_y = to_y - from_y;
 
@@ -56,26 +96,49 @@ void GCodeAutoleveller::DistanceSplit(Real from_x, Real from_y, GCodeCommand *gc
         Real mp_x = from_x + (dist_x / 2);
         Real mp_y = from_y + (dist_y / 2);
 
-        GCodeCommand *c1 = new GCodeCommand(gcmd->GetOpcode(), mp_x, mp_y);
-        GCodeCommand *c2 = new GCodeCommand(gcmd->GetOpcode(), to_x, to_y);
-
-        c1->SetName(gcmd->GetName());
-        c2->SetName(gcmd->GetName());
-        if (gcmd->HasArgument('F'))
-            c1->SetArgument('F', gcmd->GetArgument('F'));
+        int pieceKind = (kind == AL_ARC_SEGMENT)? AL_ARC_SEGMENT : AL_SEGMENT;
 
-        DistanceSplit(from_x, from_y, c1);
-        DistanceSplit(mp_x, mp_y, c2);
+        /* Only the first piece carries the feed rate */
+        DistanceSplit(from_x, from_y, mp_x, mp_y, gcmd, pieceKind, withFeed);
+        DistanceSplit(mp_x, mp_y, to_x, to_y, gcmd, pieceKind, false);
     } else {
-        /* Get the interpolated Z formula */
-        string zformula = GetInterpolationFormula(to_x, to_y, true);
-        gcmd->setZFormula(zformula);
+        AutolevelledStmt stmt;
+
+        stmt.kind = kind;
+        stmt.cmd = gcmd;
+        stmt.x = to_x;
+        stmt.y = to_y;
+        stmt.withFeed = withFeed;
+
+        /* Get the interpolated Z */
+        stmt.zcomp = GetZCompensation(to_x, to_y, true);
+
+        m_outStmtList.push_back(stmt);
+    }
+}
+
+/* Arcs under Z 0 are split in chords, every chord is split like a straight cut */
+void GCodeAutoleveller::SplitArc(GCodeCommand *gcmd, const GArc &arc, const Position &end)
+{
+    if (pos.z >= 0) {
+        AddStatement(AL_ARC_VERBATIM, gcmd);
+        return;
+    }
+
+    Real tolerance = (m_GInfo->SourceUnitType == UNIT_INCHES)? AL_ARC_TOLERANCE_INCHES : AL_ARC_TOLERANCE_MM;
+    bool withFeed = gcmd->HasArgument('F');
+    Position from = pos;
+
+    TessellateArc(arc, pos, end, tolerance, m_arcPoints);
 
-        m_outStmtList.push_back(gcmd);
+    for (unsigned int i = 0; i < m_arcPoints.size(); i++) {
+        DistanceSplit(from.x, from.y, m_arcPoints[i].x, m_arcPoints[i].y, gcmd, AL_ARC_SEGMENT, withFeed);
+        withFeed = false;
+        from = m_arcPoints[i];
     }
 }
 
-string GCodeAutoleveller::GetInterpolationFormula(Real x, Real y, bool isLinearMotionCommand)
+unsigned int GCodeAutoleveller::GetZCompensation(Real x, Real y, bool isLinearMotionCommand)
 {
     int cellx, celly;
 
@@ -108,35 +171,213 @@ string GCodeAutoleveller::GetInterpolationFormula(Real x, Real y, bool isLinearM
     /*
      * Now we can work out the interpolation...
      */
-    stringstream ss;
-    string depthParameter = isLinearMotionCommand? "#3" : "#7";
+    ZCompensation zcomp;
+
+    zcomp.params[0] = CellVariable(cellx, celly);
+    zcomp.params[1] = CellVariable(px_cell, celly);
+    zcomp.params[2] = CellVariable(cellx, py_cell);
+    zcomp.params[3] = CellVariable(px_cell, py_cell);
+    zcomp.weights[0] = WeightToThousandths(x_pc * y_pc);
+    zcomp.weights[1] = WeightToThousandths((1 - x_pc) * y_pc);
+    zcomp.weights[2] = WeightToThousandths(x_pc * (1 - y_pc));
+    zcomp.weights[3] = WeightToThousandths((1 - x_pc) * (1 - y_pc));
+    zcomp.depth = isLinearMotionCommand? ZDEPTH_ENGRAVING : ZDEPTH_DRILLSPOT;
+
+    return InternZCompensation(zcomp);
+}
+
+static inline size_t HashZCompensation(const ZCompensation &zcomp)
+{
+    unsigned long long h = zcomp.depth;
+
+    for (int i = 0; i < 4; i++)
+        h = (h * 31 + zcomp.params[i]) * 31 + (unsigned short)zcomp.weights[i];
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (size_t)h;
+}
+
+unsigned int GCodeAutoleveller::InternZCompensation(const ZCompensation &zcomp)
+{
+    m_zcompRequests++;
+
+    if ((m_zcomps.size() + 1) * 2 > m_zcompTable.size()) {
+        size_t size = m_zcompTable.empty()? 1024 : m_zcompTable.size() * 2;
+
+        m_zcompTable.assign(size, 0);
+        for (unsigned int i = 0; i < m_zcomps.size(); i++) {
+            size_t index = HashZCompensation(m_zcomps[i]) & (size - 1);
 
-    ss.precision(3);
-    ss << fixed << (x_pc * y_pc) << "*#" << CellVariable(cellx, celly) << " + " <<
-            ((1 - x_pc) * y_pc) << "*#" << CellVariable(px_cell, celly) << " + " <<
-            (x_pc * (1 - y_pc)) << "*#" << CellVariable(cellx, py_cell) << " + " <<
-            ((1 - x_pc) * (1 - y_pc)) << "*#" << CellVariable(px_cell, py_cell) << " + " <<
-            depthParameter;
+            while (m_zcompTable[index] != 0)
+                index = (index + 1) & (size - 1);
 
-    return ss.str();
+            m_zcompTable[index] = i + 1;
+        }
+    }
+
+    size_t mask = m_zcompTable.size() - 1;
+    size_t index = HashZCompensation(zcomp) & mask;
+
+    while (m_zcompTable[index] != 0) {
+        unsigned int zindex = m_zcompTable[index] - 1;
+
+        if (m_zcomps[zindex] == zcomp)
+            return zindex;
+
+        index = (index + 1) & mask;
+    }
+
+    m_zcomps.push_back(zcomp);
+    m_zcompTable[index] = m_zcomps.size();
+
+    return m_zcomps.size() - 1;
 }
 
-void GCodeAutoleveller::SplitSegments(AutolevellerListener *listener)
+void GCodeAutoleveller::SplitSegments(AutolevellerListener *listener, unsigned int tasks)
 {
     if (!m_ginter->HasStatements())
         return;
 
+    GPhaseTimer timer(m_ginter->GetPhaseTimes(), PHASE_SPLIT);
+
+    InitGrid();
+    pos.reset();
+
+    int count = m_ginter->GetStatementCount();
+
+    tasks = GTaskScheduler::Get().GetTaskCount(count, AL_SPLIT_MIN_STMTS_PER_TASK, tasks);
+
+    if (tasks == 1) {
+        SplitStatements(0, 0, listener);
+        m_ginter->SetAutolevellerMemory(GetMemoryUsage());
+        return;
+    }
+
+    /*
+     * The first part is split here, the others by the tasks.  They're merged
+     * in order, so the cells get their parameters and the Z compensations
+     * their indexes in the order they're first used, like in one go.
+     */
+    vector<GCodeAutoleveller *> parts(tasks);
+    GTaskGroup group;
+
+    for (unsigned int t = 1; t < tasks; t++) {
+        GCodeAutoleveller *part = new GCodeAutoleveller(*this);
+        int first = (int)((long long)count * t / tasks);
+        int last = (int)((long long)count * (t + 1) / tasks);
+
+        parts[t] = part;
+        group.Run([part, first, last]() { part->SplitPart(first, last); });
+    }
+
+    GCodeCursor cursor(m_ginter);
+
+    SplitRange(cursor, count / tasks, 0, listener);
+    group.Wait();
+
+    for (unsigned int t = 1; t < tasks; t++) {
+        MergePart(*parts[t]);
+        delete parts[t];
+
+        if (listener != NULL)
+            listener->UpdateProgress((int)((long long)count * (t + 1) / tasks) - 1);
+    }
+
+    m_ginter->SetAutolevellerMemory(GetMemoryUsage());
+}
+
+/* Splits the statements 'first' to 'last' - 1, from where the ones before them leave the machine */
+void GCodeAutoleveller::SplitPart(int first, int last)
+{
+    const GTrajectory &trajectory = m_ginter->GetTrajectory();
+    GSpan<unsigned char> kinds = trajectory.GetKind();
+    GCodeCursor cursor(m_ginter);
+
+    cursor.Seek(first);
+
+    size_t move = cursor.GetPoint();
+
+    /* The drills and the probe cycles don't move 'pos' */
+    while (move > 0 && (kinds[move - 1] == SEG_DRILL || kinds[move - 1] == SEG_PROBE))
+        move--;
+
+    pos.reset();
+    if (move > 0)
+        pos = GetFilePosition(trajectory, move - 1);
+
+    SplitRange(cursor, last, 0, NULL);
+}
+
+/* Appends the statements of a part after those split so far */
+void GCodeAutoleveller::MergePart(GCodeAutoleveller &part)
+{
+    vector<unsigned int> zcomps(part.m_zcomps.size());
+
+    /* The part interned them in the order they're first used */
+    for (unsigned int i = 0; i < part.m_zcomps.size(); i++) {
+        ZCompensation zcomp = part.m_zcomps[i];
+
+        for (int k = 0; k < 4; k++) {
+            int cell = zcomp.params[k] - 1;
+            int gx = cell % (m_AInfo.GridMaxX + 1);
+            int gy = cell / (m_AInfo.GridMaxX + 1);
+
+            EnsureCellVariable(gx, gy);
+            zcomp.params[k] = CellVariable(gx, gy);
+        }
+
+        zcomps[i] = InternZCompensation(zcomp);
+    }
+
+    m_zcompRequests += part.m_zcompRequests - part.m_zcomps.size();
+
+    m_outStmtList.reserve(m_outStmtList.size() + part.m_outStmtList.size());
+    for (unsigned int i = 0; i < part.m_outStmtList.size(); i++) {
+        AutolevelledStmt stmt = part.m_outStmtList[i];
+
+        if (stmt.kind == AL_ZADJUSTED || stmt.kind == AL_SEGMENT || stmt.kind == AL_ARC_SEGMENT)
+            stmt.zcomp = zcomps[stmt.zcomp];
+
+        m_outStmtList.push_back(stmt);
+    }
+
+    m_AInfo.HasDrillSpots = m_AInfo.HasDrillSpots || part.m_AInfo.HasDrillSpots;
+    if (isinf(m_AInfo.DrillSpotDepth))
+        m_AInfo.DrillSpotDepth = part.m_AInfo.DrillSpotDepth;
+}
+
+/* Grid over the board area of GCodeInfo, without any cell probed yet */
+void GCodeAutoleveller::InitGrid()
+{
     m_AInfo.HasDrillSpots = false;
+    m_outStmtList.clear();
+    m_zcomps.clear();
+    m_zcompTable.clear();
+    m_zcompRequests = 0;
+    m_streamedZComps = 0;
+    m_nextParamNumber = 2000;
+    m_streamedOutput = 0;
 
     m_AInfo.DrillSpotDepth = -numeric_limits<Real>::infinity();
 
-    m_AInfo.GridMaxX = (int)ceil((m_GInfo->BoardMaxX - m_GInfo->BoardMinX) / m_AInfo.GridSize);
-    m_AInfo.GridMaxY = (int)ceil((m_GInfo->BoardMaxY - m_GInfo->BoardMinY) / m_AInfo.GridSize);
+    /* The board area and the trajectory can be normalised, the output is in the units of the program */
+    m_unitScale = m_GInfo->UnitScale;
 
-    m_AInfo.x1 = m_GInfo->BoardMinX - m_AInfo.GridSize / 2.0;
-    m_AInfo.y1 = m_GInfo->BoardMinY - m_AInfo.GridSize / 2.0 ;
-    m_AInfo.x2 = m_GInfo->BoardMaxX;
-    m_AInfo.y2 = m_GInfo->BoardMaxY;
+    Real boardMinX = m_GInfo->BoardMinX / m_unitScale;
+    Real boardMinY = m_GInfo->BoardMinY / m_unitScale;
+    Real boardMaxX = m_GInfo->BoardMaxX / m_unitScale;
+    Real boardMaxY = m_GInfo->BoardMaxY / m_unitScale;
+
+    m_AInfo.GridMaxX = (int)ceil((boardMaxX - boardMinX) / m_AInfo.GridSize);
+    m_AInfo.GridMaxY = (int)ceil((boardMaxY - boardMinY) / m_AInfo.GridSize);
+
+    m_AInfo.x1 = boardMinX - m_AInfo.GridSize / 2.0;
+    m_AInfo.y1 = boardMinY - m_AInfo.GridSize / 2.0 ;
+    m_AInfo.x2 = boardMaxX;
+    m_AInfo.y2 = boardMaxY;
 
     //Lets adjust Grid Size on X and Y axis
     m_AInfo.Gx = (m_AInfo.x2 - m_AInfo.x1)/(m_AInfo.GridMaxX + 0.5);
@@ -150,155 +391,355 @@ void GCodeAutoleveller::SplitSegments(AutolevellerListener *listener)
 
     m_cellParams = new int[cellCount];
     memset(m_cellParams, 0, cellCount * sizeof(int));
+}
 
-    m_ginter->Init();
-    pos = m_ginter->GetCurrentPos();
-    int count = 0;
+/*
+ * Splits the statements of the interpreter, the trajectory points start at
+ * 'firstPoint' (see GCodeStreamConsumer).  'pos' is where the first one
+ * starts, in the units of the program.
+ */
+void GCodeAutoleveller::SplitStatements(unsigned long firstStatement, size_t firstPoint, AutolevellerListener *listener)
+{
+    GCodeCursor cursor(m_ginter, firstPoint);
 
-    while (m_ginter->ExecuteNextStatement()) {
-        GCodeCommand *cmd = m_ginter->GetCurrentCommand();
+    SplitRange(cursor, m_ginter->GetStatementCount(), firstStatement, listener);
+}
+
+/* Splits the statements from the one 'cursor' goes to up to 'last' - 1 */
+void GCodeAutoleveller::SplitRange(GCodeCursor &cursor, int last, unsigned long firstStatement, AutolevellerListener *listener)
+{
+    while ((int)cursor.GetIndex() < last && cursor.Next()) {
+        GCodeCommand *cmd = cursor.GetCommand();
+        int kind = cursor.GetKind();
 
         if (listener != NULL)
-            listener->UpdateProgress(count++);
+            listener->UpdateProgress(firstStatement + cursor.GetIndex() - 1);
 
         if (cmd == NULL)
             continue;
 
-        if ( cmd->IsMotionCommand() ) {
-            SplitIfNeeded((GCodeCommand *)cmd->Clone());
+        if ( kind == SEG_ARC ) {
+            GArc fileArc = *cursor.GetArc();
+
+            fileArc.cx /= m_unitScale;
+            fileArc.cy /= m_unitScale;
+            SplitArc(cmd, fileArc, cursor.GetPosition());
+
+			pos = cursor.GetPosition();
+        } else if ( kind != -1 && kind != SEG_DRILL ) {
+            SplitIfNeeded(cmd);
 
-			pos = m_ginter->GetCurrentPos();
+			pos = cursor.GetPosition();
         } else if ( cmd->IsA( G82 ) ) {
 
             m_AInfo.HasDrillSpots = true;
             if (cmd->HasArgument('Z') && isinf(m_AInfo.DrillSpotDepth))
-                m_AInfo.DrillSpotDepth = cmd->GetArgument('Z')->GetValue();
+                m_AInfo.DrillSpotDepth = cmd->GetArgumentValue('Z');
 
-            GCodeCommand *icmd = (GCodeCommand *)cmd->Clone();
+            AddStatement(AL_ZADJUSTED, cmd);
+            m_outStmtList.back().zcomp = GetZCompensation(pos.x, pos.y, false);
+        } else
+            AddStatement(AL_VERBATIM, cmd);
+    }
+}
 
-            string zformula = GetInterpolationFormula(pos.x, pos.y, false);
-            icmd->setZFormula(zformula);
+bool GCodeAutoleveller::StreamAutolevellingGCode(const char *outfile_path, GDiagnostics &diagnostics, AutolevellerListener *listener)
+{
+    GCodeEmitter outs;
+    bool result;
 
-            m_outStmtList.push_back(icmd);
-        } else
-            m_outStmtList.push_back(cmd->Clone());
+    InitGrid();
+
+    /* First pass, the probed cells and the drill spot depth are written before the moves */
+    m_streamOut = NULL;
+    m_streamListener = NULL;
+    pos.reset();
+
+    if (!m_ginter->StreamFile(diagnostics, this))
+        return false;
+
+    if (!outs.Open(outfile_path)) {
+        diagnostics << "Unable to open file: " << outfile_path << endl;
+        return false;
+    }
+
+    m_streamOut = &outs;
+    m_streamListener = listener;
+    m_ginter->OpenSource(m_source);
+    pos.reset();
+
+    result = m_ginter->StreamFile(diagnostics, this);
+
+    m_source.Close();
+    m_streamOut = NULL;
+    m_streamListener = NULL;
+    m_ginter->SetAutolevellerMemory(GetMemoryUsage());
+
+    if (!outs.Close()) {
+        diagnostics << "Error writing file: " << outfile_path << endl;
+        return false;
     }
+
+    return result;
 }
 
-void GCodeAutoleveller::GenerateAutolevellingGCode(const char *outfile_path, AutolevellerListener *listener)
+/* The split statements only live until the window is written, the Z compensations are shared within the window */
+bool GCodeAutoleveller::ConsumeWindow(GCodeInt *ginter, unsigned long firstStatement, size_t firstPoint)
 {
-    QFile outf(outfile_path);
+    {
+        GPhaseTimer timer(ginter->GetPhaseTimes(), PHASE_SPLIT);
 
-    outf.open(QIODevice::WriteOnly);
+        SplitStatements(firstStatement, firstPoint, m_streamListener);
+    }
 
-    if ( !outf.isOpen() ) {
-        out_err << "Unable to open file: " << outfile_path << endl;
-        return;
+    if (m_streamOut != NULL) {
+        GPhaseTimer timer(ginter->GetPhaseTimes(), PHASE_EMIT);
+
+        EmitStatements(*m_streamOut, NULL);
+        m_streamedOutput += m_outStmtList.size();
+    }
+
+    m_outStmtList.clear();
+    m_streamedZComps += m_zcomps.size();
+    m_zcomps.clear();
+    fill(m_zcompTable.begin(), m_zcompTable.end(), 0);
+
+    return m_streamOut == NULL || !m_streamOut->HasError();
+}
+
+size_t GCodeAutoleveller::GetMemoryUsage()
+{
+    size_t bytes = m_outStmtList.capacity() * sizeof(AutolevelledStmt) +
+                   m_zcomps.capacity() * sizeof(ZCompensation) +
+                   m_zcompTable.capacity() * sizeof(unsigned int);
+
+    if (m_cellParams != 0)
+        bytes += (m_AInfo.GridMaxX + 1) * (m_AInfo.GridMaxY + 1) * sizeof(int);
+
+    return bytes;
+}
+
+void GCodeAutoleveller::EmitStatement(GCodeEmitter &outs, AutolevelledStmt &stmt)
+{
+    GCodeCommand *cmd = stmt.cmd;
+    const char *text;
+
+    switch (stmt.kind) {
+        case AL_VERBATIM:
+            outs.EmitCommand(cmd);
+            break;
+        case AL_ZADJUSTED:
+            outs.EmitCommand(cmd, &m_zcomps[stmt.zcomp]);
+            break;
+        case AL_SEGMENT:
+            outs << cmd->GetName() << " X" << stmt.x << " Y" << stmt.y;
+
+            if (stmt.withFeed) {
+                outs << " F";
+                outs.EmitExpr(cmd->GetArgument('F'));
+            }
+            outs << " Z[";
+            outs.EmitZCompensation(m_zcomps[stmt.zcomp]);
+            outs << ']';
+            break;
+        case AL_ARC_SEGMENT:
+            outs << "G01 X" << stmt.x << " Y" << stmt.y;
+
+            if (stmt.withFeed) {
+                outs << " F";
+                outs.EmitExpr(cmd->GetArgument('F'));
+            }
+            outs << " Z[";
+            outs.EmitZCompensation(m_zcomps[stmt.zcomp]);
+            outs << ']';
+            break;
+        case AL_ARC_VERBATIM:
+            if ((text = GetSourceText(cmd)) != NULL) {
+                if (cmd->GetName().empty())
+                    outs << (cmd->IsA(G02)? "G02 " : "G03 ");
+
+                outs.WriteBlock(text, cmd->GetSourceLength());
+                break;
+            }
+
+            if (cmd->GetName().empty())
+                outs << (cmd->IsA(G02)? "G02" : "G03");
+
+            outs.EmitCommand(cmd);
+            break;
+    }
+    outs << '\n';
+}
+
+bool GCodeAutoleveller::GenerateAutolevellingGCode(const char *outfile_path, GDiagnostics &diagnostics, AutolevellerListener *listener)
+{
+    GPhaseTimer timer(m_ginter->GetPhaseTimes(), PHASE_EMIT);
+    GCodeEmitter outs;
+
+    if ( !outs.Open(outfile_path) ) {
+        diagnostics << "Unable to open file: " << outfile_path << endl;
+        return false;
     }
-    QTextStream outs(&outf);
 
-    list<GCodeStmt *>::iterator it = m_outStmtList.begin();
-    int count = 0;
+    /* The unchanged statements are copied from the file, if it's still the same */
+    m_ginter->OpenSource(m_source);
+    EmitStatements(outs, listener);
+    m_source.Close();
 
-    while (it != m_outStmtList.end()) {
-        GCodeCommand *cmd = (GCodeCommand *)(*it);
+    if ( !outs.Close() ) {
+        diagnostics << "Error writing file: " << outfile_path << endl;
+        return false;
+    }
+
+    return true;
+}
+
+void GCodeAutoleveller::EmitStatements(GCodeEmitter &outs, AutolevellerListener *listener)
+{
+    for (unsigned int i = 0; i < m_outStmtList.size(); i++) {
+        GCodeCommand *cmd = m_outStmtList[i].cmd;
 
         if (listener != NULL)
-            listener->UpdateProgress(count++);
+            listener->UpdateProgress(i);
+
+        if (m_outStmtList[i].kind == AL_VERBATIM && GetSourceText(cmd) != NULL) {
+            i = EmitSourceRun(outs, i);
+            cmd = m_outStmtList[i].cmd;
+        } else
+            EmitStatement(outs, m_outStmtList[i]);
 
         /*
          * We'll put our stuff right after the G21 or G20
          */
-        if ( cmd->IsA(G20) || cmd->IsA(G21) ) {
-            outs << cmd->ToString().c_str() << endl;
-            outs << "\n"
-                    "(Processed with MCB Autoleveller by Ivan de Jesus Deras 2013)"
-                    "\n"
-                    "\n"
-                    "(Grid Cell Size = " << m_AInfo.GridSize << "mm )\n"
-                    "(Grid Cell Count = " << (m_AInfo.GridMaxX + 1) << " x " << (m_AInfo.GridMaxY + 1) << " )\n"
-                    "\n"
-                    "\n"
-                    "#1=" << m_AInfo.ClearHeight       << "			(clearance height)\n"
-                    "#2=" << m_AInfo.TraverseHeight    << "			(traverse height)\n"
-                    "#3=" << m_AInfo.EngravingDepth    << "            (engraving depth)\n"
-                    "#4=" << m_AInfo.ProbeMaxDepth        << "			(probe maximum depth)\n"
-                    "#5=" << m_AInfo.TraverseSpeed     << "			(traverse speed)\n"
-                    "#6=" << m_AInfo.ProbeSpeed        << "			(probe speed)\n";
-
-            if (m_AInfo.HasDrillSpots)
-                outs << "#7=" << m_AInfo.DrillSpotDepth << "            (drill spot depth)\n";
-
-            outs << endl << endl;
-            outs <<  "M05			(stop motor)\n"
-                    "(MSG,PROBE: Position to within 5mm [~0.2 inches] of surface & resume)\n"
-                    "M60			(pause, wait for resume)\n"
-                    "G49			(clear any tool offsets)\n"
-                    "G92.1			(zero co-ordinate offsets)\n"
-                    "G91			(use relative coordinates)\n"
-                    "G38.2 Z" << m_AInfo.InitialProbeZ << " F[#6]	(probe to find worksurface)\n"
-                    "G90			(back to absolute)\n"
-                    "G92 Z0			(zero Z)\n"
-                    "G00 Z[#1]		(safe height)\n"
-                    "(MSG,PROBE: Z-Axis calibrate complete, beginning probe)\n"
-                    "\n"
-                    "(probe routine)\n"
-                    "(params: x y traverse_height probe_depth traverse_speed probe_speed)\n"
-                    "O100 sub\n"
-                    "G00 X[#1] Y[#2] Z[#3] F[#5]\n"
-                    "G38.2 Z[#4] F[#6]\n"
-                    "G00 Z[#3]\n"
-                    "O100 endsub\n"
-                    "\n";
-
-            /*
-             * Now we can create the code for the depth sensing bit... but
-             * we should do it in a fairly optimal way
-             */
-
-            int gx, gy, rgx;
-
-            for (gy = 0; gy <= m_AInfo.GridMaxY; gy++) {
-                for (rgx = 0; rgx <= m_AInfo.GridMaxX; rgx++) {
-                    if (gy & 1) {
-                        gx = m_AInfo.GridMaxX - rgx;
-                    } else {
-                        gx = rgx;
-                    }
-
-                    // Find the point in the centre of the grid square...
-                    Real px = m_AInfo.x1 + ((Real) gx * m_AInfo.Gx) + (m_AInfo.Gx / 2);
-                    Real py = m_AInfo.y1 + ((Real) gy * m_AInfo.Gy) + (m_AInfo.Gy / 2);
-
-                    if (!CellHasVariable(gx, gy))
-                        continue;
-
-                    int var = CellVariable(gx, gy);
-
-                    outs << "(PROBE[" << gx << "," << gy << "] " << ((double)px) << " " << ((double)py) << " -> " << var << ")" << endl;
-                    outs << "O100 call [" << ((double)px) << "] [" << ((double)py) << "] [#2] [#4] [#5] [#6]" << endl;
-                    outs << "#" << var << " = #5063" << endl;
-                }
-            }
+        if ( cmd->IsA(G20) || cmd->IsA(G21) )
+            EmitHeader(outs);
+    }
+}
 
-            /*
-             * Now before we go into the main mill bit we need to give you a chance
-             * to undo the probe connections
-             */
-            outs << "\n\n"
-                    "G00 Z[#1]		(safe height)\n"
-                    "(MSG,PROBE: Probe complete, remove connections & resume)\n"
-                    "M60			(pause, wait for resume)\n"
-                    "(MSG,PROBE: Beginning etch)\n"
-                    "\n\n";
-
-        } else {
-            outs << cmd->ToString().c_str() << endl;
-        }
+/*
+ * Copies the verbatim statements from 'first' on that are whole lines, one
+ * after the other, of the file in one block of SOURCE_WINDOW_SIZE at most.
+ * Returns the last one copied.
+ */
+unsigned int GCodeAutoleveller::EmitSourceRun(GCodeEmitter &outs, unsigned int first)
+{
+    GCodeCommand *cmd = m_outStmtList[first].cmd;
+    long long start = cmd->GetSourceOffset();
+    long long end = start + cmd->GetSourceLength();
+    unsigned int last = first;
+    const char *data;
+
+    /* The header goes after the G20 or G21 */
+    while (last + 1 < m_outStmtList.size() && !cmd->IsA(G20) && !cmd->IsA(G21)) {
+        AutolevelledStmt &next = m_outStmtList[last + 1];
+        long long nextEnd = next.cmd->GetSourceOffset() + next.cmd->GetSourceLength();
+
+        if (next.kind != AL_VERBATIM || next.cmd->GetSourceLength() == 0 ||
+            next.cmd->GetSourceOffset() != end + 1 || nextEnd - start > SOURCE_WINDOW_SIZE)
+            break;
 
-        it++;
+        data = m_source.Get(start, nextEnd - start);
+
+        if (data == NULL || data[end - start] != '\n')
+            break;
+
+        cmd = next.cmd;
+        end = nextEnd;
+        last++;
+    }
+
+    /* Formatted if the file can't be read anymore */
+    if ((data = m_source.Get(start, end - start)) == NULL) {
+        EmitStatement(outs, m_outStmtList[first]);
+        return first;
     }
-    outf.close();
+
+    outs.WriteBlock(data, end - start);
+    outs << '\n';
+
+    return last;
 }
 
+void GCodeAutoleveller::EmitHeader(GCodeEmitter &outs)
+{
+    outs << "\n"
+            "(Processed with MCB Autoleveller by Ivan de Jesus Deras 2013)"
+            "\n"
+            "\n"
+            "(Grid Cell Size = " << m_AInfo.GridSize << "mm )\n"
+            "(Grid Cell Count = " << (m_AInfo.GridMaxX + 1) << " x " << (m_AInfo.GridMaxY + 1) << " )\n"
+            "\n"
+            "\n"
+            "#1=" << m_AInfo.ClearHeight       << "			(clearance height)\n"
+            "#2=" << m_AInfo.TraverseHeight    << "			(traverse height)\n"
+            "#3=" << m_AInfo.EngravingDepth    << "            (engraving depth)\n"
+            "#4=" << m_AInfo.ProbeMaxDepth        << "			(probe maximum depth)\n"
+            "#5=" << m_AInfo.TraverseSpeed     << "			(traverse speed)\n"
+            "#6=" << m_AInfo.ProbeSpeed        << "			(probe speed)\n";
+
+    if (m_AInfo.HasDrillSpots)
+        outs << "#7=" << m_AInfo.DrillSpotDepth << "            (drill spot depth)\n";
+
+    outs << "\n\n";
+    outs <<  "M05			(stop motor)\n"
+            "(MSG,PROBE: Position to within 5mm [~0.2 inches] of surface & resume)\n"
+            "M60			(pause, wait for resume)\n"
+            "G49			(clear any tool offsets)\n"
+            "G92.1			(zero co-ordinate offsets)\n"
+            "G91			(use relative coordinates)\n"
+            "G38.2 Z" << m_AInfo.InitialProbeZ << " F[#6]	(probe to find worksurface)\n"
+            "G90			(back to absolute)\n"
+            "G92 Z0			(zero Z)\n"
+            "G00 Z[#1]		(safe height)\n"
+            "(MSG,PROBE: Z-Axis calibrate complete, beginning probe)\n"
+            "\n"
+            "(probe routine)\n"
+            "(params: x y traverse_height probe_depth traverse_speed probe_speed)\n"
+            "O100 sub\n"
+            "G00 X[#1] Y[#2] Z[#3] F[#5]\n"
+            "G38.2 Z[#4] F[#6]\n"
+            "G00 Z[#3]\n"
+            "O100 endsub\n"
+            "\n";
+
+    /*
+     * Now we can create the code for the depth sensing bit... but
+     * we should do it in a fairly optimal way
+     */
+
+    int gx, gy, rgx;
 
+    for (gy = 0; gy <= m_AInfo.GridMaxY; gy++) {
+        for (rgx = 0; rgx <= m_AInfo.GridMaxX; rgx++) {
+            if (gy & 1) {
+                gx = m_AInfo.GridMaxX - rgx;
+            } else {
+                gx = rgx;
+            }
+
+            // Find the point in the centre of the grid square...
+            Real px = m_AInfo.x1 + ((Real) gx * m_AInfo.Gx) + (m_AInfo.Gx / 2);
+            Real py = m_AInfo.y1 + ((Real) gy * m_AInfo.Gy) + (m_AInfo.Gy / 2);
+
+            if (!CellHasVariable(gx, gy))
+                continue;
+
+            int var = CellVariable(gx, gy);
+
+            outs << "(PROBE[" << gx << "," << gy << "] " << ((double)px) << " " << ((double)py) << " -> " << var << ")\n";
+            outs << "O100 call [" << ((double)px) << "] [" << ((double)py) << "] [#2] [#4] [#5] [#6]\n";
+            outs << "#" << var << " = #5063\n";
+        }
+    }
+
+    /*
+     * Now before we go into the main mill bit we need to give you a chance
+     * to undo the probe connections
+     */
+    outs << "\n\n"
+            "G00 Z[#1]		(safe height)\n"
+            "(MSG,PROBE: Probe complete, remove connections & resume)\n"
+            "M60			(pause, wait for resume)\n"
+            "(MSG,PROBE: Beginning etch)\n"
+            "\n\n";
+}
@@ -0,0 +1,616 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cfloat>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef _MSC_VER
+#include <io.h>
+#define snprintf _snprintf
+#endif
+
+#ifndef _WIN32
+//Linux treat binary and text the same, Windows doesn't
+#define _O_BINARY 0
+
+#include <unistd.h>
+#endif
+
+#include "gcode-emitter.h"
+
+using namespace std;
+
+#define MEM_BUF_SIZE    256
+#define MAX_FAST_DIGITS 17
+
+/* Powers of ten, all of them are exact in a long double */
+static const Real pow10Table[] = {
+    1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+    1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+    1e20L, 1e21L
+};
+
+static const unsigned long long ipow10Table[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL
+};
+
+GCodeEmitter::GCodeEmitter()
+{
+    m_fhandle = -1;
+    m_error = false;
+    m_len = 0;
+    m_capacity = MEM_BUF_SIZE;
+    m_buf = new char[m_capacity];
+    m_numFormat = NUMFMT_GENERAL;
+    m_precision = 6;
+}
+
+GCodeEmitter::~GCodeEmitter()
+{
+    Close();
+    delete [] m_buf;
+}
+
+bool GCodeEmitter::Open(const char *filePath)
+{
+    Close();
+
+    m_fhandle = open(filePath, O_WRONLY|O_CREAT|O_TRUNC|_O_BINARY, 0644);
+
+    if (m_fhandle == -1)
+        return false;
+
+    if (m_capacity < EMIT_BUF_SIZE) {
+        delete [] m_buf;
+        m_capacity = EMIT_BUF_SIZE;
+        m_buf = new char[m_capacity];
+    }
+    m_len = 0;
+    m_error = false;
+
+    return true;
+}
+
+bool GCodeEmitter::Close()
+{
+    if (m_fhandle == -1)
+        return !m_error;
+
+    Flush();
+    close(m_fhandle);
+    m_fhandle = -1;
+
+    return !m_error;
+}
+
+bool GCodeEmitter::Flush()
+{
+    if (m_fhandle == -1)
+        return !m_error;
+
+    WriteFile(m_buf, m_len);
+    m_len = 0;
+
+    return !m_error;
+}
+
+bool GCodeEmitter::WriteFile(const char *data, size_t len)
+{
+    size_t offset = 0;
+
+    while (offset < len) {
+        int bytes_written = write(m_fhandle, &data[offset], len - offset);
+
+        if (bytes_written <= 0) {
+            m_error = true;
+            break;
+        }
+        offset += bytes_written;
+    }
+
+    return !m_error;
+}
+
+void GCodeEmitter::WriteBlock(const char *data, size_t len)
+{
+    if (m_fhandle == -1 || m_len + len <= m_capacity) {
+        Write(data, len);
+        return;
+    }
+
+    Flush();
+
+    if (len < m_capacity)
+        Write(data, len);
+    else
+        WriteFile(data, len);
+}
+
+void GCodeEmitter::MakeRoom(size_t len)
+{
+    if (m_fhandle != -1) {
+        Flush();
+
+        if (len <= m_capacity)
+            return;
+    }
+
+    size_t capacity = m_capacity;
+
+    while (m_len + len > capacity)
+        capacity *= 2;
+
+    char *buf = new char[capacity];
+
+    memcpy(buf, m_buf, m_len);
+    delete [] m_buf;
+
+    m_buf = buf;
+    m_capacity = capacity;
+}
+
+void GCodeEmitter::WriteInt(long value)
+{
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long uvalue = (value < 0)? -(unsigned long)value : value;
+
+    do {
+        digits[--i] = '0' + (uvalue % 10);
+        uvalue /= 10;
+    } while (uvalue != 0);
+
+    if (value < 0)
+        digits[--i] = '-';
+
+    Write(&digits[i], sizeof(digits) - i);
+}
+
+void GCodeEmitter::WriteReal(Real value, int format, int precision)
+{
+    char str[64];
+
+    if (m_len + sizeof(str) > m_capacity)
+        MakeRoom(sizeof(str));
+
+    m_len += FormatReal(&m_buf[m_len], value, format, precision);
+}
+
+/*
+ * Rounds 'scaled' to the nearest integer.  Returns false when the value is so close
+ * to a tie that the rounding error of the scaling could have changed the result,
+ * the caller should let printf sort that out.
+ */
+static inline bool RoundScaled(Real scaled, unsigned long long &n)
+{
+    n = (unsigned long long)scaled;
+
+    Real frac = scaled - (Real)n;
+    Real guard = scaled * (8 * LDBL_EPSILON);
+
+    if (fabsl(frac - 0.5L) <= guard)
+        return false;
+
+    if (frac > 0.5L)
+        n++;
+
+    return true;
+}
+
+/* Writes 'n' as exactly 'count' digits (zero padded) */
+static inline void WriteDigits(char *out, unsigned long long n, int count)
+{
+    for (int i = count - 1; i >= 0; i--) {
+        out[i] = '0' + (char)(n % 10);
+        n /= 10;
+    }
+}
+
+static int FormatFallback(char *out, Real value, int format, int precision)
+{
+    int len;
+
+    if (format == NUMFMT_GENERAL)
+        len = snprintf(out, 64, "%.*Lg", precision, value);
+    else
+        len = snprintf(out, 64, "%.*Lf", precision, value);
+
+    if (len < 0 || len >= 64) {
+        /* Huge numbers, this is not going to be valid GCode anyway */
+        strcpy(out, "0");
+        len = 1;
+    }
+
+    return len;
+}
+
+static int FormatGeneral(char *out, Real value, int precision)
+{
+    if (precision == 0)
+        precision = 1;
+
+    if (precision > MAX_FAST_DIGITS || !isfinite(value))
+        return FormatFallback(out, value, NUMFMT_GENERAL, precision);
+
+    bool negative = signbit(value);
+    Real a = negative? -value : value;
+    char *p = out;
+
+    if (a == 0) {
+        if (negative)
+            *p++ = '-';
+        *p++ = '0';
+
+        return p - out;
+    }
+
+    /* printf switches to exponential notation out of this range */
+    if (a < 1e-4L || a >= pow10Table[precision])
+        return FormatFallback(out, value, NUMFMT_GENERAL, precision);
+
+    /* Find the decimal exponent, a is in [10^e, 10^(e+1)) */
+    int e;
+
+    if (a >= 1) {
+        e = 0;
+        while (e < precision && a >= pow10Table[e + 1])
+            e++;
+    } else {
+        e = -1;
+        while (e > -4 && a * pow10Table[-e] < 1)
+            e--;
+    }
+
+    unsigned long long n;
+
+    if (!RoundScaled(a * pow10Table[precision - 1 - e], n))
+        return FormatFallback(out, value, NUMFMT_GENERAL, precision);
+
+    if (n >= ipow10Table[precision]) {
+        /* Rounding carried into a new digit (e.g. 9.9999996 -> 10) */
+        n /= 10;
+        e++;
+
+        if (e >= precision)
+            return FormatFallback(out, value, NUMFMT_GENERAL, precision);
+    } else if (n < ipow10Table[precision - 1]) {
+        return FormatFallback(out, value, NUMFMT_GENERAL, precision);
+    }
+
+    char digits[MAX_FAST_DIGITS + 1];
+    int count = precision;
+
+    WriteDigits(digits, n, precision);
+
+    /* %g doesn't keep trailing zeros in the fraction */
+    int intDigits = (e >= 0)? e + 1 : 0;
+
+    while (count > intDigits && digits[count - 1] == '0')
+        count--;
+
+    if (negative)
+        *p++ = '-';
+
+    if (e >= 0) {
+        memcpy(p, digits, intDigits);
+        p += intDigits;
+
+        if (count > intDigits) {
+            *p++ = '.';
+            memcpy(p, &digits[intDigits], count - intDigits);
+            p += count - intDigits;
+        }
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = -1; i > e; i--)
+            *p++ = '0';
+
+        memcpy(p, digits, count);
+        p += count;
+    }
+
+    return p - out;
+}
+
+static int FormatFixed(char *out, Real value, int precision, bool trimZeros)
+{
+    if (precision > MAX_FAST_DIGITS || !isfinite(value))
+        return FormatFallback(out, value, NUMFMT_FIXED, precision);
+
+    bool negative = signbit(value);
+    Real a = negative? -value : value;
+    Real scaled = a * pow10Table[precision];
+    unsigned long long n;
+
+    if (scaled >= 1e18L || !RoundScaled(scaled, n)) {
+        int len = FormatFallback(out, value, NUMFMT_FIXED, precision);
+
+        if (trimZeros && precision > 0) {
+            while (out[len - 1] == '0')
+                len--;
+            if (out[len - 1] == '.')
+                len--;
+        }
+        return len;
+    }
+
+    unsigned long long ipart = n / ipow10Table[precision];
+    unsigned long long fpart = n % ipow10Table[precision];
+    int decimals = precision;
+
+    if (trimZeros) {
+        while (decimals > 0 && (fpart % 10) == 0) {
+            fpart /= 10;
+            decimals--;
+        }
+
+        /* Don't write "-0" */
+        if (ipart == 0 && decimals == 0)
+            negative = false;
+    }
+
+    char *p = out;
+    char digits[24];
+    int i = sizeof(digits);
+
+    if (negative)
+        *p++ = '-';
+
+    do {
+        digits[--i] = '0' + (char)(ipart % 10);
+        ipart /= 10;
+    } while (ipart != 0);
+
+    memcpy(p, &digits[i], sizeof(digits) - i);
+    p += sizeof(digits) - i;
+
+    if (decimals > 0) {
+        *p++ = '.';
+        WriteDigits(p, fpart, decimals);
+        p += decimals;
+    }
+
+    return p - out;
+}
+
+/*
+ * Formats a number into 'out' (at least 64 chars), returns the number of characters written.
+ * The output is the same printf would produce, we only call printf for the odd cases
+ * (exponential notation, ties that need exact rounding, etc) because it is slow.
+ */
+int GCodeEmitter::FormatReal(char *out, Real value, int format, int precision)
+{
+    if (precision < 0)
+        precision = 6;
+
+    switch (format) {
+        case NUMFMT_FIXED: return FormatFixed(out, value, precision, false);
+        case NUMFMT_SHORTEST: return FormatFixed(out, value, precision, true);
+        default:
+            return FormatGeneral(out, value, precision);
+    }
+}
+
+/*
+ * Returns value * 10^decimals rounded to an integer, the digits are the same
+ * printf("%.*f") would write.
+ */
+long GCodeEmitter::RoundReal(Real value, int decimals)
+{
+    bool negative = signbit(value);
+    Real a = negative? -value : value;
+    unsigned long long n;
+
+    if (decimals > MAX_FAST_DIGITS || !isfinite(value))
+        return 0;
+
+    Real scaled = a * pow10Table[decimals];
+
+    if (scaled >= 1e18L || !RoundScaled(scaled, n)) {
+        char str[64];
+        int len = FormatFallback(str, a, NUMFMT_FIXED, decimals);
+
+        n = 0;
+        for (int i = 0; i < len; i++) {
+            if (isdigit(str[i]))
+                n = n * 10 + (str[i] - '0');
+        }
+    }
+
+    return negative? -(long)n : (long)n;
+}
+
+void GCodeEmitter::EmitExpr(GExpr *expr)
+{
+    switch (expr->GetKind()) {
+        case NUMBER_EXPR:
+            WriteReal(((GNumberExpr *)expr)->GetValue());
+            break;
+        case VREF_EXPR:
+            Write(((GVarRefExpr *)expr)->GetVarName());
+            break;
+        case ADD_EXPR:
+        case SUB_EXPR:
+        case MUL_EXPR:
+        case DIV_EXPR: {
+            GBinaryExpr *bexpr = (GBinaryExpr *)expr;
+            const char *op;
+
+            switch (expr->GetKind()) {
+                case ADD_EXPR: op = " + "; break;
+                case SUB_EXPR: op = " - "; break;
+                case MUL_EXPR: op = " * "; break;
+                default: op = " / "; break;
+            }
+
+            WriteChar('(');
+            EmitExpr(bexpr->GetLExpr());
+            Write(op, 3);
+            EmitExpr(bexpr->GetRExpr());
+            WriteChar(')');
+            break;
+        }
+    }
+}
+
+void GCodeEmitter::EmitZCompensation(const ZCompensation &zcomp)
+{
+    for (int i = 0; i < 4; i++) {
+        long weight = zcomp.weights[i];
+
+        if (weight < 0) {
+            WriteChar('-');
+            weight = -weight;
+        }
+
+        char digits[5] = { '.', '0', '0', '0', '*' };
+
+        WriteDigits(&digits[1], weight % 1000, 3);
+        WriteInt(weight / 1000);
+        Write(digits, sizeof(digits));
+        WriteChar('#');
+        WriteInt(zcomp.params[i]);
+        Write(" + ", 3);
+    }
+    WriteChar('#');
+    WriteInt(zcomp.GetDepthParameter());
+}
+
+/*
+ * Writes a command, when 'zcomp' is given the Z argument is replaced (or added)
+ * with the compensation formula.
+ */
+void GCodeEmitter::EmitCommand(GCodeCommand *cmd, const ZCompensation *zcomp)
+{
+    vector<GArgument> &args = cmd->GetArguments();
+
+    Write(cmd->GetName());
+
+    for (unsigned int i = 0; i < args.size(); i++) {
+        GArgument &arg = args[i];
+
+        if (arg.name != 'Z' || zcomp == NULL) {
+            WriteChar(' ');
+            WriteChar(arg.name);
+            EmitExpr(arg.expr);
+        } else {
+            Write(" Z[", 3);
+            EmitZCompensation(*zcomp);
+            WriteChar(']');
+        }
+    }
+
+    if (zcomp != NULL && !cmd->HasArgument('Z')) {
+        Write(" Z[", 3);
+        EmitZCompensation(*zcomp);
+        WriteChar(']');
+    }
+}
+
+bool GFileStamp::Read(int fhandle)
+{
+    struct stat st;
+
+    if (fstat(fhandle, &st) != 0)
+        return false;
+
+    size = st.st_size;
+    inode = st.st_ino;
+#if defined(_WIN32)
+    time = (long long)st.st_mtime * 1000000000;
+#elif defined(__APPLE__)
+    time = (long long)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    time = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+
+    return true;
+}
+
+bool GCodeSource::Open(const char *filePath)
+{
+    Close();
+
+    m_fhandle = open(filePath, O_RDONLY|_O_BINARY);
+
+    if (m_fhandle == -1)
+        return false;
+
+    if (!m_stamp.Read(m_fhandle) || m_stamp.size == 0) {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void GCodeSource::Close()
+{
+    if (m_fhandle != -1)
+        close(m_fhandle);
+
+    m_fhandle = -1;
+    m_stamp = GFileStamp();
+    m_window.clear();
+    m_windowStart = 0;
+}
+
+const char *GCodeSource::Get(long long offset, size_t length)
+{
+    if (!Contains(offset, length))
+        return NULL;
+
+    if (offset >= m_windowStart && offset + (long long)length <= m_windowStart + (long long)m_window.size())
+        return m_window.data() + (offset - m_windowStart);
+
+    /* The next window starts here, the statements are copied in the order of the file */
+    size_t size = (size_t)min(m_stamp.size - offset, (long long)max(length, (size_t)SOURCE_WINDOW_SIZE));
+    size_t done = 0;
+
+    m_window.resize(size);
+    m_windowStart = offset;
+
+    if (lseek(m_fhandle, offset, SEEK_SET) != offset) {
+        m_window.clear();
+        return NULL;
+    }
+
+    while (done < size) {
+        long len = size - done;
+        int bytes_read = read(m_fhandle, &m_window[done], (unsigned int)((len < EMIT_BUF_SIZE)? len : EMIT_BUF_SIZE));
+
+        if (bytes_read <= 0)
+            break;
+        done += bytes_read;
+    }
+
+    /* Truncated since it was opened */
+    m_window.resize(done);
+
+    return (done >= length)? m_window.data() : NULL;
+}
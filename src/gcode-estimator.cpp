@@ -0,0 +1,413 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include "gcode-estimator.h"
+
+using namespace std;
+
+/* Segment kinds are indexes in the times by kind */
+#define SEG_KIND_COUNT  (SEG_PROBE + 1)
+
+static inline bool ArcBefore(const GArc &arc, size_t point) { return arc.point < point; }
+
+template <class T>
+static inline bool StopBefore(const T &stop, size_t point) { return stop.point < point; }
+
+/* Feed rate in units per second, the files with no F run at the highest feed rate */
+static inline double FeedSpeed(float feed, const GMachineInfo &minfo)
+{
+    return ((feed > 0)? min((double)feed, minfo.MaxFeedRate) : minfo.MaxFeedRate) / 60;
+}
+
+GCodeTimeEstimator::GCodeTimeEstimator(GCodeInt *ginter)
+{
+    m_ginter = ginter;
+
+    /* A small hobby machine */
+    double scale = (ginter->GetMeasureUnits() == UNIT_INCHES)? 1 / MM_PER_INCH : 1;
+
+    m_MInfo.RapidRate = 2000 * scale;
+    m_MInfo.MaxFeedRate = 1000 * scale;
+    m_MInfo.Acceleration = 100 * scale;
+    m_MInfo.JunctionDeviation = 0.01 * scale;
+    m_MInfo.ToolChangeTime = 30;
+}
+
+/* Time of a move that starts and ends at rest */
+double GCodeTimeEstimator::MoveTime(double length, double speed)
+{
+    double a = m_MInfo.Acceleration;
+
+    if (length <= 0 || speed <= 0)
+        return 0;
+
+    if (length * a >= speed * speed)
+        return length / speed + speed / a;
+
+    return 2 * sqrt(length / a);
+}
+
+/*
+ * Times of the drill and probe cycles.  A drill cycle (G98) goes up to R if
+ * it's below, moves to the hole, goes down to R, feeds to Z, dwells P
+ * seconds (G82) and goes back to the highest of R and the Z it started at.
+ * A probe cycle (O100) moves to the point at the traverse height, probes
+ * down to the board (Z 0) and goes back up.
+ */
+void GCodeTimeEstimator::PlanStops()
+{
+    const GTrajectory &trajectory = m_ginter->GetTrajectory();
+    GSpan<unsigned char> kinds = trajectory.GetKind();
+    GSpan<unsigned int> sources = trajectory.GetSource();
+    GSpan<float> feeds = trajectory.GetFeed();
+    double rapid = m_MInfo.RapidRate / 60;
+    bool hasR = false;
+    Real lastR = 0;
+    vector<unsigned int> points;
+    vector<Real> rs, dwells;
+
+    m_stops.clear();
+
+    for (size_t i = 0; i < kinds.Size(); i++) {
+        if (kinds[i] == SEG_DRILL || kinds[i] == SEG_PROBE)
+            points.push_back(i);
+    }
+
+    /*
+     * The arguments of the drills are read in a loop of their own: the
+     * statements are all over the heap and the reads overlap when there is
+     * nothing else to wait for.  NAN is a drill without R.
+     */
+    rs.resize(points.size());
+    dwells.resize(points.size());
+
+    for (size_t k = 0; k < points.size(); k++) {
+        if (kinds[points[k]] != SEG_DRILL)
+            continue;
+
+        GCodeCommand *cmd = StmtCast<GCodeCommand>(m_ginter->GetStatement(sources[points[k]]));
+
+        rs[k] = cmd->HasArgument('R')? cmd->GetArgumentValue('R') * m_ginter->GetGCodeInfo()->UnitScale : NAN;
+        dwells[k] = (cmd->IsA(G82) && cmd->HasArgument('P'))? cmd->GetArgumentValue('P') : 0;
+    }
+
+    for (size_t k = 0; k < points.size(); k++) {
+        size_t i = points[k];
+        bool afterStop = !m_stops.empty() && m_stops.back().point + 1 == i;
+        Position start = afterStop? m_stops.back().after : trajectory.GetStartPosition(i);
+        Position end = trajectory.GetPosition(i);
+        Stop stop;
+
+        stop.point = i;
+        stop.after = end;
+
+        if (kinds[i] == SEG_PROBE) {
+            double traverse = max((double)end.z, 0.0);
+            double dx = end.x - start.x, dy = end.y - start.y, dz = end.z - start.z;
+
+            stop.time = MoveTime(sqrt(dx * dx + dy * dy + dz * dz), rapid) +
+                        MoveTime(traverse, FeedSpeed(feeds[i], m_MInfo)) +
+                        MoveTime(traverse, rapid);
+        } else {
+            if (!isnan(rs[k])) {
+                lastR = rs[k];
+                hasR = true;
+            }
+
+            Real r = hasR? lastR : start.z;
+            Real retract = max(start.z, r);
+            Real z = start.z;
+            double time = 0;
+
+            if (z < r) {
+                time += MoveTime(r - z, rapid);
+                z = r;
+            }
+
+            time += MoveTime(hypot((double)(end.x - start.x), (double)(end.y - start.y)), rapid);
+            time += MoveTime(z - r, rapid);
+            time += MoveTime(fabs(r - end.z), FeedSpeed(feeds[i], m_MInfo));
+            time += dwells[k];
+            time += MoveTime(retract - end.z, rapid);
+
+            stop.after.z = retract;
+            stop.time = time;
+        }
+
+        m_stops.push_back(stop);
+    }
+}
+
+/*
+ * Geometry and junction speeds of the segments 'first' to 'last - 1', plus
+ * the segment before them.  Segment 'i' goes from point 'i - 1' to point 'i'.
+ */
+void GCodeTimeEstimator::ComputeBlock(size_t first, size_t last)
+{
+    const GTrajectory &trajectory = m_ginter->GetTrajectory();
+    GSpan<Real> xs = trajectory.GetX();
+    GSpan<Real> ys = trajectory.GetY();
+    GSpan<Real> zs = trajectory.GetZ();
+    GSpan<unsigned char> kinds = trajectory.GetKind();
+    GSpan<float> feeds = trajectory.GetFeed();
+    GSpan<GArc> arcs = trajectory.GetArcs();
+    size_t n = last - first;
+    double rapid = m_MInfo.RapidRate / 60;
+    double a = m_MInfo.Acceleration;
+    double delta = m_MInfo.JunctionDeviation;
+
+    /* Point 'first - 2 + k' goes to index 'k', the program starts at 0,0,0 */
+    for (size_t k = 0; k < n + 2; k++) {
+        long point = (long)first - 2 + (long)k;
+
+        m_px[k] = (point >= 0)? (double)xs[point] : 0;
+        m_py[k] = (point >= 0)? (double)ys[point] : 0;
+        m_pz[k] = (point >= 0)? (double)zs[point] : 0;
+    }
+
+    /* The machine is somewhere else after a drill cycle */
+    vector<Stop>::iterator stop = lower_bound(m_stops.begin(), m_stops.end(), (first < 2)? 0 : first - 2, StopBefore<Stop>);
+
+    for (vector<Stop>::iterator it = stop; it != m_stops.end() && it->point < last; it++) {
+        size_t k = it->point + 2 - first;
+
+        m_px[k] = (double)it->after.x;
+        m_py[k] = (double)it->after.y;
+        m_pz[k] = (double)it->after.z;
+    }
+
+    for (size_t j = 0; j <= n; j++) {
+        double dx = m_px[j + 1] - m_px[j];
+        double dy = m_py[j + 1] - m_py[j];
+        double dz = m_pz[j + 1] - m_pz[j];
+        double length = sqrt(dx * dx + dy * dy + dz * dz);
+        double inv = 1 / max(length, 1e-300);
+
+        m_length[j] = length;
+        m_inX[j] = m_outX[j] = dx * inv;
+        m_inY[j] = m_outY[j] = dy * inv;
+        m_inZ[j] = m_outZ[j] = dz * inv;
+    }
+
+    for (size_t j = (first == 0)? 1 : 0; j <= n; j++) {
+        size_t point = first + j - 1;
+
+        m_speed[j] = (kinds[point] == SEG_RAPID)? rapid : FeedSpeed(feeds[point], m_MInfo);
+    }
+
+    /* There is nothing before the program */
+    if (first == 0) {
+        m_length[0] = m_speed[0] = 0;
+        m_outX[0] = m_outY[0] = m_outZ[0] = 0;
+    }
+
+    /* Arcs are longer than their chord, their direction turns and the centripetal acceleration limits their speed */
+    const GArc *arc = lower_bound(arcs.begin(), arcs.end(), (first == 0)? 0 : first - 1, ArcBefore);
+
+    for (; arc != arcs.end() && arc->point < last; arc++) {
+        size_t j = arc->point + 1 - first;
+        double cx = (double)arc->cx, cy = (double)arc->cy;
+        double sweep = (double)arc->sweep;
+        double r = (hypot(m_px[j] - cx, m_py[j] - cy) + hypot(m_px[j + 1] - cx, m_py[j + 1] - cy)) / 2;
+        double arcLength = r * fabs(sweep);
+        double dz = m_pz[j + 1] - m_pz[j];
+        double length = sqrt(arcLength * arcLength + dz * dz);
+        double horizontal = (length > 0)? arcLength / length * ((sweep > 0)? 1 : -1) : 0;
+        double vertical = (length > 0)? dz / length : 0;
+        double a0 = atan2(m_py[j] - cy, m_px[j] - cx);
+        double a1 = a0 + sweep;
+
+        m_length[j] = length;
+        m_inX[j] = -sin(a0) * horizontal;
+        m_inY[j] = cos(a0) * horizontal;
+        m_outX[j] = -sin(a1) * horizontal;
+        m_outY[j] = cos(a1) * horizontal;
+        m_inZ[j] = m_outZ[j] = vertical;
+        m_speed[j] = min(m_speed[j], sqrt(a * r));
+    }
+
+    /* The cycles are planned apart, the machine stops before and after them */
+    for (; stop != m_stops.end() && stop->point < last; stop++) {
+        if (stop->point + 1 < first)
+            continue;
+
+        size_t j = stop->point + 1 - first;
+
+        m_length[j] = m_speed[j] = 0;
+        m_inX[j] = m_inY[j] = m_inZ[j] = 0;
+        m_outX[j] = m_outY[j] = m_outZ[j] = 0;
+    }
+
+    /* Junction deviation: the speed a circle 'delta' away from the corner allows (squared) */
+    for (size_t j = 1; j <= n; j++) {
+        double cosTheta = -(m_outX[j - 1] * m_inX[j] + m_outY[j - 1] * m_inY[j] + m_outZ[j - 1] * m_inZ[j]);
+        double sinHalf = sqrt(max(0.0, 0.5 * (1 - cosTheta)));
+        double speed2 = a * delta * sinHalf / max(1 - sinHalf, 1e-9);
+
+        m_junction[j] = min(speed2, min(m_speed[j - 1] * m_speed[j - 1], m_speed[j] * m_speed[j]));
+    }
+}
+
+void GCodeTimeEstimator::Estimate(GTimeEstimate &estimate)
+{
+    GPhaseTimer timer(m_ginter->GetPhaseTimes(), PHASE_ESTIMATE);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    const GTrajectory &trajectory = m_ginter->GetTrajectory();
+    GSpan<unsigned char> kinds = trajectory.GetKind();
+    GSpan<GToolChange> toolChanges = trajectory.GetToolChanges();
+    size_t count = trajectory.Size();
+    double a = m_MInfo.Acceleration;
+    double invA = 1 / a, halfInvA = 0.5 / a;
+    double kindTime[SEG_KIND_COUNT] = { 0 };
+
+    estimate.ToolChanges = 0;
+    estimate.ToolTime.clear();
+
+    m_px.resize(ESTIMATOR_BLOCK_SIZE + 2);
+    m_py.resize(ESTIMATOR_BLOCK_SIZE + 2);
+    m_pz.resize(ESTIMATOR_BLOCK_SIZE + 2);
+    m_length.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_speed.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_inX.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_inY.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_inZ.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_outX.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_outY.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_outZ.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_junction.resize(ESTIMATOR_BLOCK_SIZE + 1);
+    m_entry.resize(ESTIMATOR_BLOCK_SIZE);
+    m_exit.resize(ESTIMATOR_BLOCK_SIZE);
+    m_time.resize(ESTIMATOR_BLOCK_SIZE);
+
+    PlanStops();
+    m_entryMax.resize(count);
+    m_segLength.resize(count);
+    m_segSpeed.resize(count);
+
+    /*
+     * Backward pass: every segment must be able to slow down for the next
+     * ones, the program ends at rest.  The speeds are propagated squared
+     * (v1² = v0² + 2 a d), there is no square root in the chain.
+     */
+    double exit2 = 0;
+
+    for (size_t last = count; last > 0; ) {
+        size_t first = (last > ESTIMATOR_BLOCK_SIZE)? last - ESTIMATOR_BLOCK_SIZE : 0;
+
+        ComputeBlock(first, last);
+
+        for (size_t j = last - first; j >= 1; j--) {
+            double entry2 = min(m_junction[j], exit2 + 2 * a * m_length[j]);
+
+            m_entryMax[first + j - 1] = (float)entry2;
+            exit2 = entry2;
+        }
+
+        copy(&m_length[1], &m_length[last - first + 1], &m_segLength[first]);
+        copy(&m_speed[1], &m_speed[last - first + 1], &m_segSpeed[first]);
+
+        last = first;
+    }
+
+    /* Forward pass: the entry speeds the acceleration allows, then the time of every segment */
+    double entry2 = 0;
+    size_t nextChange = 0;
+    int tool = 0;
+    double toolTime = 0;
+
+    for (size_t first = 0; first < count; first += ESTIMATOR_BLOCK_SIZE) {
+        size_t last = min(first + ESTIMATOR_BLOCK_SIZE, count);
+        size_t n = last - first;
+        const double *length = &m_segLength[first];
+        const double *speed = &m_segSpeed[first];
+
+        /* The speed reached at the end of the segment before the block, the program starts at rest */
+        if (first > 0)
+            entry2 = min((double)m_entryMax[first], entry2 + 2 * a * length[-1]);
+        m_entry[0] = entry2;
+
+        for (size_t k = 1; k < n; k++) {
+            entry2 = min((double)m_entryMax[first + k], entry2 + 2 * a * length[k - 1]);
+            m_entry[k] = entry2;
+        }
+
+        for (size_t k = 0; k + 1 < n; k++)
+            m_exit[k] = m_entry[k + 1];
+
+        m_exit[n - 1] = (last < count)? min((double)m_entryMax[last], entry2 + 2 * a * length[n - 1]) : 0;
+
+        /* Trapezoid if there is room to cruise, triangle otherwise */
+        for (size_t k = 0; k < n; k++) {
+            double v = max(speed[k], 1e-9);
+            double v0 = min(sqrt(m_entry[k]), v);
+            double v1 = min(sqrt(m_exit[k]), v);
+            double cruise = length[k] - (2 * v * v - v0 * v0 - v1 * v1) * halfInvA;
+            double peak = sqrt(max(a * length[k] + (v0 * v0 + v1 * v1) / 2, 0.0));
+            double trapezoid = (2 * v - v0 - v1) * invA + cruise / v;
+            double triangle = (2 * peak - v0 - v1) * invA;
+
+            m_time[k] = max((cruise >= 0)? trapezoid : triangle, 0.0);
+        }
+
+        vector<Stop>::iterator stop = lower_bound(m_stops.begin(), m_stops.end(), first, StopBefore<Stop>);
+
+        for (; stop != m_stops.end() && stop->point < last; stop++)
+            m_time[stop->point - first] = stop->time;
+
+        for (size_t k = 0; k < n; k++) {
+            size_t point = first + k;
+
+            while (nextChange < toolChanges.Size() && toolChanges[nextChange].point <= point) {
+                if (toolTime > 0)
+                    estimate.ToolTime[tool] += toolTime;
+                estimate.ToolChanges += m_MInfo.ToolChangeTime;
+                tool = toolChanges[nextChange++].tool;
+                toolTime = 0;
+            }
+
+            kindTime[kinds[point]] += m_time[k];
+            toolTime += m_time[k];
+        }
+    }
+
+    /* Changes after the last move */
+    for (; nextChange < toolChanges.Size(); nextChange++) {
+        if (toolTime > 0)
+            estimate.ToolTime[tool] += toolTime;
+        estimate.ToolChanges += m_MInfo.ToolChangeTime;
+        tool = toolChanges[nextChange].tool;
+        toolTime = 0;
+    }
+
+    estimate.ToolTime[tool] += toolTime;
+
+    estimate.Rapid = kindTime[SEG_RAPID];
+    estimate.Cutting = kindTime[SEG_CUT] + kindTime[SEG_ARC];
+    estimate.Drilling = kindTime[SEG_DRILL];
+    estimate.Probing = kindTime[SEG_PROBE];
+    estimate.Total = estimate.Rapid + estimate.Cutting + estimate.Drilling + estimate.Probing + estimate.ToolChanges;
+
+    m_entryMax.clear();
+    m_entryMax.shrink_to_fit();
+    m_segLength.clear();
+    m_segLength.shrink_to_fit();
+    m_segSpeed.clear();
+    m_segSpeed.shrink_to_fit();
+
+    estimate.EstimateTime = (int)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,179 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "gcode-export.h"
+#include "gcode-emitter.h"
+
+#ifdef _MSC_VER
+#define snprintf _snprintf
+#endif
+
+using namespace std;
+
+/*
+ * Opens the file of a column and writes its .npy header (format 1.0): magic, length
+ * of the header and a Python dict with the type, padded so the data starts
+ * at a multiple of 64 bytes.  'type' is the NumPy kind ('f', 'u').
+ */
+static bool OpenColumn(GCodeEmitter &outs, const string &path, char type, size_t itemSize, size_t count, GDiagnostics &diagnostics)
+{
+    unsigned short one = 1;
+    char order = (itemSize == 1)? '|' : (*(unsigned char *)&one == 1)? '<' : '>';
+    char header[128];
+
+    if (!outs.Open(path.c_str())) {
+        diagnostics << "Unable to open file: " << path << endl;
+        return false;
+    }
+
+    int len = snprintf(header, sizeof(header), "{'descr': '%c%c%u', 'fortran_order': False, 'shape': (%llu,), }",
+                       order, type, (unsigned int)itemSize, (unsigned long long)count);
+    size_t padded = (10 + len + 1 + 63) / 64 * 64 - 10;
+    unsigned char length[2] = { (unsigned char)(padded & 0xff), (unsigned char)(padded >> 8) };
+
+    outs.Write("\x93NUMPY\x01\x00", 8);
+    outs.Write((const char *)length, 2);
+    outs.Write(header, len);
+
+    for (size_t i = len; i + 1 < padded; i++)
+        outs << ' ';
+    outs << '\n';
+
+    return true;
+}
+
+static bool CloseColumn(GCodeEmitter &outs, const string &path, GDiagnostics &diagnostics)
+{
+    if (!outs.Close()) {
+        diagnostics << "Error writing file: " << path << endl;
+        return false;
+    }
+
+    return true;
+}
+
+template <class T>
+static bool WriteColumn(const string &path, char type, GSpan<T> values, GDiagnostics &diagnostics)
+{
+    GCodeEmitter outs;
+
+    if (!OpenColumn(outs, path, type, sizeof(T), values.Size(), diagnostics))
+        return false;
+
+    outs.WriteBlock((const char *)values.begin(), values.Size() * sizeof(T));
+
+    return CloseColumn(outs, path, diagnostics);
+}
+
+/* float64 whatever Real is */
+static bool WriteRealColumn(const string &path, GSpan<Real> values, GDiagnostics &diagnostics)
+{
+    if (sizeof(Real) == sizeof(double))
+        return WriteColumn(path, 'f', GSpan<double>((const double *)values.begin(), values.Size()), diagnostics);
+
+    GCodeEmitter outs;
+    vector<double> chunk(EXPORT_CHUNK_POINTS);
+
+    if (!OpenColumn(outs, path, 'f', sizeof(double), values.Size(), diagnostics))
+        return false;
+
+    for (size_t first = 0; first < values.Size(); first += EXPORT_CHUNK_POINTS) {
+        size_t count = min((size_t)EXPORT_CHUNK_POINTS, values.Size() - first);
+
+        for (size_t i = 0; i < count; i++)
+            chunk[i] = (double)values[first + i];
+
+        outs.WriteBlock((const char *)&chunk[0], count * sizeof(double));
+    }
+
+    return CloseColumn(outs, path, diagnostics);
+}
+
+/*
+ * Line of the statement of every point, from the spans of the commands in the
+ * file (see GCodeCommand::GetSourceOffset).  The statements follow the order
+ * of the file, so the line ends are counted once.
+ */
+static void ComputeSourceLines(GCodeInt *ginter, GCodeSource &source, vector<unsigned int> &lines)
+{
+    GSpan<unsigned int> sources = ginter->GetTrajectory().GetSource();
+    GSpan<unsigned char> kinds = ginter->GetTrajectory().GetKind();
+    unsigned int count = ginter->GetStatementCount();
+    long long scanned = 0;
+    unsigned int line = 1;
+
+    lines.assign(sources.Size(), 0);
+
+    if (!source.IsOpen())
+        return;
+
+    for (size_t i = 0; i < sources.Size(); i++) {
+        /* The source of a probe cycle is the statement after the O100 call, it has no line */
+        if (kinds[i] == SEG_PROBE || sources[i] >= count)
+            continue;
+
+        GCodeCommand *cmd = StmtCast<GCodeCommand>(ginter->GetStatement(sources[i]));
+
+        if (cmd == NULL || cmd->GetSourceLength() == 0 || !source.Contains(cmd->GetSourceOffset(), cmd->GetSourceLength()))
+            continue;
+
+        long long offset = cmd->GetSourceOffset();
+
+        if (offset < scanned) {
+            scanned = 0;
+            line = 1;
+        }
+
+        while (scanned < offset) {
+            size_t length = (size_t)min(offset - scanned, (long long)SOURCE_WINDOW_SIZE);
+            const char *data = source.Get(scanned, length);
+
+            /* Truncated, the lines of the rest aren't known */
+            if (data == NULL)
+                return;
+
+            for (const char *eol = data; (eol = (const char *)memchr(eol, '\n', data + length - eol)) != NULL; eol++)
+                line++;
+
+            scanned += length;
+        }
+
+        lines[i] = line;
+    }
+}
+
+bool ExportTrajectory(GCodeInt *ginter, const string &prefix, GDiagnostics &diagnostics)
+{
+    const GTrajectory &trajectory = ginter->GetTrajectory();
+    vector<unsigned int> lines;
+    GCodeSource source;
+
+    /* The lines are left at 0 if the file changed since it was loaded */
+    ginter->OpenSource(source);
+    ComputeSourceLines(ginter, source, lines);
+    source.Close();
+
+    return WriteRealColumn(prefix + "x.npy", trajectory.GetX(), diagnostics) &&
+           WriteRealColumn(prefix + "y.npy", trajectory.GetY(), diagnostics) &&
+           WriteRealColumn(prefix + "z.npy", trajectory.GetZ(), diagnostics) &&
+           WriteColumn(prefix + "feed.npy", 'f', trajectory.GetFeed(), diagnostics) &&
+           WriteColumn(prefix + "kind.npy", 'u', trajectory.GetKind(), diagnostics) &&
+           WriteColumn(prefix + "source.npy", 'u', trajectory.GetSource(), diagnostics) &&
+           WriteColumn(prefix + "line.npy", 'u', GSpan<unsigned int>(lines.data(), lines.size()), diagnostics);
+}
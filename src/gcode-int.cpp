@@ -13,10 +13,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <QProgressDialog>
-#include <QMessageBox>
-#include <QTime>
 #include <limits>
+#include <chrono>
+#include <algorithm>
+#include <unordered_set>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -26,42 +26,251 @@
 #include <io.h>
 #endif
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
 #ifndef _WIN32
 //Linux treat binary and text the same, Windows doesn't
 #define _O_BINARY 0
 
 #include <unistd.h>
-
-#define tell(fd) lseek(fd, 0, SEEK_CUR)
 #endif
 
 #include "gcode-int.h"
+#include "gcode-arc.h"
+#include "gcode-stats.h"
+#include "gcode-emitter.h"
 
 using namespace std;
 
-extern stringstream out_err;
-
-static inline void UpdateBoardArea(Real x, Real y, GCodeInfo &gi)	
+/* Calls 'visit' with every parameter read by 'expr' */
+template <class Visit>
+static void VisitVarRefs(GExpr *expr, Visit &visit)
 {
-        if (x < gi.BoardMinX)
-            gi.BoardMinX = x;
-		
-        if (x > gi.BoardMaxX)
-            gi.BoardMaxX = x;
-		
-        if (y < gi.BoardMinY)
-            gi.BoardMinY = y;
-		
-        if (y > gi.BoardMaxY)
-            gi.BoardMaxY = y;
+	switch (expr->GetKind()) {
+		case VREF_EXPR:
+			visit((GVarRefExpr *)expr);
+			break;
+		case ADD_EXPR:
+		case SUB_EXPR:
+		case MUL_EXPR:
+		case DIV_EXPR: {
+			GBinaryExpr *bexpr = (GBinaryExpr *)expr;
+
+			VisitVarRefs(bexpr->GetLExpr(), visit);
+			VisitVarRefs(bexpr->GetRExpr(), visit);
+			break;
+		}
+	}
 }
 
+/* Records a command as a reader of the parameters it reads */
+struct AddReaders
+{
+	GParameterDeps &deps;
+	unsigned int stmt;
+
+	AddReaders(GParameterDeps &deps, unsigned int stmt): deps(deps) { this->stmt = stmt; }
+	void operator()(GVarRefExpr *vref) { deps.AddReader(vref, stmt); }
+};
+
+/* Finds whether an expression reads any of 'vars' (any parameter if it's empty) */
+struct FindVarRefs
+{
+	const unordered_set<string> &vars;
+	bool found;
+
+	FindVarRefs(const unordered_set<string> &vars): vars(vars) { found = false; }
+
+	void operator()(GVarRefExpr *vref) {
+		if (vars.empty() || vars.count(vref->GetVarName()) != 0)
+			found = true;
+	}
+};
+
+/* Finds whether an expression read at a point of the program reads a parameter that doesn't have its last value there */
+struct FindChangedLater
+{
+	GParameterDeps &deps;
+	unsigned int stmt;
+	unsigned long order;
+	bool found;
+
+	FindChangedLater(GParameterDeps &deps, unsigned int stmt, unsigned long order): deps(deps) {
+		this->stmt = stmt;
+		this->order = order;
+		found = false;
+	}
+
+	void operator()(GVarRefExpr *vref) {
+		if (!deps.HasLastValue(vref, stmt, order))
+			found = true;
+	}
+};
+
+/* Processes the statements as they are parsed */
+struct GCodeInt::LoadVisitor: public GStmtVisitor<LoadVisitor>
+{
+	GCodeInt *ginter;
+	GCodeInfo &gi;
+	Position pos;	//Trajectory position
+	Real feed;		//Feed rate in effect
+	int tool;		//Last T word
+	bool streaming;	//Nothing is kept for later, see StreamFile
+	unordered_set<string> noVars;	//Any parameter, for FindVarRefs
+
+	LoadVisitor(GCodeInt *ginter, bool streaming): gi(ginter->gi) {
+		this->ginter = ginter;
+		this->streaming = streaming;
+		feed = 0;
+		tool = 0;
+	}
+
+	void VisitAssign(GCodeAssign &assign_stmt) {
+		string varname = assign_stmt.GetVariable();
+		GExpr *expr = assign_stmt.GetExpr();
+		Real value = ginter->EvalExpr(expr);
+		FindVarRefs refs(noVars);
+
+		ginter->gparameters.Set(varname, value);
+
+		if (streaming)
+			return;
+
+		VisitVarRefs(expr, refs);
+		ginter->m_paramDeps.AddAssignment(varname, expr, refs.found, ginter->slist.size());
+	}
+
+	void VisitCommand(GCodeCommand &cmd_stmt) {
+		vector<GArgument> &args = cmd_stmt.GetArguments();
+		AddReaders readers(ginter->m_paramDeps, ginter->slist.size());
+
+		ginter->EvalArguments(cmd_stmt);
+
+		for (unsigned int i = 0; i < args.size() && !streaming; i++)
+			VisitVarRefs(args[i].expr, readers);
+
+		if (cmd_stmt.HasArgument('F'))
+			feed = cmd_stmt.GetArgumentValue('F');
+
+		if (cmd_stmt.HasArgument('T'))
+			tool = (int)cmd_stmt.GetArgumentValue('T');
+
+		if (cmd_stmt.IsA(M06))
+			ginter->m_trajectory.AddToolChange(tool);
+
+		switch ( cmd_stmt.GetOpcode() ) {
+			case G20: gi.UnitType = UNIT_INCHES; break;
+			case G21: gi.UnitType = UNIT_MM; break;
+		}
+
+		/* The commands that move, they have a point each */
+		int kind = -1;
+
+		if (cmd_stmt.IsA(G81) || cmd_stmt.IsA(G82))
+			kind = SEG_DRILL;
+		else if (cmd_stmt.IsMotionCommand())
+			kind = cmd_stmt.IsA(G00)? SEG_RAPID : SEG_CUT;
+
+		if (kind != -1) {
+			Position from = pos;
+			GArc arc;
+
+			MoveTo(cmd_stmt, pos);
+
+			/* An arc that isn't valid is taken as a straight cut */
+			if (kind == SEG_CUT && (cmd_stmt.IsA(G02) || cmd_stmt.IsA(G03)) && ComputeArc(cmd_stmt, from, pos, arc))
+				ginter->m_trajectory.AddArc(pos, arc, ginter->slist.size(), feed);
+			else
+				ginter->m_trajectory.Add(pos, kind, ginter->slist.size(), feed);
+		}
+
+		ginter->slist.push_back(&cmd_stmt);
+	}
+
+	void VisitSubCall(GCodeSubCall &subcall_stmt) {
+		/* Is this a probe point? */
+		if (subcall_stmt.GetSubID() == _O(100) &&
+			subcall_stmt.GetArgumentCount() > 2) {
+
+			GExpr *arg0 = subcall_stmt.GetArgument(0); // First argument is X coordinate
+			GExpr *arg1 = subcall_stmt.GetArgument(1); // Second argument is Y coordinate
+			GProbeCall call;
+			FindVarRefs refs(noVars);
+
+			Real x_value = ginter->EvalExpr(arg0);
+			Real y_value = ginter->EvalExpr(arg1);
+			Position p;
+
+			p.x = x_value;
+			p.y = y_value;
+
+			if (!streaming)
+				ginter->probePoints->push_back(p);
+
+			/* O100 x y traverse_height probe_depth traverse_speed probe_speed, see GCodeAutoleveller */
+			p.z = ginter->EvalExpr(subcall_stmt.GetArgument(2));
+
+			Real probeSpeed = (subcall_stmt.GetArgumentCount() > 5)? ginter->EvalExpr(subcall_stmt.GetArgument(5)) : 0;
+
+			call.args[0] = arg0;
+			call.args[1] = arg1;
+			call.args[2] = subcall_stmt.GetArgument(2);
+			call.args[3] = (subcall_stmt.GetArgumentCount() > 5)? subcall_stmt.GetArgument(5) : NULL;
+
+			for (int i = 0; i < 4 && !streaming; i++) {
+				if (call.args[i] != NULL)
+					VisitVarRefs(call.args[i], refs);
+			}
+
+			if (refs.found) {
+				call.point = ginter->m_trajectory.Size();
+				call.probePoint = --ginter->probePoints->end();
+				call.stmt = ginter->slist.size();
+				call.order = ginter->m_paramDeps.GetAssignmentCount();
+				ginter->m_probeCalls.push_back(call);
+			}
+
+			ginter->m_trajectory.Add(p, SEG_PROBE, ginter->slist.size(), probeSpeed);
+		}
+	}
+};
+
+/* Adds up the memory used by the statements */
+struct MemoryVisitor: public GStmtVisitor<MemoryVisitor>
+{
+	GCodeMemoryUsage &usage;
+
+	MemoryVisitor(GCodeMemoryUsage &usage): usage(usage) { }
+
+	void VisitAssign(GCodeAssign &) {
+		usage.Statements += sizeof(GCodeAssign);
+	}
+
+	void VisitCommand(GCodeCommand &cmd) {
+		usage.Statements += sizeof(GCodeCommand);
+		usage.Arguments += cmd.GetArguments().capacity() * sizeof(GArgument);
+		usage.Strings += StringHeapBytes(cmd.GetName());
+	}
+
+	void VisitSubCall(GCodeSubCall &subcall) {
+		usage.Statements += sizeof(GCodeSubCall);
+		usage.Arguments += subcall.GetArgumentCount() * sizeof(GExpr *);
+	}
+};
+
 GCodeInt::GCodeInt(string filePath)
 {
 	m_filePath = filePath;
 	m_gparser = 0;
-	itCurrentStmt = slist.end();
 	probePoints = new list<Position>();
+	m_autolevellerMemory = 0;
+	m_canonicalUnits = UNIT_FILE;
+	m_streamOffset = 0;
+	m_streamExprs = m_streamUniqueExprs = 0;
 }
 
 GCodeInt::~GCodeInt(void)
@@ -69,194 +278,660 @@ GCodeInt::~GCodeInt(void)
 	if (m_gparser != NULL)
 		delete m_gparser;
 
-	itCurrentStmt = slist.begin();
-	while (itCurrentStmt != slist.end()) {
-		GCodeStmt *gstmt = *itCurrentStmt;
-
-		delete gstmt;
-		itCurrentStmt++;
-	}
+	for (unsigned int i = 0; i < slist.size(); i++)
+		delete slist[i];
 
 	slist.clear();
 	probePoints->clear();
-	gparameters.clear();
+	gparameters.Clear();
+	m_paramDeps.Clear();
 
 	delete probePoints;
 }
 
-bool GCodeInt::LoadFile()
+long long GetPhysicalMemory()
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+
+	status.dwLength = sizeof(status);
+	if (GlobalMemoryStatusEx(&status))
+		return (long long)status.ullTotalPhys;
+#else
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pageSize = sysconf(_SC_PAGE_SIZE);
+
+	if (pages > 0 && pageSize > 0)
+		return (long long)pages * pageSize;
+#endif
+
+	return 0;
+}
+
+static inline long ElapsedMs(chrono::steady_clock::time_point since)
+{
+	return (long)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - since).count();
+}
+
+static inline double ElapsedSeconds(chrono::steady_clock::time_point since)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - since).count();
+}
+
+/* Time taken by a clock read, it's about the time of lexing a token */
+static double ClockReadSeconds()
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	for (int i = 0; i < 63; i++)
+		chrono::steady_clock::now();
+
+	return ElapsedSeconds(start) / 64;
+}
+
+Real GCodeInt::GetUnitScale(int unitType)
+{
+	if (m_canonicalUnits == UNIT_FILE || m_canonicalUnits == unitType)
+		return 1;
+
+	return (m_canonicalUnits == UNIT_MM)? MM_PER_INCH : 1 / MM_PER_INCH;
+}
+
+/*
+ * Hands the window to the consumer and frees it, see StreamFile.  The
+ * trajectory is left with the position the next window starts at.
+ */
+bool GCodeInt::FlushWindow(GCodeStreamConsumer *consumer, LoadVisitor &loader, GMotionStats &stats)
+{
+	Real scale = GetUnitScale(gi.UnitType);
+	bool consumed = true;
+
+	gi.SourceUnitType = gi.UnitType;
+	gi.UnitScale = scale;
+
+	if (scale != 1) {
+		GPhaseTimer timer(m_phaseTimes, PHASE_NORMALISE);
+
+		m_trajectory.Scale(scale, 1);
+	}
+
+	{
+		GPhaseTimer timer(m_phaseTimes, PHASE_STATS);
+
+		stats.Add(m_trajectory, 1, m_trajectory.Size());
+	}
+
+	if (consumer != NULL)
+		consumed = consumer->ConsumeWindow(this, m_streamOffset, 1);
+
+	m_streamOffset += slist.size();
+
+	for (unsigned int i = 0; i < slist.size(); i++)
+		delete slist[i];
+
+	slist.clear();
+
+	/* Nothing refers to the expressions of the window anymore */
+	m_streamExprs += m_exprPool.GetRequestCount();
+	m_streamUniqueExprs += m_exprPool.GetNodeCount();
+	m_exprPool.Clear();
+
+	Position start = loader.pos;
+
+	start.x *= scale;
+	start.y *= scale;
+	start.z *= scale;
+
+	m_trajectory.Clear();
+	m_trajectory.Add(start, SEG_RAPID, 0, 0);
+
+	return consumed;
+}
+
+bool GCodeInt::ReadFile(GDiagnostics &diagnostics, GCodeLoadListener *listener, GCodeStreamConsumer *consumer, bool streaming)
 {
 	int fileHandle = open(m_filePath.c_str(), O_RDONLY|_O_BINARY);
 
 	/*m_in.open(m_filePath, ifstream::in);
 
     if (!m_in.is_open()) {
-        out_err << "Unable to open file: " << m_filePath << endl;
+        diagnostics << "Unable to open file: " << m_filePath << endl;
         return false;
     }*/
 
 	if (fileHandle == -1) {
-		out_err << "Unable to open file: " << m_filePath << endl;
+		diagnostics << "Unable to open file: " << m_filePath << endl;
         return false;
 	}
-	
-	QProgressDialog *dialog = new QProgressDialog();
 
-	int size = lseek(fileHandle, 0, SEEK_END);
-
-	dialog->setRange(0, size);
-	dialog->setModal(false);
-	dialog->show();
+	long size = lseek(fileHandle, 0, SEEK_END);
 
 	lseek(fileHandle, 0, SEEK_SET);
 
-    bool definedMillRouteDepth = false;
+	if (!m_sourceStamp.Read(fileHandle))
+		m_sourceStamp = GFileStamp();
+
+	LoadVisitor loader(this, streaming);
+	GMotionStats streamStats;
+
+	/* Nothing of a previous load is kept, whether it was streamed or not */
+	for (unsigned int i = 0; i < slist.size(); i++)
+		delete slist[i];
+
+	slist.clear();
+	m_exprPool.Clear();
+	gparameters.Clear();
+	m_paramDeps.Clear();
+	m_probeCalls.clear();
+	probePoints->clear();
+	m_trajectory.Clear();
+	m_streamOffset = 0;
+	m_streamExprs = m_streamUniqueExprs = 0;
+
+	if (m_gparser != NULL)
+		delete m_gparser;
+
+	GCodeLexer *lexer = new GCodeLexer(fileHandle, &diagnostics);
+	m_gparser = new GCodeParser(lexer, &m_exprPool);
 
-	GCodeLexer *lexer = new GCodeLexer(fileHandle);
-	m_gparser = new GCodeParser(lexer);
+	gi.UnitType = UNIT_MM;
+	gi.UnitScale = 1;
 
-    gi.BoardMinX = numeric_limits<Real>::infinity();
-    gi.BoardMinY = numeric_limits<Real>::infinity();
-    gi.BoardMaxX = -numeric_limits<Real>::infinity();
-    gi.BoardMaxY = -numeric_limits<Real>::infinity();
+	/* Every window starts with the position its first move starts at, the program starts at 0,0,0 */
+	if (streaming)
+		m_trajectory.Add(Position(), SEG_RAPID, 0, 0);
 
 	//Preprocess command list
-	QTime time;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	long nextProgress = LOAD_PROGRESS_BYTES;
+	long lastProgressMs = 0;
+	bool result = true;
+	unsigned long statementCount = 0;
+	double progressSeconds = 0;
+	double flushSeconds = 0;	//In the consumer, it times itself
+	double sampleParse = 0, sampleEval = 0;	//Of the timed statements, the lexer keeps their lex time
 
-	time.start();
+	if (listener != NULL)
+		listener->UpdateProgress(0, size);
 
 	m_gparser->Init();
 	while (!m_gparser->IsAtEnd()) {
 		
 		GCodeStmt *gs;
+		bool sample = (statementCount++ % LOAD_TIMING_SAMPLE) == 0;
+		chrono::steady_clock::time_point sampleStart;
+		double lexBefore = 0, readBefore = 0;
+
+		if (IsCancelled()) {
+			diagnostics << "Loading of " << m_filePath << " cancelled" << endl;
+			result = false;
+			break;
+		}
+
+		if (sample) {
+			lexBefore = lexer->GetLexSeconds();
+			readBefore = lexer->GetReadSeconds();
+			lexer->SetTiming(true);
+			sampleStart = chrono::steady_clock::now();
+		}
 
 		if (!m_gparser->GetNextStatement(gs)) {
-			dialog->close();
-			return false;
+			result = false;
+			break;
 		}
 
-		dialog->setValue(tell(fileHandle));
+		if (sample) {
+			lexer->SetTiming(false);
+			sampleParse += ElapsedSeconds(sampleStart) - (lexer->GetLexSeconds() - lexBefore) -
+						   (lexer->GetReadSeconds() - readBefore);
+		}
 
-		if (gs == NULL)
-			continue;
+		/* The clock is only read every LOAD_PROGRESS_BYTES */
+		if (listener != NULL && lexer->GetBytesRead() >= nextProgress) {
+			long ms = ElapsedMs(start);
 
-		switch (gs->GetKind()) {
-			case ASSIGN_STMT: {
-				GCodeAssign *assign_stmt = (GCodeAssign *)gs;
-				string varname = assign_stmt->GetVariable();
-				Real value = EvalExpr(assign_stmt->GetExpr());
+			nextProgress = lexer->GetBytesRead() + LOAD_PROGRESS_BYTES;
+			if (ms - lastProgressMs >= LOAD_PROGRESS_MS) {
+				chrono::steady_clock::time_point progressStart = chrono::steady_clock::now();
 
-				gparameters[varname] = value;
-				delete gs;
-				break;
+				listener->UpdateProgress(lexer->GetBytesRead(), size);
+				lastProgressMs = ms;
+				progressSeconds += ElapsedSeconds(progressStart);
 			}
-			case COMMAND_STMT: {
-				GCodeCommand *cmd_stmt = (GCodeCommand *)gs;
-
-				switch ( cmd_stmt->GetOpcode() ) {
-                    case G20: gi.UnitType = UNIT_INCHES; slist.push_back(gs); break;
-                    case G21: gi.UnitType = UNIT_MM; slist.push_back(gs); break;
-
-					case G82:
-                    case G81:
-						moveTo(*cmd_stmt, gi.Pos);
-						UpdateBoardArea(gi.Pos.x, gi.Pos.y, gi);
-						
-						slist.push_back(gs);
-						break;
-					default:
-						if (cmd_stmt->IsMotionCommand()) {
-							/*
-							 * We have a move command, if our z is below zero then this will
-							 * count towards our area
-							 */
-                            moveToWithEval(*cmd_stmt, gi.Pos);
-
-							if (gi.Pos.z < 0) {
-								if (!definedMillRouteDepth || (gi.Pos.z < gi.MillRouteDepth))
-									gi.MillRouteDepth = gi.Pos.z;
-
-								UpdateBoardArea(gi.Pos.x, gi.Pos.y, gi);
-							}
-
-                        }
-                        slist.push_back(gs);
-
-						break;
-				}
-				break;
-			}
-			case SUBCALL_STMT: {
-				GCodeSubCall *subcall_stmt = (GCodeSubCall *)gs;
+		}
 
-				/* Is this a probe point? */
-				if (subcall_stmt->GetSubID() == _O(100) &&
-					subcall_stmt->GetArgumentCount() > 2) {
+		if (gs == NULL)
+			continue;
 
-					GExpr *arg0 = subcall_stmt->GetArgument(0); // First argument is X coordinate
-					GExpr *arg1 = subcall_stmt->GetArgument(1); // Second argument is Y coordinate
+		if (sample)
+			sampleStart = chrono::steady_clock::now();
 
-					Real x_value = EvalExpr(arg0);
-					Real y_value = EvalExpr(arg1);
-					Position p;
+		loader.Visit(gs);
 
-					p.x = x_value;
-					p.y = y_value;
+		if (sample)
+			sampleEval += ElapsedSeconds(sampleStart);
 
-					UpdateBoardArea(x_value, y_value, gi);
+		/* Only commands are kept */
+		if (gs->GetKind() != COMMAND_STMT)
+			delete gs;
 
-					probePoints->push_back(p);
-				}
-				delete gs;
+		/* The probe cycles add points but no statements */
+		if (streaming && max(slist.size(), m_trajectory.Size()) >= STREAM_WINDOW_STATEMENTS) {
+			chrono::steady_clock::time_point flushStart = chrono::steady_clock::now();
+			bool consumed = FlushWindow(consumer, loader, streamStats);
+
+			flushSeconds += ElapsedSeconds(flushStart);
+
+			if (!consumed) {
+				result = false;
 				break;
 			}
 		}
     }
 
-	dialog->close();
+	/*
+	 * Lexing, parsing and evaluation are interleaved and too fine grained to
+	 * time every one, the time of the loop (reads and progress aside) is split
+	 * like it's split in the timed statements.  Every timed token adds a clock
+	 * read to its lex time and one to the parse time of its statement.
+	 */
+	double readSeconds = lexer->GetReadSeconds();
+	double loopSeconds = max(0.0, ElapsedSeconds(start) - progressSeconds - flushSeconds - readSeconds);
+	double clockSeconds = lexer->GetTimedTokens() * ClockReadSeconds();
+	double sampleLex = max(0.0, lexer->GetLexSeconds() - clockSeconds);
+	double sampleSeconds;
+
+	sampleParse = max(0.0, sampleParse - clockSeconds);
+	sampleSeconds = sampleLex + sampleParse + sampleEval;
+
+	m_phaseTimes.Add(PHASE_READ, readSeconds);
+	if (sampleSeconds > 0) {
+		m_phaseTimes.Add(PHASE_LEX, loopSeconds * sampleLex / sampleSeconds);
+		m_phaseTimes.Add(PHASE_PARSE, loopSeconds * sampleParse / sampleSeconds);
+		m_phaseTimes.Add(PHASE_EVAL, loopSeconds * sampleEval / sampleSeconds);
+	}
+
 	delete lexer;
 	close(fileHandle);
 
-	int difference = time.elapsed();
-	QMessageBox::information(NULL, "Duration", QString("Elapsed Time ") + QString::number(difference) + "ms");
+	if (!result)
+		return false;
+
+	if (streaming) {
+		if (!FlushWindow(consumer, loader, streamStats))
+			return false;
+
+		if (listener != NULL)
+			listener->UpdateProgress(size, size);
+
+		gi.Pos = loader.pos;
+		gi.Pos.x *= gi.UnitScale;
+		gi.Pos.y *= gi.UnitScale;
+		gi.Pos.z *= gi.UnitScale;
+		gi.UnitType = (m_canonicalUnits != UNIT_FILE)? m_canonicalUnits : gi.SourceUnitType;
+		streamStats.Store(gi);
+
+		m_trajectory.Clear();
+		m_exprPool.Clear();
+
+		gi.StatementCount = m_streamOffset;
+		gi.ExprCount = m_streamExprs;
+		gi.UniqueExprCount = m_streamUniqueExprs;
+		gi.LoadTime = ElapsedMs(start);
+
+		return true;
+	}
+
+	if (listener != NULL)
+		listener->UpdateProgress(size, size);
+
+	slist.shrink_to_fit();
+	m_trajectory.Shrink();
+
+	gi.SourceUnitType = gi.UnitType;
+	gi.Pos = loader.pos;
+
+	/* One pass over the geometry, the statistics are computed from it afterwards */
+	if (m_canonicalUnits != UNIT_FILE && m_canonicalUnits != gi.UnitType) {
+		GPhaseTimer timer(m_phaseTimes, PHASE_NORMALISE);
+
+		gi.UnitScale = GetUnitScale(gi.UnitType);
+		gi.UnitType = m_canonicalUnits;
+
+		/* The ranges don't share anything */
+		GTaskGroup group(&m_cancel);
+		size_t size = m_trajectory.Size();
+		unsigned int tasks = GTaskScheduler::Get().GetTaskCount(size, NORMALISE_MIN_POINTS_PER_TASK);
+		Real scale = gi.UnitScale;
+
+		for (unsigned int t = 1; t < tasks; t++)
+			group.Run([this, scale, size, t, tasks]() { m_trajectory.Scale(scale, size * t / tasks, size * (t + 1) / tasks); });
+
+		m_trajectory.Scale(scale, 0, size / tasks);
+		group.Wait();
+
+		for (list<Position>::iterator it = probePoints->begin(); it != probePoints->end(); it++) {
+			it->x *= gi.UnitScale;
+			it->y *= gi.UnitScale;
+			it->z *= gi.UnitScale;
+		}
+
+		gi.Pos.x *= gi.UnitScale;
+		gi.Pos.y *= gi.UnitScale;
+		gi.Pos.z *= gi.UnitScale;
+	}
+
+	/* The ranges not scaled yet were dropped */
+	if (IsCancelled()) {
+		diagnostics << "Loading of " << m_filePath << " cancelled" << endl;
+		return false;
+	}
+
+	/* Board area, route depth and the rest of the statistics, from the trajectory */
+	{
+		GPhaseTimer timer(m_phaseTimes, PHASE_STATS);
+		GMotionStats stats;
+
+		ComputeMotionStats(m_trajectory, stats);
+		stats.Store(gi);
+	}
+
+	gi.StatementCount = slist.size();
+	gi.ExprCount = m_exprPool.GetRequestCount();
+	gi.UniqueExprCount = m_exprPool.GetNodeCount();
+	gi.LoadTime = ElapsedMs(start);
  
 	return true;
 }
 
-void GCodeInt::Init()
+/* Every array is a straight loop of its own, the feed rates (floats) are vectorised */
+static bool ArcBefore(const GArc &arc, size_t point)
 {
-	itCurrentStmt = slist.begin();
-    m_currentPos.reset();
+	return arc.point < point;
 }
 
-bool GCodeInt::ExecuteNextStatement()
+void GTrajectory::Scale(Real factor, size_t first, size_t last)
 {
-	if (itCurrentStmt == slist.end())
-		return false;
+	size_t count = last;
+	Real *xs = m_x.data();
+	Real *ys = m_y.data();
+	Real *zs = m_z.data();
+	float *feeds = m_feed.data();
+	float feedFactor = (float)factor;
+
+	for (size_t i = first; i < count; i++)
+		xs[i] *= factor;
+
+	for (size_t i = first; i < count; i++)
+		ys[i] *= factor;
+
+	for (size_t i = first; i < count; i++)
+		zs[i] *= factor;
+
+	for (size_t i = first; i < count; i++)
+		feeds[i] *= feedFactor;
+
+	/* The arcs are in the order of their points */
+	for (vector<GArc>::iterator arc = lower_bound(m_arcs.begin(), m_arcs.end(), first, ArcBefore);
+		 arc != m_arcs.end() && arc->point < last; arc++) {
+		arc->cx *= factor;
+		arc->cy *= factor;
+	}
+}
+
+void GTrajectory::Append(const GTrajectory &trajectory, size_t first)
+{
+	m_x.insert(m_x.end(), trajectory.m_x.begin() + first, trajectory.m_x.end());
+	m_y.insert(m_y.end(), trajectory.m_y.begin() + first, trajectory.m_y.end());
+	m_z.insert(m_z.end(), trajectory.m_z.begin() + first, trajectory.m_z.end());
+	m_kind.insert(m_kind.end(), trajectory.m_kind.begin() + first, trajectory.m_kind.end());
+	m_source.insert(m_source.end(), trajectory.m_source.begin() + first, trajectory.m_source.end());
+	m_feed.insert(m_feed.end(), trajectory.m_feed.begin() + first, trajectory.m_feed.end());
+
+	size_t offset = Size() - trajectory.Size();
 
-	m_curCmd = NULL;
-	GCodeStmt *gstmt = *itCurrentStmt;
-	switch (gstmt->GetKind()) {
-			/* 
-			 * At this point we only consider motion and drill commands, all other (assigments, probe points)
-			 * we ignore them here, they were processed when the file was loaded.
-			 */
-			case COMMAND_STMT: {
-				m_curCmd = (GCodeCommand *)gstmt;
-
-				if (m_curCmd->IsMotionCommand())
-					moveTo(*m_curCmd, m_currentPos);
-                else if ( m_curCmd->IsA(G82) )
-					moveTo(*m_curCmd, m_currentPos);
-                else if ( m_curCmd->IsA(G81) )
-                    moveTo(*m_curCmd, m_currentPos);
+	for (unsigned int i = 0; i < trajectory.m_arcs.size(); i++) {
+		GArc arc = trajectory.m_arcs[i];
+
+		if (arc.point >= first) {
+			arc.point += offset;
+			m_arcs.push_back(arc);
+		}
+	}
+
+	for (unsigned int i = 0; i < trajectory.m_toolChanges.size(); i++) {
+		GToolChange change = trajectory.m_toolChanges[i];
+
+		if (change.point >= first) {
+			change.point += offset;
+			m_toolChanges.push_back(change);
+		}
+	}
+}
+
+/* List and hash nodes, the links are approximated as pointers */
+#define LIST_NODE_BYTES(type)   (sizeof(type) + 2 * sizeof(void *))
+#define HASH_NODE_BYTES(type)   (sizeof(type) + 2 * sizeof(void *))
+
+typedef pair<string, Real> GNamedParameter;
+
+/* Both parameter tables, names of the named parameters included */
+size_t GParameterTable::GetMemoryUsage()
+{
+	size_t bytes = m_values.capacity() * sizeof(Real) + m_isSet.capacity() / 8 +
+				   m_named.bucket_count() * sizeof(void *);
+
+	for (unordered_map<string, Real>::iterator it = m_named.begin(); it != m_named.end(); it++)
+		bytes += HASH_NODE_BYTES(GNamedParameter) + StringHeapBytes(it->first);
+
+	return bytes;
+}
+
+void GParameterDeps::AddAssignment(const string &var, GExpr *expr, bool readsParameters, unsigned int stmt)
+{
+	Parameter &param = GetParameter(ParameterNumber(var), var);
+
+	if (param.assignments != 0 || !param.readers.empty())
+		m_reassigned = true;
+
+	if (param.assignments++ == 0) {
+		param.stmt = stmt;
+		param.order = m_assignments;
+	}
+
+	if (readsParameters) {
+		Derived &derived = m_derived[var];
+
+		derived.exprs.push_back(expr);
+		derived.order = m_assignments;
+	}
+
+	m_assignments++;
+}
+
+unsigned int GParameterDeps::GetAssignments(const string &var, unsigned int &stmt, unsigned long &order)
+{
+	int number = ParameterNumber(var);
+	const Parameter *param = NULL;
+
+	if (number != 0 && !m_numbered.empty())
+		param = &m_numbered[number];
+	else if (number == 0) {
+		unordered_map<string, Parameter>::iterator it = m_named.find(var);
+
+		if (it != m_named.end())
+			param = &it->second;
+	}
+
+	if (param == NULL)
+		return 0;
+
+	stmt = param->stmt;
+	order = param->order;
+
+	return param->assignments;
+}
+
+const vector<unsigned int> *GParameterDeps::GetReaders(const string &var)
+{
+	int number = ParameterNumber(var);
+
+	if (number != 0)
+		return (m_numbered.empty() || m_numbered[number].readers.empty())? NULL : &m_numbered[number].readers;
+
+	unordered_map<string, Parameter>::iterator it = m_named.find(var);
+
+	return (it != m_named.end() && !it->second.readers.empty())? &it->second.readers : NULL;
+}
+
+static bool AssignedBefore(const pair<unsigned long, string> &a, const pair<unsigned long, string> &b)
+{
+	return a.first < b.first;
+}
+
+/* There are a few derived parameters (e.g. a probe result each), they're gone over until none is added */
+void GParameterDeps::GetDerivedFrom(const string &var, vector<pair<string, GExpr *> > &derived)
+{
+	vector<pair<unsigned long, string> > ordered;
+	unordered_set<string> changed;
+	bool added = true;
+
+	for (unordered_map<string, Derived>::iterator it = m_derived.begin(); it != m_derived.end(); it++) {
+		if (it->first != var)
+			ordered.push_back(make_pair(it->second.order, it->first));
+	}
+
+	sort(ordered.begin(), ordered.end(), AssignedBefore);
+	changed.insert(var);
+
+	vector<bool> taken(ordered.size(), false);
+
+	while (added) {
+		added = false;
+
+		for (unsigned int i = 0; i < ordered.size(); i++) {
+			vector<GExpr *> &exprs = m_derived[ordered[i].second].exprs;
+			FindVarRefs refs(changed);
+
+			if (taken[i])
+				continue;
+
+			/* Any assignment, an earlier one could be read before the last */
+			for (unsigned int j = 0; j < exprs.size(); j++)
+				VisitVarRefs(exprs[j], refs);
+
+			if (refs.found) {
+				taken[i] = true;
+				changed.insert(ordered[i].second);
+				added = true;
 			}
-			default:
-				/* Nothing to do with the other staments */
-				break;
+		}
+	}
+
+	for (unsigned int i = 0; i < ordered.size(); i++)
+		if (taken[i])
+			derived.push_back(make_pair(ordered[i].second, m_derived[ordered[i].second].exprs.back()));
+}
+
+size_t GParameterDeps::GetMemoryUsage()
+{
+	typedef pair<string, Parameter> NamedParameter;
+	typedef pair<string, Derived> DerivedParameter;
+	size_t bytes = m_numbered.capacity() * sizeof(Parameter) +
+				   (m_named.bucket_count() + m_derived.bucket_count()) * sizeof(void *);
+
+	for (unsigned int i = 0; i < m_numbered.size(); i++)
+		bytes += m_numbered[i].readers.capacity() * sizeof(unsigned int);
+
+	for (unordered_map<string, Parameter>::iterator it = m_named.begin(); it != m_named.end(); it++)
+		bytes += HASH_NODE_BYTES(NamedParameter) + StringHeapBytes(it->first) + it->second.readers.capacity() * sizeof(unsigned int);
+
+	for (unordered_map<string, Derived>::iterator it = m_derived.begin(); it != m_derived.end(); it++)
+		bytes += HASH_NODE_BYTES(DerivedParameter) + StringHeapBytes(it->first) + it->second.exprs.capacity() * sizeof(GExpr *);
+
+	return bytes;
+}
+
+bool GCodeInt::OpenSource(GCodeSource &source)
+{
+	if (!source.Open(m_filePath.c_str()))
+		return false;
+
+	if (source.GetStamp() != m_sourceStamp) {
+		source.Close();
+		return false;
 	}
 
-	itCurrentStmt++;
+	return true;
+}
+
+GCodeMemoryUsage GCodeInt::GetMemoryUsage()
+{
+	GCodeMemoryUsage usage;
+
+	usage.Statements = slist.capacity() * sizeof(GCodeStmt *);
+	usage.Expressions = m_exprPool.GetMemoryUsage();
+	usage.Arguments = 0;
+	usage.Strings = StringHeapBytes(m_filePath);
+	usage.Parameters = gparameters.GetMemoryUsage() + m_paramDeps.GetMemoryUsage() + m_probeCalls.capacity() * sizeof(GProbeCall);
+	usage.ProbePoints = probePoints->size() * LIST_NODE_BYTES(Position);
+	usage.Trajectory = m_trajectory.GetMemoryUsage();
+	usage.Autoleveller = m_autolevellerMemory;
+
+	MemoryVisitor visitor(usage);
+
+	visitor.VisitAll(slist.begin(), slist.end());
+
+	return usage;
+}
+
+void GCodeCursor::Reset(size_t firstPoint)
+{
+	const GTrajectory &trajectory = m_ginter->GetTrajectory();
+
+	m_sources = trajectory.GetSource();
+	m_kinds = trajectory.GetKind();
+	m_arcs = trajectory.GetArcs();
+	m_scale = m_ginter->GetGCodeInfo()->UnitScale;
+	m_count = m_ginter->GetStatementCount();
+	m_index = 0;
+	m_first = m_point = firstPoint;
+	m_last = (firstPoint == 0)? NO_POINT : firstPoint - 1;
+	m_arcIndex = lower_bound(m_arcs.begin(), m_arcs.end(), firstPoint, ArcBefore) - m_arcs.begin();
+	m_cmd = NULL;
+	m_kind = -1;
+	m_arc = NULL;
+}
+
+/*
+ * Moves the cursor so Next goes to the statement 'index', with the position
+ * left by the statements before it.  There is no need to replay anything:
+ * the points of the trajectory are the checkpoints, a binary search finds
+ * the one before 'index'.  They hold only the position, it's the only state
+ * a cursor has: the arguments were evaluated with the parameters by LoadFile
+ * (and SetParameter) and the modal command of every statement is resolved by
+ * the parser.
+ */
+bool GCodeCursor::Seek(unsigned int index)
+{
+	if (index > m_count)
+		return false;
+
+	m_point = lower_bound(m_sources.begin() + m_first, m_sources.end(), index) - m_sources.begin();
+
+	size_t last = m_point;
+
+	/* The probe cycles are not statements, Next doesn't see them */
+	while (last > m_first && m_kinds[last - 1] == SEG_PROBE)
+		last--;
+
+	m_last = (last == 0)? NO_POINT : last - 1;
+	m_arcIndex = lower_bound(m_arcs.begin(), m_arcs.end(), m_point, ArcBefore) - m_arcs.begin();
+	m_index = index;
+	m_cmd = NULL;
+	m_kind = -1;
+	m_arc = NULL;
+
 	return true;
 }
 
@@ -280,16 +955,7 @@ Real GCodeInt::EvalExpr(GExpr *expr)
 			return nexpr->GetValue();
 		}
 		case VREF_EXPR: {
-			GVarRefExpr *vrexpr = (GVarRefExpr *)expr;
-			string varName = vrexpr->GetVarName();
-
-            Real value = 0.0;
-            if (gparameters.find(varName) != gparameters.end())
-                value = gparameters[varName];
-
-            vrexpr->SetValue(value);
-
-            return value;
+			return gparameters.Get((GVarRefExpr *)expr);
 		}
 		case ADD_EXPR:
 		case SUB_EXPR:
@@ -301,12 +967,321 @@ Real GCodeInt::EvalExpr(GExpr *expr)
 			Real val1 = EvalExpr(lexpr);
 			Real val2 = EvalExpr(rexpr);
 
-            Real value = DoOperation(val1, val2, expr->GetKind());
-            bexpr->SetValue(value);
-
-            return value;
+            return DoOperation(val1, val2, expr->GetKind());
 		}
 		default:
 			return 0.0;
 	}
 }
+
+/* Evaluates the arguments of the commands stmts[first] to stmts[last - 1], the parameters are only read */
+void GCodeInt::EvalCommands(const vector<unsigned int> &stmts, size_t first, size_t last)
+{
+	for (size_t i = first; i < last; i++)
+		EvalArguments(*static_cast<GCodeCommand *>(slist[stmts[i]]));
+}
+
+/* Whether the parameters read by 'expr' have their last value at a point of the program, see GParameterDeps::HasLastValue */
+bool GCodeInt::ReadsLastValues(GExpr *expr, unsigned int stmt, unsigned long order)
+{
+	FindChangedLater changed(m_paramDeps, stmt, order);
+
+	VisitVarRefs(expr, changed);
+
+	return !changed.found;
+}
+
+/* Same for the arguments of the commands stmts[first] to stmts[last - 1] */
+bool GCodeInt::ReadLastValues(const vector<unsigned int> &stmts, size_t first, size_t last)
+{
+	for (size_t i = first; i < last; i++) {
+		vector<GArgument> &args = static_cast<GCodeCommand *>(slist[stmts[i]])->GetArguments();
+
+		for (unsigned int j = 0; j < args.size(); j++) {
+			if (!ReadsLastValues(args[j].expr, stmts[i], ~0UL))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+bool GCodeInt::SetParameter(const string &var, Real value, GDiagnostics &diagnostics, unsigned int tasks)
+{
+	vector<pair<string, GExpr *> > derived;
+	vector<unsigned int> stmts;
+	vector<GProbeCall *> probes;
+	unordered_set<string> changed;
+	unsigned int stmt;
+	unsigned long order;
+	unsigned int assignments = m_paramDeps.GetAssignments(var, stmt, order);
+
+	{
+		GPhaseTimer timer(m_phaseTimes, PHASE_EVAL);
+
+		/* Nothing changes until every expression evaluated again is known to read the last values */
+		if (assignments > 1) {
+			diagnostics << var << " is assigned more than once, load the file again to see the change" << endl;
+			return false;
+		}
+
+		m_paramDeps.GetDerivedFrom(var, derived);
+
+		changed.insert(var);
+		for (unsigned int i = 0; i < derived.size(); i++) {
+			changed.insert(derived[i].first);
+
+			if (m_paramDeps.GetAssignments(derived[i].first, stmt, order) != 1 ||
+				!ReadsLastValues(derived[i].second, stmt, order)) {
+				diagnostics << derived[i].first << " (computed from " << var << ") is assigned more than once or from "
+							  << "parameters assigned later, load the file again to see the change" << endl;
+				return false;
+			}
+		}
+
+		for (unordered_set<string>::iterator it = changed.begin(); it != changed.end(); it++) {
+			const vector<unsigned int> *readers = m_paramDeps.GetReaders(*it);
+
+			if (readers != NULL)
+				stmts.insert(stmts.end(), readers->begin(), readers->end());
+		}
+
+		for (unsigned int i = 0; i < m_probeCalls.size(); i++) {
+			GProbeCall &call = m_probeCalls[i];
+			FindVarRefs refs(changed);
+			bool last = true;
+
+			for (int j = 0; j < 4; j++) {
+				if (call.args[j] != NULL) {
+					VisitVarRefs(call.args[j], refs);
+					last = last && ReadsLastValues(call.args[j], call.stmt, call.order);
+				}
+			}
+
+			if (refs.found && !last) {
+				diagnostics << "A probe cycle reads parameters assigned later, load the file again to see the change" << endl;
+				return false;
+			}
+
+			if (refs.found)
+				probes.push_back(&call);
+		}
+
+		if (assignments == 0 && derived.empty() && stmts.empty() && probes.empty()) {
+			diagnostics << "Parameter " << var << " is not used by " << m_filePath << endl;
+			return false;
+		}
+
+		sort(stmts.begin(), stmts.end());
+		stmts.erase(unique(stmts.begin(), stmts.end()), stmts.end());
+
+		/* The commands don't share anything but the expressions and the parameters, which are read only */
+		GTaskGroup group;
+		size_t size = stmts.size();
+		unsigned int evalTasks = GTaskScheduler::Get().GetTaskCount(size, REEVAL_MIN_STMTS_PER_TASK, tasks);
+		vector<char> last(evalTasks, true);
+
+		if (!m_paramDeps.CommandsReadLastValues()) {
+			for (unsigned int t = 1; t < evalTasks; t++)
+				group.Run([this, &stmts, &last, size, t, evalTasks]() { last[t] = ReadLastValues(stmts, size * t / evalTasks, size * (t + 1) / evalTasks); });
+
+			last[0] = ReadLastValues(stmts, 0, size / evalTasks);
+			group.Wait();
+		}
+
+		if (find(last.begin(), last.end(), false) != last.end()) {
+			diagnostics << "A command reading " << var << " reads parameters assigned more than once or later, "
+						  << "load the file again to see the change" << endl;
+			return false;
+		}
+
+		auto evalCommands = [&]() {
+			for (unsigned int t = 1; t < evalTasks; t++)
+				group.Run([this, &stmts, size, t, evalTasks]() { EvalCommands(stmts, size * t / evalTasks, size * (t + 1) / evalTasks); });
+
+			EvalCommands(stmts, 0, size / evalTasks);
+			group.Wait();
+		};
+
+		/* The values to go back to if the trajectory can't follow */
+		vector<pair<string, Real> > previous;
+		vector<char> wasSet;
+
+		previous.push_back(make_pair(var, gparameters.Get(var)));
+		for (unsigned int i = 0; i < derived.size(); i++)
+			previous.push_back(make_pair(derived[i].first, gparameters.Get(derived[i].first)));
+
+		for (unsigned int i = 0; i < previous.size(); i++)
+			wasSet.push_back(gparameters.IsSet(previous[i].first));
+
+		gparameters.Set(var, value);
+		for (unsigned int i = 0; i < derived.size(); i++)
+			gparameters.Set(derived[i].first, EvalExpr(derived[i].second));
+
+		evalCommands();
+
+		if (!stmts.empty() && !UpdateTrajectory(stmts.front(), stmts.back())) {
+			for (unsigned int i = 0; i < previous.size(); i++) {
+				if (wasSet[i])
+					gparameters.Set(previous[i].first, previous[i].second);
+				else
+					gparameters.Unset(previous[i].first);
+			}
+
+			/* The arguments the trajectory was computed with */
+			evalCommands();
+
+			diagnostics << "Changing " << var << " makes an arc valid or invalid, load the file again to see the change" << endl;
+			return false;
+		}
+
+		/* It's not computed from the others anymore */
+		m_paramDeps.SetConstant(var);
+
+		UpdateProbes(probes);
+	}
+
+	{
+		GPhaseTimer timer(m_phaseTimes, PHASE_STATS);
+		GMotionStats stats;
+
+		ComputeMotionStats(m_trajectory, stats, tasks);
+		stats.Store(gi);
+	}
+
+	return true;
+}
+
+/* Moves the points of the probe cycles after their arguments changed, like LoadVisitor placed them */
+void GCodeInt::UpdateProbes(const vector<GProbeCall *> &probes)
+{
+	Real scale = gi.UnitScale;
+
+	for (unsigned int i = 0; i < probes.size(); i++) {
+		GProbeCall &call = *probes[i];
+		Position p;
+		float speed = 0;
+
+		p.x = EvalExpr(call.args[0]) * scale;
+		p.y = EvalExpr(call.args[1]) * scale;
+		p.z = EvalExpr(call.args[2]) * scale;
+
+		if (call.args[3] != NULL)
+			speed = (float)EvalExpr(call.args[3]) * (float)scale;
+
+		m_trajectory.SetPoint(call.point, p, speed);
+		call.probePoint->x = p.x;
+		call.probePoint->y = p.y;
+	}
+}
+
+static inline bool SamePosition(const Position &p1, const Position &p2)
+{
+	return p1.x == p2.x && p1.y == p2.y && p1.z == p2.z;
+}
+
+/*
+ * Moves the points of the commands from 'first' on after their arguments
+ * changed, like LoadVisitor placed them.  After 'last' it stops at the first
+ * point that didn't move, the ones after it don't move either.  The new points
+ * are kept apart until the end, so nothing changes if an arc became valid or
+ * invalid (the kind of a point can't change here).
+ */
+bool GCodeInt::UpdateTrajectory(unsigned int first, unsigned int last)
+{
+	GSpan<unsigned int> sources = m_trajectory.GetSource();
+	GSpan<unsigned char> kinds = m_trajectory.GetKind();
+	GSpan<float> feeds = m_trajectory.GetFeed();
+	GSpan<GArc> arcs = m_trajectory.GetArcs();
+	Real scale = gi.UnitScale;
+	size_t point = lower_bound(sources.begin(), sources.end(), first) - sources.begin();
+	Position pos;
+	float feed = 0;
+	unsigned int stmt = 0;
+
+	/* Start after the last move before 'first', the feed rate could be set in between */
+	while (point > 0 && kinds[point - 1] == SEG_PROBE)
+		point--;
+
+	if (point > 0) {
+		pos = m_trajectory.GetPosition(point - 1);
+		feed = feeds[point - 1];
+		stmt = sources[point - 1] + 1;
+	}
+
+	size_t arc = lower_bound(arcs.begin(), arcs.end(), point, ArcBefore) - arcs.begin();
+	vector<pair<size_t, Position> > moved;
+	vector<float> movedFeeds;
+	vector<pair<size_t, GArc> > movedArcs;
+
+	for (; stmt < slist.size(); stmt++) {
+		GCodeCommand *cmd = StmtCast<GCodeCommand>(slist[stmt]);
+
+		if (cmd == NULL)
+			continue;
+
+		if (cmd->HasArgument('F'))
+			feed = (float)cmd->GetArgumentValue('F') * (float)scale;
+
+		if (!cmd->IsA(G81) && !cmd->IsA(G82) && !cmd->IsMotionCommand())
+			continue;
+
+		while (point < kinds.Size() && kinds[point] == SEG_PROBE)
+			point++;
+
+		if (point >= kinds.Size() || sources[point] != stmt)
+			return false;
+
+		/* In the units of the trajectory, like GTrajectory::Scale leaves them */
+		Position from = pos;
+
+		if (cmd->HasArgument('X'))
+			pos.x = cmd->GetArgumentValue('X') * scale;
+
+		if (cmd->HasArgument('Y'))
+			pos.y = cmd->GetArgumentValue('Y') * scale;
+
+		if (cmd->HasArgument('Z'))
+			pos.z = cmd->GetArgumentValue('Z') * scale;
+
+		/* ComputeArc works in the units of the program */
+		if (cmd->IsA(G02) || cmd->IsA(G03)) {
+			Position start = from, end = pos;
+			GArc newArc;
+
+			start.x /= scale; start.y /= scale; start.z /= scale;
+			end.x /= scale; end.y /= scale; end.z /= scale;
+
+			bool valid = ComputeArc(*cmd, start, end, newArc);
+
+			if (valid != (kinds[point] == SEG_ARC))
+				return false;
+
+			if (valid) {
+				newArc.cx *= scale;
+				newArc.cy *= scale;
+				newArc.point = point;
+				movedArcs.push_back(make_pair(arc++, newArc));
+			}
+		}
+
+		bool same = SamePosition(pos, m_trajectory.GetPosition(point)) && feed == feeds[point];
+
+		moved.push_back(make_pair(point, pos));
+		movedFeeds.push_back(feed);
+		point++;
+
+		if (stmt >= last && same)
+			break;
+	}
+
+	for (unsigned int i = 0; i < moved.size(); i++)
+		m_trajectory.SetPoint(moved[i].first, moved[i].second, movedFeeds[i]);
+
+	for (unsigned int i = 0; i < movedArcs.size(); i++)
+		m_trajectory.SetArc(movedArcs[i].first, movedArcs[i].second);
+
+	gi.Pos = m_trajectory.GetStartPosition(m_trajectory.Size());
+
+	return true;
+}
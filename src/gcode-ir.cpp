@@ -13,28 +13,260 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <sstream>
+#include <cmath>
+#include <cstring>
 
 #include "gcode-ir.h"
+#include "gcode-emitter.h"
 
 string GCodeCommand::ToString()
 {
-    stringstream ss;
+    GCodeEmitter emitter;
 
-    ss.precision(4);
+    emitter.EmitCommand(this);
 
-    ss << name;
+    return emitter.ToString();
+}
+
+#define POOL_INITIAL_SIZE   1024
+
+static inline size_t HashCombine(size_t h, size_t v)
+{
+    return h ^ (v + 0x9e3779b9 + (h << 6) + (h >> 2));
+}
+
+/* Spreads the bits, pointers and numbers parsed as double have many zero low bits */
+static inline size_t HashMix(unsigned long long h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (size_t)h;
+}
+
+/* Values that only differ beyond double precision collide, SameReal tells them apart */
+static inline size_t HashReal(Real value)
+{
+    double d = (double)value;
+    unsigned long long bits;
+
+    memcpy(&bits, &d, sizeof(bits));
+
+    return HashMix(bits);
+}
+
+static inline size_t HashVar(const string &var)
+{
+    unsigned long long h = VREF_EXPR;
+
+    for (unsigned int i = 0; i < var.length(); i++)
+        h = h * 31 + (unsigned char)var[i];
+
+    return HashMix(h);
+}
+
+static inline size_t HashBinary(int kind, GExpr *lexpr, GExpr *rexpr)
+{
+    return HashMix(HashCombine(HashCombine(kind, (size_t)lexpr), (size_t)rexpr));
+}
+
+/* Same number, telling 0 and -0 apart since they are written differently */
+static inline bool SameReal(Real a, Real b)
+{
+    return a == b && signbit(a) == signbit(b);
+}
+
+GExprPool::GExprPool()
+{
+    m_count = 0;
+    m_requests = 0;
+}
+
+void GExprPool::Clear()
+{
+    for (unsigned int i = 0; i < m_table.size(); i++) {
+        if (m_table[i] != NULL)
+            delete m_table[i];
+    }
+
+    m_table.clear();
+    m_tags.clear();
+    m_count = 0;
+    m_requests = 0;
+}
+
+/* Expressions plus the hash table, variable names included */
+size_t GExprPool::GetMemoryUsage()
+{
+    size_t bytes = m_table.capacity() * sizeof(GExpr *) + m_tags.capacity() * sizeof(unsigned int);
+
+    for (unsigned int i = 0; i < m_table.size(); i++) {
+        GExpr *expr = m_table[i];
 
-    for (unsigned int i = 0; i < argNameList.length(); i++) {
-        char argName = argNameList[i];
-        GExpr *value = arguments[argName];
+        if (expr == NULL)
+            continue;
 
-        if (argName != 'Z' || zformula.empty()) {
-            ss << " " << argName << fixed << value->ToString();
-        } else {
-            ss << " " << argName << "[" << zformula << "]";
+        switch (expr->GetKind()) {
+            case NUMBER_EXPR: bytes += sizeof(GNumberExpr); break;
+            case VREF_EXPR:
+                bytes += sizeof(GVarRefExpr) + StringHeapBytes(((GVarRefExpr *)expr)->GetVarName());
+                break;
+            default:
+                bytes += sizeof(GBinaryExpr); break;
         }
     }
 
-    return ss.str();
+    return bytes;
+}
+
+size_t GExprPool::Hash(GExpr *expr)
+{
+    int kind = expr->GetKind();
+
+    switch (kind) {
+        case NUMBER_EXPR: return HashReal(((GNumberExpr *)expr)->GetValue());
+        case VREF_EXPR: return HashVar(((GVarRefExpr *)expr)->GetVarName());
+        default: {
+            GBinaryExpr *bexpr = (GBinaryExpr *)expr;
+
+            return HashBinary(kind, bexpr->GetLExpr(), bexpr->GetRExpr());
+        }
+    }
+}
+
+void GExprPool::Grow()
+{
+    size_t size = m_table.empty()? POOL_INITIAL_SIZE : m_table.size() * 2;
+    vector<GExpr *> table(size, (GExpr *)NULL);
+    vector<unsigned int> tags(size, 0);
+    size_t mask = size - 1;
+
+    for (unsigned int i = 0; i < m_table.size(); i++) {
+        GExpr *expr = m_table[i];
+
+        if (expr == NULL)
+            continue;
+
+        size_t index = Hash(expr) & mask;
+
+        while (table[index] != NULL)
+            index = (index + 1) & mask;
+
+        table[index] = expr;
+        tags[index] = m_tags[i];
+    }
+
+    m_table.swap(table);
+    m_tags.swap(tags);
+}
+
+/*
+ * Looks up an expression, 'index' is left at the slot where it is (or where it
+ * should be inserted).  The tags keep the upper hash bits (the upper half of
+ * a 32 bit size_t) so most of the mismatches are discarded without touching
+ * the expression.
+ */
+template <class Match>
+GExpr *GExprPool::Find(size_t hash, size_t &index, Match match)
+{
+    if ((m_count + 1) * 2 > m_table.size())
+        Grow();
+
+    size_t mask = m_table.size() - 1;
+    unsigned int tag = (unsigned int)((unsigned long long)hash >> (sizeof(size_t) > 4? 32 : 16)) | 1;
+
+    m_requests++;
+    for (index = hash & mask; m_table[index] != NULL; index = (index + 1) & mask) {
+        if (m_tags[index] == tag && match(m_table[index]))
+            return m_table[index];
+    }
+
+    m_tags[index] = tag;
+
+    return NULL;
+}
+
+struct NumberMatch
+{
+    Real value;
+
+    bool operator()(GExpr *expr) {
+        return expr->GetKind() == NUMBER_EXPR && SameReal(((GNumberExpr *)expr)->GetValue(), value);
+    }
+};
+
+struct VarRefMatch
+{
+    const string *var;
+
+    bool operator()(GExpr *expr) {
+        return expr->GetKind() == VREF_EXPR && ((GVarRefExpr *)expr)->GetVarName() == *var;
+    }
+};
+
+struct BinaryMatch
+{
+    int kind;
+    GExpr *lexpr;
+    GExpr *rexpr;
+
+    bool operator()(GExpr *expr) {
+        return expr->GetKind() == kind &&
+               ((GBinaryExpr *)expr)->GetLExpr() == lexpr &&
+               ((GBinaryExpr *)expr)->GetRExpr() == rexpr;
+    }
+};
+
+GExpr *GExprPool::Number(Real value)
+{
+    NumberMatch match = { value };
+    size_t index;
+    GExpr *expr = Find(HashReal(value), index, match);
+
+    if (expr == NULL) {
+        expr = m_table[index] = new GNumberExpr(value);
+        m_count++;
+    }
+
+    return expr;
+}
+
+GExpr *GExprPool::VarRef(const string &var)
+{
+    VarRefMatch match = { &var };
+    size_t index;
+    GExpr *expr = Find(HashVar(var), index, match);
+
+    if (expr == NULL) {
+        expr = m_table[index] = new GVarRefExpr(var);
+        m_count++;
+    }
+
+    return expr;
+}
+
+GExpr *GExprPool::Binary(int kind, GExpr *lexpr, GExpr *rexpr)
+{
+    BinaryMatch match = { kind, lexpr, rexpr };
+    size_t index;
+    GExpr *expr = Find(HashBinary(kind, lexpr, rexpr), index, match);
+
+    if (expr != NULL)
+        return expr;
+
+    switch (kind) {
+        case ADD_EXPR: expr = new GAddExpr(lexpr, rexpr); break;
+        case SUB_EXPR: expr = new GSubExpr(lexpr, rexpr); break;
+        case MUL_EXPR: expr = new GMulExpr(lexpr, rexpr); break;
+        default:
+            expr = new GDivExpr(lexpr, rexpr); break;
+    }
+
+    m_table[index] = expr;
+    m_count++;
+
+    return expr;
 }
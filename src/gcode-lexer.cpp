@@ -18,47 +18,43 @@
 
 #include "gcode-lexer.h"
 
-stringstream out_err;
-
 string GCodeLexer::ParseInt()
 {
-	stringstream ss;
+	string s_value;
 
 	while (isdigit(m_currentCh) && m_currentCh != EOF) {
-			ss << m_currentCh;
+			s_value += m_currentCh;
 			m_currentCh =  GetNextChar();
 	}
 
 	UngetChar();
 
-	return ss.str();
+	return s_value;
 }
 
 Real GCodeLexer::ParseReal()
 {
-	stringstream ss;
+	string s_value;
 	
 	if (m_currentCh == '-' || m_currentCh == '+') {
-		ss << m_currentCh;
+		s_value += m_currentCh;
 		
 		m_currentCh = GetNextChar();
 	}
 	while ( (isdigit(m_currentCh) || m_currentCh == '.') && m_currentCh != EOF ) {
-			ss << m_currentCh;
+			s_value += m_currentCh;
 			m_currentCh = GetNextChar();
 	}
 	UngetChar();
 
-	string s_value = ss.str();
-
-	m_tokenLexeme << s_value;
+	m_tokenLexeme += s_value;
 
 	return atof(s_value.c_str());
 }
 
-int GCodeLexer::NextToken()
+int GCodeLexer::ScanToken()
 {
-	m_tokenLexeme.str("");
+	m_tokenLexeme.clear();
 
 	while (1) {
 		m_currentCh = GetNextChar();
@@ -69,7 +65,8 @@ int GCodeLexer::NextToken()
 		if (m_currentCh == ' ' || m_currentCh == '\t')
 			continue;
 
-		m_tokenLexeme << m_currentCh;
+		m_tokenStart = GetOffset() - 1;
+		m_tokenLexeme += m_currentCh;
 		m_currentCh = toupper(m_currentCh);
 
 		switch (m_currentCh) {
@@ -77,12 +74,12 @@ int GCodeLexer::NextToken()
 				m_currentCh = GetNextChar();
 				while (m_currentCh != ')' && m_currentCh != EOF) {
 					if (m_currentCh == '(') {
-						out_err << "Nested comment at line " << m_lineNumber << endl;
+						*m_diagnostics << "Nested comment at line " << m_lineNumber << endl;
 						return TOK_ERROR;
 					}
 					m_currentCh = GetNextChar();
 				}
-				m_tokenLexeme.str("");
+				m_tokenLexeme.clear();
 				continue;
 			}
 			case '\r': {
@@ -102,7 +99,7 @@ int GCodeLexer::NextToken()
 				m_currentCh = GetNextChar();
 				string s_value = ParseInt();
 				m_value.m_intValue = atoi(s_value.c_str());
-				m_tokenLexeme << s_value;
+				m_tokenLexeme += s_value;
 							
 				return TOK_LINENUMBER;	  
 			}
@@ -112,14 +109,14 @@ int GCodeLexer::NextToken()
 				m_currentCh = GetNextChar();
 				string s_value = ParseInt();
 				number1 = atoi(s_value.c_str());
-				m_tokenLexeme << s_value;
+				m_tokenLexeme += s_value;
 
 				m_currentCh = GetNextChar();
 				if (m_currentCh == '.') {	
 					m_currentCh = GetNextChar();
 					s_value = ParseInt();
 					number2 = atoi(s_value.c_str());
-					m_tokenLexeme << s_value;
+					m_tokenLexeme += s_value;
 
 					return __G(number1, number2);
 				}
@@ -133,7 +130,7 @@ int GCodeLexer::NextToken()
 				m_currentCh = GetNextChar();
 				string s_value = ParseInt();
 				int number = atoi(s_value.c_str());
-				m_tokenLexeme << s_value;
+				m_tokenLexeme += s_value;
 							
 				return _M(number);
 			}
@@ -142,16 +139,14 @@ int GCodeLexer::NextToken()
 				m_currentCh = GetNextChar();
 				string s_value = ParseInt();
 				int number = atoi(s_value.c_str());
-				m_tokenLexeme << s_value;
+				m_tokenLexeme += s_value;
 							
 				return _O(number);		  
 			}
 			case '#': {
-				stringstream ss;
-
 				m_currentCh = GetNextChar();
 				string s_value = ParseInt();
-				m_tokenLexeme << s_value;
+				m_tokenLexeme += s_value;
 
 				return TOK_VAR;
 			}
@@ -172,21 +167,20 @@ int GCodeLexer::NextToken()
 			case 'P': return TOK_PARGUMENT;
 			case 'R': return TOK_RARGUMENT;
 			case 'S': {
-				stringstream ss;
+				string str;
 				m_currentCh = GetNextChar();
 
 				if (isalpha(m_currentCh)) {
 					char ch;
 
-					ss << "s";
+					str = "s";
 					while (isalpha(m_currentCh) && m_currentCh != EOF) {
 						ch = tolower(m_currentCh);
-						ss << ch;
-						m_tokenLexeme << m_currentCh;
+						str += ch;
+						m_tokenLexeme += m_currentCh;
 						m_currentCh = GetNextChar();
 					}
 					UngetChar();
-					string str = ss.str();
 
 					if (str == "sub")
 						return KW_SUB;
@@ -199,6 +193,9 @@ int GCodeLexer::NextToken()
 				}
 			}
 			case 'T': return TOK_TARGUMENT;
+			case 'I': return TOK_IARGUMENT;
+			case 'J': return TOK_JARGUMENT;
+			case 'K': return TOK_KARGUMENT;
 
 			default: {
 				
@@ -207,27 +204,26 @@ int GCodeLexer::NextToken()
 					return TOK_NUMBER;
 				} else if (isalpha(m_currentCh)) {
 					char ch;
-					stringstream ss;
+					string str;
 
 					while (isalpha(m_currentCh) && m_currentCh != EOF ) {
 						ch = tolower(m_currentCh);
-						ss << ch;
-						m_tokenLexeme << m_currentCh;
+						str += ch;
+						m_tokenLexeme += m_currentCh;
 						m_currentCh = GetNextChar();
 					}
 					UngetChar();
-					string str = ss.str();
 
 					if (str == "endsub")
 						return KW_ENDSUB;
 					else if (str == "call")
 						return KW_CALL;
 					else {
-						out_err << "Invalid keyword '" << str << "' detected at line " << m_lineNumber << endl;
+						*m_diagnostics << "Invalid keyword '" << str << "' detected at line " << m_lineNumber << endl;
 						return TOK_ERROR;
 					}
 				} else {
-					out_err << "Invalid symbol '" << m_currentCh << "' detected at line " << m_lineNumber << " (0x" << hex << ((int)m_currentCh) << ")" << endl;
+					*m_diagnostics << "Invalid symbol '" << m_currentCh << "' detected at line " << m_lineNumber << " (0x" << hex << ((int)m_currentCh) << dec << ")" << endl;
 					return TOK_ERROR;
 				}
 			}
@@ -18,8 +18,6 @@
 
 #include "gcode-parser.h"
 
-extern stringstream out_err;
-
 void GCodeParser::SkipEOL()
 {
 	while (m_currentToken == TOK_EOL) 
@@ -37,6 +35,9 @@ char GCodeParser::TokenArgumentToName(unsigned int tkParam)
 		case TOK_RARGUMENT: return 'R';
 		case TOK_SARGUMENT: return 'S';
 		case TOK_TARGUMENT: return 'T';
+		case TOK_IARGUMENT: return 'I';
+		case TOK_JARGUMENT: return 'J';
+		case TOK_KARGUMENT: return 'K';
 		default:
 			return '?';
 	}
@@ -45,7 +46,7 @@ char GCodeParser::TokenArgumentToName(unsigned int tkParam)
 bool GCodeParser::MatchToken(int token, string tokenName)
 {
 	if (m_currentToken != token) {
-		out_err << "Expected '" << tokenName << "' at line " << m_lexer->GetLineNumber() << " found '" << m_lexer->GetLexeme() << "'" << endl;
+		m_lexer->GetDiagnostics() << "Expected '" << tokenName << "' at line " << m_lexer->GetLineNumber() << " found '" << m_lexer->GetLexeme() << "'" << endl;
 		return false;
 	}
 	m_currentToken = m_lexer->NextToken();
@@ -63,21 +64,14 @@ bool GCodeParser::ParseExpr(GExpr * &expr)
 
 	while (m_currentToken == TOK_OPADD || m_currentToken == TOK_OPSUB) {
 		GExpr *expr2;
-		
-		if (m_currentToken == TOK_OPADD)
-			expr1 = new GAddExpr(expr1, 0);
-		else
-			expr1 = new GSubExpr(expr1, 0);
+		int kind = (m_currentToken == TOK_OPADD)? ADD_EXPR : SUB_EXPR;
 
 		m_currentToken = m_lexer->NextToken();
 		
-		if (!ParseTerm(expr2)) {
-			delete expr1;
-
+		if (!ParseTerm(expr2))
 			return false;
-		}
 
-		((GBinaryExpr *)expr1)->SetRExpr(expr2);
+		expr1 = m_pool->Binary(kind, expr1, expr2);
 	}
 
 	expr = expr1;
@@ -94,21 +88,14 @@ bool GCodeParser::ParseTerm(GExpr * &expr)
 
 	while (m_currentToken == TOK_OPMUL || m_currentToken == TOK_OPDIV) {
 		GExpr *expr2;
-		
-		if (m_currentToken == TOK_OPMUL)
-			expr1 = new GMulExpr(expr1, 0);
-		else
-			expr1 = new GDivExpr(expr1, 0);
+		int kind = (m_currentToken == TOK_OPMUL)? MUL_EXPR : DIV_EXPR;
 
 		m_currentToken = m_lexer->NextToken();
 		
-		if (!ParseFactor(expr2)) {
-			delete expr1;
-
+		if (!ParseFactor(expr2))
 			return false;
-		}
 
-		((GBinaryExpr *)expr1)->SetRExpr(expr2);
+		expr1 = m_pool->Binary(kind, expr1, expr2);
 	}
 
 	expr = expr1;
@@ -131,11 +118,11 @@ bool GCodeParser::ParseFactor(GExpr * &expr)
 			if (!ParseFactor(expr1))
 				return false;
 
-			expr = new GMulExpr(new GNumberExpr(-1.0), expr1);
+			expr = m_pool->Binary(MUL_EXPR, m_pool->Number(-1.0), expr1);
 			return true;
 		}
 		case TOK_NUMBER: {
-			expr = new GNumberExpr(m_lexer->GetRealValue());
+			expr = m_pool->Number(m_lexer->GetRealValue());
 			m_currentToken = m_lexer->NextToken();
 
 			return true;
@@ -146,8 +133,7 @@ bool GCodeParser::ParseFactor(GExpr * &expr)
 				return false;
 			
 			if (m_currentToken != TOK_RBRACKET) {
-				out_err << "Expected ']' at line " << m_lexer->GetLineNumber() << ", found '" << m_lexer->GetLexeme() << "'" << endl;
-				delete expr;
+				m_lexer->GetDiagnostics() << "Expected ']' at line " << m_lexer->GetLineNumber() << ", found '" << m_lexer->GetLexeme() << "'" << endl;
 				expr = 0;
 				return false;
 			}
@@ -155,15 +141,14 @@ bool GCodeParser::ParseFactor(GExpr * &expr)
 			return true;
 		}
 		case TOK_VAR: {
-			string varName = m_lexer->GetLexeme();
-			expr = new GVarRefExpr(varName);
+			expr = m_pool->VarRef(m_lexer->GetLexeme());
 
 			m_currentToken = m_lexer->NextToken();
 
 			return true;
 		}
 		default:
-			out_err << "Unexpected '" << m_lexer->GetLexeme() << "' at line " << m_lexer->GetLineNumber() << ", expected NUMBER, '[' or parameter" << endl;
+			m_lexer->GetDiagnostics() << "Unexpected '" << m_lexer->GetLexeme() << "' at line " << m_lexer->GetLineNumber() << ", expected NUMBER, '[' or parameter" << endl;
 			return false;
 	}
 }
@@ -183,7 +168,7 @@ bool GCodeParser::ParseParameterValue(GExpr * &expr)
 
 			m_currentToken = m_lexer->NextToken();
 
-			expr = new GNumberExpr(value);
+			expr = m_pool->Number(value);
 			break;
 		}
 		case TOK_LBRACKET: {
@@ -192,8 +177,7 @@ bool GCodeParser::ParseParameterValue(GExpr * &expr)
 				return false;
 
 			if (m_currentToken != TOK_RBRACKET) {
-				out_err << "Error in command at line " << m_lexer->GetLineNumber() << ", expected ']'" << endl;
-				delete expr;
+				m_lexer->GetDiagnostics() << "Error in command at line " << m_lexer->GetLineNumber() << ", expected ']'" << endl;
 				expr = 0;
 				return false;
 			}
@@ -202,7 +186,7 @@ bool GCodeParser::ParseParameterValue(GExpr * &expr)
 		}
 
 		default:
-			out_err << "Error in command at line " << m_lexer->GetLineNumber() << ", expected NUMBER or '['" << endl;
+			m_lexer->GetDiagnostics() << "Error in command at line " << m_lexer->GetLineNumber() << ", expected NUMBER or '['" << endl;
 			return false;
 	}
 
@@ -227,7 +211,10 @@ bool GCodeParser::ParseArguments(GCodeCommand *gcmd)
 			case TOK_PARGUMENT:
 			case TOK_RARGUMENT:
 			case TOK_SARGUMENT: 
-			case TOK_TARGUMENT: {
+			case TOK_TARGUMENT:
+			case TOK_IARGUMENT:
+			case TOK_JARGUMENT:
+			case TOK_KARGUMENT: {
 				char argName = TokenArgumentToName(m_currentToken);
 				GExpr *paramValue = NULL;
 
@@ -241,7 +228,7 @@ bool GCodeParser::ParseArguments(GCodeCommand *gcmd)
 			}
 			case TOK_ERROR: return false;
 			default: 
-				out_err << "Expected argument or command at line " << m_lexer->GetLineNumber() << ", found '" << m_lexer->GetLexeme() << "'" << endl;
+				m_lexer->GetDiagnostics() << "Expected argument or command at line " << m_lexer->GetLineNumber() << ", found '" << m_lexer->GetLexeme() << "'" << endl;
 				return false;
 		}
 	}
@@ -249,6 +236,8 @@ bool GCodeParser::ParseArguments(GCodeCommand *gcmd)
 
 bool  GCodeParser::ParseNextStatement(GCodeStmt *&stmt)
 {
+	long long start = m_lexer->GetTokenStart();
+
 	stmt = NULL;
 	if (IsGCommand( m_currentToken ) || IsMCommand (m_currentToken) ) {
 		GCodeCommand *gcmd = new GCodeCommand();
@@ -265,6 +254,8 @@ bool  GCodeParser::ParseNextStatement(GCodeStmt *&stmt)
 			return false;
 		}
 
+		/* The current token is the one after the command */
+		gcmd->SetSource(start, m_lexer->GetPreviousTokenEnd() - start);
 		stmt = gcmd;
 		return true;
 
@@ -289,7 +280,7 @@ bool  GCodeParser::ParseNextStatement(GCodeStmt *&stmt)
 			}
 			case KW_ENDSUB: {
 				/* Oops dangling 'endsub' */
-				out_err << "'endsub' without a previous subroutine declaration" << endl;
+				m_lexer->GetDiagnostics() << "'endsub' without a previous subroutine declaration" << endl;
 				stmt = 0;
 				return false;
 			}
@@ -312,7 +303,7 @@ bool  GCodeParser::ParseNextStatement(GCodeStmt *&stmt)
 				return true;
 			}
 			default:
-				out_err << "Error at line " << m_lexer->GetLineNumber() << ", unexpected '" << m_lexer->GetLexeme() << "', expected 'sub', 'endsub', 'call'" << endl;
+				m_lexer->GetDiagnostics() << "Error at line " << m_lexer->GetLineNumber() << ", unexpected '" << m_lexer->GetLexeme() << "', expected 'sub', 'endsub', 'call'" << endl;
 				return false;
 		}
 	
@@ -339,6 +330,7 @@ bool  GCodeParser::ParseNextStatement(GCodeStmt *&stmt)
 			return false;
 		}
 
+		gcmd->SetSource(start, m_lexer->GetPreviousTokenEnd() - start);
 		stmt = gcmd;
 		return true;
 	}
@@ -0,0 +1,221 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include "gcode-stats.h"
+#include "gcode-arc.h"
+
+using namespace std;
+
+static inline void UpdateBoardArea(Real x, Real y, GMotionStats &stats)
+{
+    if (x < stats.BoardMinX)
+        stats.BoardMinX = x;
+
+    if (x > stats.BoardMaxX)
+        stats.BoardMaxX = x;
+
+    if (y < stats.BoardMinY)
+        stats.BoardMinY = y;
+
+    if (y > stats.BoardMaxY)
+        stats.BoardMaxY = y;
+}
+
+static inline bool ArcBefore(const GArc &arc, size_t point)
+{
+    return arc.point < point;
+}
+
+void GMotionStats::Clear()
+{
+    BoardMinX = BoardMinY = numeric_limits<Real>::infinity();
+    BoardMaxX = BoardMaxY = -numeric_limits<Real>::infinity();
+    MinZ = numeric_limits<Real>::infinity();
+    MaxZ = -numeric_limits<Real>::infinity();
+    RouteDepth = 0;
+    HasRouteDepth = false;
+    CutLength = RapidLength = 0;
+    fill(Count, Count + SEG_PROBE + 1, 0);
+    FeedLength.clear();
+}
+
+void GMotionStats::Add(const GTrajectory &trajectory, size_t first, size_t last)
+{
+    GSpan<Real> xs = trajectory.GetX();
+    GSpan<Real> ys = trajectory.GetY();
+    GSpan<Real> zs = trajectory.GetZ();
+    GSpan<unsigned char> kinds = trajectory.GetKind();
+    GSpan<float> feeds = trajectory.GetFeed();
+    GSpan<GArc> arcs = trajectory.GetArcs();
+    const GArc *arc = lower_bound(arcs.begin(), arcs.end(), first, ArcBefore);
+    Position start = trajectory.GetStartPosition(first);
+    float runFeed = 0;
+    Real runLength = 0;
+
+    for (size_t i = first; i < last; i++) {
+        int kind = kinds[i];
+        Real x = xs[i], y = ys[i], z = zs[i];
+
+        Count[kind]++;
+
+        /* The probe cycles go back to where they started */
+        if (kind == SEG_PROBE) {
+            UpdateBoardArea(x, y, *this);
+            continue;
+        }
+
+        MinZ = min(MinZ, z);
+        MaxZ = max(MaxZ, z);
+
+        if (kind == SEG_DRILL)
+            UpdateBoardArea(x, y, *this);
+        else {
+            Real dx = x - start.x, dy = y - start.y, dz = z - start.z;
+            Real length;
+
+            if (kind == SEG_ARC) {
+                Real rx = start.x - arc->cx, ry = start.y - arc->cy;
+                Real xy = sqrt(rx * rx + ry * ry) * fabs(arc->sweep);
+
+                length = sqrt(xy * xy + dz * dz);
+
+                if (z < 0) {
+                    Position end;
+                    Real minX, minY, maxX, maxY;
+
+                    end.x = x;
+                    end.y = y;
+                    end.z = z;
+                    GetArcBounds(*arc, start, end, minX, minY, maxX, maxY);
+                    UpdateBoardArea(minX, minY, *this);
+                    UpdateBoardArea(maxX, maxY, *this);
+                }
+
+                arc++;
+            } else
+                length = sqrt(dx * dx + dy * dy + dz * dz);
+
+            if (kind == SEG_RAPID)
+                RapidLength += length;
+            else {
+                if (feeds[i] != runFeed) {
+                    if (runLength != 0)
+                        FeedLength[runFeed] += runLength;
+
+                    runFeed = feeds[i];
+                    runLength = 0;
+                }
+
+                runLength += length;
+                CutLength += length;
+            }
+
+            if (z < 0) {
+                RouteDepth = z;
+                HasRouteDepth = true;
+                UpdateBoardArea(x, y, *this);
+            }
+        }
+
+        start.x = x;
+        start.y = y;
+        start.z = z;
+    }
+
+    if (runLength != 0)
+        FeedLength[runFeed] += runLength;
+}
+
+void GMotionStats::Merge(const GMotionStats &next)
+{
+    BoardMinX = min(BoardMinX, next.BoardMinX);
+    BoardMinY = min(BoardMinY, next.BoardMinY);
+    BoardMaxX = max(BoardMaxX, next.BoardMaxX);
+    BoardMaxY = max(BoardMaxY, next.BoardMaxY);
+    MinZ = min(MinZ, next.MinZ);
+    MaxZ = max(MaxZ, next.MaxZ);
+
+    if (next.HasRouteDepth) {
+        RouteDepth = next.RouteDepth;
+        HasRouteDepth = true;
+    }
+
+    CutLength += next.CutLength;
+    RapidLength += next.RapidLength;
+
+    for (int kind = 0; kind <= SEG_PROBE; kind++)
+        Count[kind] += next.Count[kind];
+
+    for (map<float, Real>::const_iterator it = next.FeedLength.begin(); it != next.FeedLength.end(); it++)
+        FeedLength[it->first] += it->second;
+}
+
+void GMotionStats::Store(GCodeInfo &gi) const
+{
+    bool moves = MinZ <= MaxZ;
+
+    gi.BoardMinX = BoardMinX;
+    gi.BoardMinY = BoardMinY;
+    gi.BoardMaxX = BoardMaxX;
+    gi.BoardMaxY = BoardMaxY;
+    gi.MillRouteDepth = RouteDepth;
+    gi.CutLength = CutLength;
+    gi.RapidLength = RapidLength;
+    gi.RapidCount = Count[SEG_RAPID];
+    gi.CutCount = Count[SEG_CUT];
+    gi.ArcCount = Count[SEG_ARC];
+    gi.DrillCount = Count[SEG_DRILL];
+    gi.ProbeCount = Count[SEG_PROBE];
+    gi.MinZ = moves? MinZ : 0;
+    gi.MaxZ = moves? MaxZ : 0;
+    gi.FeedHistogram = FeedLength;
+}
+
+/*
+ * Every task reduces a contiguous range, the partial results are merged in
+ * order so the route depth (the last one) doesn't depend on the split.
+ */
+void ComputeMotionStats(const GTrajectory &trajectory, GMotionStats &stats, unsigned int tasks)
+{
+    size_t size = trajectory.Size();
+
+    tasks = GTaskScheduler::Get().GetTaskCount(size, STATS_MIN_POINTS_PER_TASK, tasks);
+
+    stats.Clear();
+
+    if (tasks == 1) {
+        stats.Add(trajectory, 0, size);
+        return;
+    }
+
+    vector<GMotionStats> partial(tasks);
+    GTaskGroup group;
+
+    for (unsigned int t = 1; t < tasks; t++) {
+        GMotionStats *part = &partial[t];
+
+        group.Run([part, &trajectory, size, t, tasks]() { part->Add(trajectory, size * t / tasks, size * (t + 1) / tasks); });
+    }
+
+    stats.Add(trajectory, 0, size / tasks);
+    group.Wait();
+
+    for (unsigned int t = 1; t < tasks; t++)
+        stats.Merge(partial[t]);
+}
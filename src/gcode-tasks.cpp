@@ -0,0 +1,286 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "gcode-tasks.h"
+
+using namespace std;
+
+static unsigned int s_threadCount = 0;
+
+/* Worker of the calling thread (-1 out of the scheduler) and priority of the task it runs */
+static thread_local int t_worker = -1;
+static thread_local GTaskPriority t_priority = TASK_NORMAL;
+
+GTaskGroup::GTaskGroup(GCancelToken *token)
+{
+    m_priority = GTaskScheduler::GetCurrentPriority();
+    m_token = token;
+    m_pending = 0;
+}
+
+GTaskGroup::GTaskGroup(GTaskPriority priority, GCancelToken *token)
+{
+    m_priority = priority;
+    m_token = token;
+    m_pending = 0;
+}
+
+void GTaskGroup::Run(const function<void()> &work)
+{
+    GTask *task = new GTask;
+
+    task->work = work;
+    task->group = this;
+    m_pending++;
+
+    GTaskScheduler::Get().Submit(task);
+}
+
+void GTaskGroup::Wait()
+{
+    if (m_pending != 0)
+        GTaskScheduler::Get().Wait(this);
+}
+
+GTaskScheduler &GTaskScheduler::Get()
+{
+    static GTaskScheduler scheduler(s_threadCount);
+
+    return scheduler;
+}
+
+void GTaskScheduler::SetThreadCount(unsigned int threads)
+{
+    s_threadCount = min(threads, (unsigned int)TASK_MAX_THREADS);
+}
+
+GTaskPriority GTaskScheduler::GetCurrentPriority()
+{
+    return t_priority;
+}
+
+unsigned int GTaskScheduler::GetTaskCount(size_t size, size_t minPerTask, unsigned int tasks)
+{
+    if (tasks == 0)
+        tasks = GetThreadCount();
+
+    if (minPerTask != 0)
+        tasks = (unsigned int)min((size_t)tasks, max((size_t)1, size / minPerTask));
+
+    return max(1u, tasks);
+}
+
+GTaskScheduler::GTaskScheduler(unsigned int threads)
+{
+    if (threads == 0)
+        threads = max(1u, thread::hardware_concurrency());
+
+    m_generation = 0;
+    m_stop = false;
+
+    for (unsigned int i = 1; i < threads; i++)
+        m_workers.push_back(new Worker());
+
+    for (unsigned int i = 0; i < m_workers.size(); i++)
+        m_threads.push_back(thread(&GTaskScheduler::WorkerLoop, this, (int)i));
+}
+
+GTaskScheduler::~GTaskScheduler()
+{
+    {
+        lock_guard<mutex> lock(m_sleepLock);
+
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (unsigned int i = 0; i < m_threads.size(); i++)
+        m_threads[i].join();
+
+    for (unsigned int i = 0; i < m_workers.size(); i++)
+        delete m_workers[i];
+}
+
+/* Wakes the sleeping threads, they look for work or for the group they wait for */
+void GTaskScheduler::Signal()
+{
+    {
+        lock_guard<mutex> lock(m_sleepLock);
+
+        m_generation++;
+    }
+    m_wake.notify_all();
+}
+
+void GTaskScheduler::Submit(GTask *task)
+{
+    Worker &worker = (t_worker >= 0)? *m_workers[t_worker] : m_shared;
+
+    {
+        lock_guard<mutex> lock(worker.lock);
+
+        worker.tasks[task->group->m_priority].push_back(task);
+    }
+
+    Signal();
+}
+
+/* The newest or the oldest task of a deque, only those of 'group' if it's not NULL */
+GTask *GTaskScheduler::TakeFrom(Worker &worker, int priority, bool newest, GTaskGroup *group)
+{
+    lock_guard<mutex> lock(worker.lock);
+    deque<GTask *> &tasks = worker.tasks[priority];
+    GTask *task = NULL;
+
+    if (tasks.empty())
+        return NULL;
+
+    if (group == NULL) {
+        if (newest) {
+            task = tasks.back();
+            tasks.pop_back();
+        } else {
+            task = tasks.front();
+            tasks.pop_front();
+        }
+    } else if (newest) {
+        for (size_t i = tasks.size(); i > 0; i--) {
+            if (tasks[i - 1]->group == group) {
+                task = tasks[i - 1];
+                tasks.erase(tasks.begin() + (i - 1));
+                break;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < tasks.size(); i++) {
+            if (tasks[i]->group == group) {
+                task = tasks[i];
+                tasks.erase(tasks.begin() + i);
+                break;
+            }
+        }
+    }
+
+    return task;
+}
+
+/*
+ * Next task for worker 'self' (-1 out of the scheduler), by priority: its own
+ * newest one, then the oldest shared one, then the oldest one of another
+ * worker.  A thread waiting for a group only takes the tasks of the group, it
+ * doesn't start other work that could keep it from returning.
+ */
+GTask *GTaskScheduler::Take(int self, GTaskGroup *group)
+{
+    int first = (group != NULL)? group->m_priority : 0;
+    int last = (group != NULL)? group->m_priority : TASK_PRIORITY_COUNT - 1;
+    int count = m_workers.size();
+
+    for (int priority = first; priority <= last; priority++) {
+        GTask *task = NULL;
+
+        if (self >= 0)
+            task = TakeFrom(*m_workers[self], priority, true, group);
+
+        if (task == NULL)
+            task = TakeFrom(m_shared, priority, false, group);
+
+        for (int i = 1; i <= count && task == NULL; i++) {
+            int victim = (self + i) % count;
+
+            if (victim != self)
+                task = TakeFrom(*m_workers[victim], priority, false, group);
+        }
+
+        if (task != NULL)
+            return task;
+    }
+
+    return NULL;
+}
+
+void GTaskScheduler::Execute(GTask *task)
+{
+    GTaskGroup *group = task->group;
+    GTaskPriority priority = t_priority;
+
+    t_priority = group->m_priority;
+    if (!group->IsCancelled())
+        task->work();
+    t_priority = priority;
+
+    delete task;
+
+    /* The group can be gone as soon as its waiter sees it finished */
+    if (--group->m_pending == 0)
+        Signal();
+}
+
+void GTaskScheduler::Wait(GTaskGroup *group)
+{
+    while (group->m_pending != 0) {
+        unsigned long generation;
+
+        {
+            lock_guard<mutex> lock(m_sleepLock);
+
+            generation = m_generation;
+        }
+
+        GTask *task = Take(t_worker, group);
+
+        if (task != NULL) {
+            Execute(task);
+            continue;
+        }
+
+        /* Its tasks are running in other threads */
+        unique_lock<mutex> lock(m_sleepLock);
+
+        while (m_generation == generation && group->m_pending != 0)
+            m_wake.wait(lock);
+    }
+}
+
+void GTaskScheduler::WorkerLoop(int self)
+{
+    t_worker = self;
+
+    for (;;) {
+        unsigned long generation;
+
+        {
+            lock_guard<mutex> lock(m_sleepLock);
+
+            if (m_stop)
+                return;
+
+            generation = m_generation;
+        }
+
+        GTask *task = Take(self, NULL);
+
+        if (task != NULL) {
+            Execute(task);
+            continue;
+        }
+
+        unique_lock<mutex> lock(m_sleepLock);
+
+        while (m_generation == generation && !m_stop)
+            m_wake.wait(lock);
+    }
+}
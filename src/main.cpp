@@ -15,10 +15,99 @@
 
 #include "MCBGenerator.h"
 #include <QtGui/QApplication>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include "gcode-int.h"
+#include "gcode-autoleveller.h"
+#include "gcode-estimator.h"
+
+using namespace std;
+
+static void PrintMemoryUsage(const char *label, size_t bytes, size_t total)
+{
+	printf("  %-14s %12lu  %5.1f%%\n", label, (unsigned long)bytes, (total == 0)? 0.0 : 100.0 * bytes / total);
+}
+
+/*
+ * Prints the memory used by every file, the files are also split with the
+ * default autolevel grid so the autoleveller buffers are accounted too.
+ */
+static int DumpStats(int fileCount, char *files[])
+{
+	int result = 0;
+
+	for (int i = 0; i < fileCount; i++) {
+		GCodeInt ginter(files[i]);
+		GDiagnostics diagnostics;
+
+		if (!ginter.LoadFile(diagnostics)) {
+			fprintf(stderr, "%s: %s", files[i], diagnostics.GetText().c_str());
+			result = 1;
+			continue;
+		}
+
+		GCodeInfo *gi = ginter.GetGCodeInfo();
+		GCodeAutoleveller gal(&ginter);
+		AutolevellerInfo *ainfo = gal.GetAutolevellerInfo();
+
+		ainfo->GridSize = (gi->SourceUnitType == UNIT_INCHES)? 0.2 : 5.0;
+		ainfo->EngravingDepth = gi->MillRouteDepth / gi->UnitScale;
+		gal.SplitSegments();
+
+		GCodeMemoryUsage usage = ginter.GetMemoryUsage();
+		size_t total = usage.Total();
+
+		printf("%s: %d statements, %lu expressions (%lu stored), loaded in %d ms\n", files[i],
+			   ginter.GetStatementCount(), gi->ExprCount, gi->UniqueExprCount, gi->LoadTime);
+		PrintMemoryUsage("statements", usage.Statements, total);
+		PrintMemoryUsage("expressions", usage.Expressions, total);
+		PrintMemoryUsage("arguments", usage.Arguments, total);
+		PrintMemoryUsage("strings", usage.Strings, total);
+		PrintMemoryUsage("parameters", usage.Parameters, total);
+		PrintMemoryUsage("probe points", usage.ProbePoints, total);
+		PrintMemoryUsage("trajectory", usage.Trajectory, total);
+		PrintMemoryUsage("autoleveller", usage.Autoleveller, total);
+		PrintMemoryUsage("total", total, total);
+
+		printf("  cut length %.1f, rapids %.1f, Z %.3f to %.3f\n",
+			   (double)gi->CutLength, (double)gi->RapidLength, (double)gi->MinZ, (double)gi->MaxZ);
+		printf("  moves: %lu rapids, %lu cuts, %lu arcs, %lu drills, %lu probes\n",
+			   gi->RapidCount, gi->CutCount, gi->ArcCount, gi->DrillCount, gi->ProbeCount);
+
+		for (map<float, Real>::iterator it = gi->FeedHistogram.begin(); it != gi->FeedHistogram.end(); it++)
+			printf("    F%g %.1f\n", it->first, (double)it->second);
+
+		GCodeTimeEstimator estimator(&ginter);
+		GTimeEstimate estimate;
+
+		estimator.Estimate(estimate);
+		printf("  machining time %.0f s (rapids %.0f, cutting %.0f, drilling %.0f, probing %.0f, tool changes %.0f), estimated in %d ms\n",
+			   estimate.Total, estimate.Rapid, estimate.Cutting, estimate.Drilling, estimate.Probing, estimate.ToolChanges,
+			   estimate.EstimateTime);
+
+		for (map<int, double>::iterator it = estimate.ToolTime.begin(); it != estimate.ToolTime.end(); it++)
+			printf("    T%d %.0f s\n", it->first, it->second);
+
+		GPhaseTimes &times = ginter.GetPhaseTimes();
+
+		printf("  phases (ms):");
+		for (int phase = 0; phase < PHASE_COUNT; phase++)
+			printf(" %s %.1f", GetPhaseName(phase), times.Seconds[phase] * 1000);
+		printf("\n");
+	}
+
+	return result;
+}
 
 int main(int argc, char *argv[])
 {
+	/* Only the core is used, it runs without a display */
+	if (argc > 2 && strcmp(argv[1], "--stats") == 0)
+		return DumpStats(argc - 2, &argv[2]);
+
 	QApplication a(argc, argv);
+
 	PCBMillingGenerator w;
 	w.show();
 	return a.exec();
@@ -0,0 +1,583 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Batch autoleveller: loads every file given, autolevels it and prints one
+ * JSON object per file (JSON lines) with its statistics and the time of every
+ * phase (see GPhaseTimes).  It only uses the GCode engine, no QT.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "gcode-int.h"
+#include "gcode-autoleveller.h"
+#include "gcode-estimator.h"
+#include "gcode-export.h"
+
+using namespace std;
+
+/* Options of the batch, the autoleveller ones are NAN if they weren't given */
+struct CliOptions
+{
+	unsigned int jobs;
+	long long memoryBudget;     //Bytes
+	string outputDir;           //Empty for the directory of every input
+	bool autolevel;
+	bool stream;                //GCodeInt::StreamFile instead of LoadFile
+	bool trajectory;            //Export the trajectory, see ExportTrajectory
+	vector<pair<string, double> > parameters;  //Changed after loading, see GCodeInt::SetParameter
+	string jsonPath;            //Empty for stdout
+	int units;                  //Of the statistics, UNIT_FILE for the units of every file
+
+	double gridSize;
+	double engravingDepth;      //The route depth of the file by default
+	double probeMaxDepth;
+	double traverseHeight;
+	double traverseSpeed;
+	double probeSpeed;
+	double clearHeight;
+	double initialProbeZ;
+};
+
+/* Files taken by the workers at once are limited by their estimated memory, like GCodeLoadAdmission */
+class MemoryBudget
+{
+public:
+	MemoryBudget(long long budget) { m_budget = budget; m_inUse = 0; }
+
+	/* A file over the budget is let in alone */
+	void Acquire(long long bytes) {
+		unique_lock<mutex> lock(m_mutex);
+
+		while (m_inUse > 0 && m_inUse + bytes > m_budget)
+			m_released.wait(lock);
+
+		m_inUse += bytes;
+	}
+
+	void Release(long long bytes) {
+		lock_guard<mutex> lock(m_mutex);
+
+		m_inUse -= bytes;
+		m_released.notify_all();
+	}
+
+private:
+	mutex m_mutex;
+	condition_variable m_released;
+	long long m_budget;
+	long long m_inUse;
+};
+
+static inline long ElapsedMs(chrono::steady_clock::time_point since)
+{
+	return (long)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - since).count();
+}
+
+static void JsonString(string &out, const string &text)
+{
+	out += '"';
+
+	for (size_t i = 0; i < text.size(); i++) {
+		unsigned char c = text[i];
+
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			char escape[8];
+
+			snprintf(escape, sizeof(escape), "\\u%04x", c);
+			out += escape;
+		} else
+			out += c;
+	}
+
+	out += '"';
+}
+
+/* JSON has no infinity nor NaN, e.g. the board area of a file without cuts */
+static void JsonNumber(string &out, double value)
+{
+	char text[32];
+
+	if (!isfinite(value)) {
+		out += "null";
+		return;
+	}
+
+	snprintf(text, sizeof(text), "%.10g", value);
+	out += text;
+}
+
+static void JsonField(string &out, const char *name)
+{
+	if (out.size() > 1)
+		out += ',';
+
+	JsonString(out, name);
+	out += ':';
+}
+
+static void JsonField(string &out, const char *name, double value)
+{
+	JsonField(out, name);
+	JsonNumber(out, value);
+}
+
+static void JsonField(string &out, const char *name, const string &value)
+{
+	JsonField(out, name);
+	JsonString(out, value);
+}
+
+/* The input name without its extension and 'suffix', .probe.ngc is the name DialogAutolevel gives */
+static string OutputPath(const string &inputPath, const string &outputDir, const char *suffix)
+{
+	size_t slash = inputPath.find_last_of("/\\");
+	string dir = (slash == string::npos)? "" : inputPath.substr(0, slash + 1);
+	string name = (slash == string::npos)? inputPath : inputPath.substr(slash + 1);
+	size_t dot = name.rfind('.');
+
+	if (dot != string::npos && dot > 0)
+		name.erase(dot);
+
+	if (!outputDir.empty())
+		dir = outputDir + "/";
+
+	return dir + name + suffix;
+}
+
+static long long FileSize(const string &path)
+{
+	struct stat info;
+
+	return (stat(path.c_str(), &info) == 0)? (long long)info.st_size : 0;
+}
+
+/* Units given on the command line are the units of the program, the defaults are DialogAutolevel's */
+static void SetAutolevellerInfo(AutolevellerInfo *ainfo, GCodeInfo *gi, const CliOptions &options)
+{
+	bool inches = (gi->SourceUnitType == UNIT_INCHES);
+
+	ainfo->GridSize = !isnan(options.gridSize)? options.gridSize : (inches? 0.2 : 5.0);
+	ainfo->EngravingDepth = !isnan(options.engravingDepth)? options.engravingDepth : (double)(gi->MillRouteDepth / gi->UnitScale);
+	ainfo->ProbeMaxDepth = !isnan(options.probeMaxDepth)? options.probeMaxDepth : (inches? -0.039 : -1.0);
+	ainfo->TraverseHeight = !isnan(options.traverseHeight)? options.traverseHeight : (inches? 0.02 : 0.5);
+	ainfo->TraverseSpeed = !isnan(options.traverseSpeed)? options.traverseSpeed : (inches? 15.7 : 400);
+	ainfo->ProbeSpeed = !isnan(options.probeSpeed)? options.probeSpeed : (inches? 2.4 : 60);
+
+	/* The autoleveller has its own defaults for these */
+	if (!isnan(options.clearHeight))
+		ainfo->ClearHeight = options.clearHeight;
+
+	if (!isnan(options.initialProbeZ))
+		ainfo->InitialProbeZ = options.initialProbeZ;
+}
+
+/* Loads, autolevels and computes the statistics of a file, returns its JSON object */
+static string ProcessFile(const string &path, const CliOptions &options, bool &ok)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	string json = "{";
+	GCodeInt ginter(path);
+	GDiagnostics diagnostics;	//Of the whole processing of the file
+
+	JsonField(json, "file", path);
+
+	ginter.SetCanonicalUnits(options.units);
+
+	ok = options.stream? ginter.StreamFile(diagnostics) : ginter.LoadFile(diagnostics);
+
+	/* What-if changes, everything below sees them */
+	for (size_t i = 0; i < options.parameters.size() && ok; i++)
+		ok = ginter.SetParameter(options.parameters[i].first, options.parameters[i].second, diagnostics);
+
+	if (ok) {
+		GCodeInfo *gi = ginter.GetGCodeInfo();
+		GCodeTimeEstimator estimator(&ginter);
+		GTimeEstimate estimate;
+
+		/* The estimator goes over the trajectory, a streamed file has none */
+		if (!options.stream)
+			estimator.Estimate(estimate);
+
+		JsonField(json, "units", string((gi->UnitType == UNIT_INCHES)? "in" : "mm"));
+		JsonField(json, "source_units", string((gi->SourceUnitType == UNIT_INCHES)? "in" : "mm"));
+		JsonField(json, "statements", (double)gi->StatementCount);
+		JsonField(json, "load_ms", gi->LoadTime);
+
+		if (options.autolevel) {
+			GCodeAutoleveller gal(&ginter);
+			string outputPath = OutputPath(path, options.outputDir, ".probe.ngc");
+
+			SetAutolevellerInfo(gal.GetAutolevellerInfo(), gi, options);
+
+			if (options.stream)
+				ok = gal.StreamAutolevellingGCode(outputPath.c_str(), diagnostics);
+			else {
+				gal.SplitSegments();
+				ok = gal.GenerateAutolevellingGCode(outputPath.c_str(), diagnostics);
+			}
+
+			JsonField(json, "output", outputPath);
+			JsonField(json, "output_statements", gal.GetOutputSize());
+			JsonField(json, "zcomp_dedup", gal.GetZCompensationDedupRatio());
+		}
+
+		JsonField(json, "board");
+		json += '[';
+		JsonNumber(json, gi->BoardMinX);
+		json += ',';
+		JsonNumber(json, gi->BoardMinY);
+		json += ',';
+		JsonNumber(json, gi->BoardMaxX);
+		json += ',';
+		JsonNumber(json, gi->BoardMaxY);
+		json += ']';
+
+		JsonField(json, "route_depth", gi->MillRouteDepth);
+		JsonField(json, "cut_length", gi->CutLength);
+		JsonField(json, "rapid_length", gi->RapidLength);
+
+		JsonField(json, "moves");
+		json += "{\"rapid\":" + to_string(gi->RapidCount) + ",\"cut\":" + to_string(gi->CutCount) +
+				",\"arc\":" + to_string(gi->ArcCount) + ",\"drill\":" + to_string(gi->DrillCount) +
+				",\"probe\":" + to_string(gi->ProbeCount) + "}";
+
+		JsonField(json, "z");
+		json += '[';
+		JsonNumber(json, gi->MinZ);
+		json += ',';
+		JsonNumber(json, gi->MaxZ);
+		json += ']';
+
+		/* Cut length by feed rate */
+		JsonField(json, "feeds");
+		json += '{';
+		for (map<float, Real>::iterator it = gi->FeedHistogram.begin(); it != gi->FeedHistogram.end(); it++) {
+			char feed[32];
+
+			if (it != gi->FeedHistogram.begin())
+				json += ',';
+
+			snprintf(feed, sizeof(feed), "%g", it->first);
+			JsonString(json, feed);
+			json += ':';
+			JsonNumber(json, it->second);
+		}
+		json += '}';
+
+		if (!options.stream)
+			JsonField(json, "machining_s", estimate.Total);
+
+		/* In the units of the statistics, like the trajectory */
+		if (options.trajectory) {
+			string prefix = OutputPath(path, options.outputDir, ".");
+
+			if (!ExportTrajectory(&ginter, prefix, diagnostics))
+				ok = false;
+
+			JsonField(json, "trajectory", prefix + "*.npy");
+		}
+	}
+
+	/* Milliseconds by phase, also for a file that failed to load */
+	GPhaseTimes &times = ginter.GetPhaseTimes();
+
+	JsonField(json, "phases_ms");
+	json += '{';
+	for (int phase = 0; phase < PHASE_COUNT; phase++) {
+		if (phase != 0)
+			json += ',';
+
+		JsonString(json, GetPhaseName(phase));
+		json += ':';
+		JsonNumber(json, times.Seconds[phase] * 1000);
+	}
+	json += '}';
+
+	JsonField(json, "ok");
+	json += ok? "true" : "false";
+
+	if (!ok)
+		JsonField(json, "error", diagnostics.GetText());
+
+	JsonField(json, "total_ms", ElapsedMs(start));
+	json += '}';
+
+	return json;
+}
+
+static void PrintUsage()
+{
+	fprintf(stderr,
+			"Usage: mcb-cli [options] file...\n"
+			"Autolevels every file (the output is <name>.probe.ngc) and prints a JSON object per file.\n"
+			"\n"
+			"  -j, --jobs N               threads (files processed at the same time), one per core by default, 256 at most\n"
+			"  -m, --memory MB            memory for the files being processed, half the RAM by default\n"
+			"  -o, --output-dir DIR       directory of the autolevelled files, the input one by default\n"
+			"  -n, --no-autolevel         only load the files and compute their statistics\n"
+			"  -s, --stream               read the files in a constant memory, without keeping them\n"
+			"                             (no machining time, autolevelling reads them three times)\n"
+			"  -t, --trajectory           export the trajectory as NumPy columns, <name>.x.npy, <name>.feed.npy...\n"
+			"      --json FILE            write the JSON lines to FILE instead of stdout\n"
+			"      --units mm|in          units of the statistics, those of every file by default\n"
+			"      --set PARAM=VALUE      change a parameter (e.g. #3=-0.2) for the statistics, the machining\n"
+			"                             time and the trajectory, with -n; it can be given more than once\n"
+			"\n"
+			"Autoleveller options, in the units of every file (the defaults depend on the units):\n"
+			"      --grid SIZE            grid cell size (5 mm, 0.2 in)\n"
+			"      --engraving-depth Z    depth of the cuts, the route depth of the file by default\n"
+			"      --probe-depth Z        probe maximum depth (-1 mm, -0.039 in)\n"
+			"      --traverse-height Z    (0.5 mm, 0.02 in)\n"
+			"      --traverse-speed F     (400 mm/min, 15.7 in/min)\n"
+			"      --probe-speed F        (60 mm/min, 2.4 in/min)\n"
+			"      --clear-height Z       (12 mm, 0.47244 in)\n"
+			"      --initial-probe-z Z    (-5 mm, -0.1969 in)\n");
+}
+
+static bool ParseNumber(const char *text, double &value)
+{
+	char *end;
+
+	value = strtod(text, &end);
+
+	return end != text && *end == '\0';
+}
+
+/* Whole number of jobs, TASK_MAX_THREADS at most */
+static bool ParseJobs(const char *text, unsigned int &jobs)
+{
+	char *end;
+	long value = strtol(text, &end, 10);
+
+	if (end == text || *end != '\0' || value < 1)
+		return false;
+
+	jobs = (unsigned int)min(value, (long)TASK_MAX_THREADS);
+
+	return true;
+}
+
+static bool ParseOptions(int argc, char *argv[], CliOptions &options, vector<string> &files)
+{
+	struct NumberOption { const char *name; double *value; };
+	NumberOption numbers[] = {
+		{ "--grid", &options.gridSize },
+		{ "--engraving-depth", &options.engravingDepth },
+		{ "--probe-depth", &options.probeMaxDepth },
+		{ "--traverse-height", &options.traverseHeight },
+		{ "--traverse-speed", &options.traverseSpeed },
+		{ "--probe-speed", &options.probeSpeed },
+		{ "--clear-height", &options.clearHeight },
+		{ "--initial-probe-z", &options.initialProbeZ },
+	};
+	long long memory = GetPhysicalMemory();
+
+	options.jobs = min(max(1u, thread::hardware_concurrency()), (unsigned int)TASK_MAX_THREADS);
+	options.memoryBudget = (memory > 0)? memory / 2 : (long long)1 << 30;
+	options.autolevel = true;
+	options.stream = false;
+	options.trajectory = false;
+	options.units = UNIT_FILE;
+	options.gridSize = options.engravingDepth = options.probeMaxDepth = NAN;
+	options.traverseHeight = options.traverseSpeed = options.probeSpeed = NAN;
+	options.clearHeight = options.initialProbeZ = NAN;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = (i + 1 < argc);
+		double value;
+
+		if (arg == "-n" || arg == "--no-autolevel") {
+			options.autolevel = false;
+			continue;
+		}
+
+		if (arg == "-s" || arg == "--stream") {
+			options.stream = true;
+			continue;
+		}
+
+		if (arg == "-t" || arg == "--trajectory") {
+			options.trajectory = true;
+			continue;
+		}
+
+		if (arg[0] != '-') {
+			files.push_back(arg);
+			continue;
+		}
+
+		if (!hasValue) {
+			fprintf(stderr, "mcb-cli: %s needs a value\n", arg.c_str());
+			return false;
+		}
+
+		const char *text = argv[++i];
+
+		if (arg == "-o" || arg == "--output-dir") {
+			options.outputDir = text;
+			continue;
+		}
+
+		if (arg == "--json") {
+			options.jsonPath = text;
+			continue;
+		}
+
+		if (arg == "--set") {
+			const char *equal = strchr(text, '=');
+
+			if (equal == NULL || equal == text || !ParseNumber(equal + 1, value)) {
+				fprintf(stderr, "mcb-cli: %s is not PARAM=VALUE for --set\n", text);
+				return false;
+			}
+
+			options.parameters.push_back(make_pair(string(text, equal - text), value));
+			continue;
+		}
+
+		if (arg == "--units") {
+			if (strcmp(text, "mm") == 0)
+				options.units = UNIT_MM;
+			else if (strcmp(text, "in") == 0)
+				options.units = UNIT_INCHES;
+			else {
+				fprintf(stderr, "mcb-cli: unknown units %s\n", text);
+				return false;
+			}
+			continue;
+		}
+
+		if (arg == "-j" || arg == "--jobs") {
+			if (!ParseJobs(text, options.jobs)) {
+				fprintf(stderr, "mcb-cli: %s is not a number of jobs for %s\n", text, arg.c_str());
+				return false;
+			}
+			continue;
+		}
+
+		if (!ParseNumber(text, value)) {
+			fprintf(stderr, "mcb-cli: %s is not a number for %s\n", text, arg.c_str());
+			return false;
+		}
+
+		if (arg == "-m" || arg == "--memory") {
+			options.memoryBudget = (long long)(value * 1024 * 1024);
+			continue;
+		}
+
+		unsigned int n;
+
+		for (n = 0; n < sizeof(numbers) / sizeof(numbers[0]); n++) {
+			if (arg == numbers[n].name) {
+				*numbers[n].value = value;
+				break;
+			}
+		}
+
+		if (n == sizeof(numbers) / sizeof(numbers[0])) {
+			fprintf(stderr, "mcb-cli: unknown option %s\n", arg.c_str());
+			return false;
+		}
+	}
+
+	/* A streamed file keeps no trajectory */
+	if (options.trajectory && options.stream) {
+		fprintf(stderr, "mcb-cli: --trajectory can't be used with --stream\n");
+		return false;
+	}
+
+	/* The autolevelled file is written from the statements, which keep the assignments of the program */
+	if (!options.parameters.empty() && (options.stream || options.autolevel)) {
+		fprintf(stderr, "mcb-cli: --set needs -n and can't be used with --stream\n");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	CliOptions options;
+	vector<string> files;
+
+	if (!ParseOptions(argc, argv, options, files) || files.empty()) {
+		PrintUsage();
+		return 2;
+	}
+
+	FILE *json = stdout;
+
+	if (!options.jsonPath.empty() && (json = fopen(options.jsonPath.c_str(), "w")) == NULL) {
+		fprintf(stderr, "mcb-cli: unable to open %s\n", options.jsonPath.c_str());
+		return 2;
+	}
+
+	/* The files and the work they split share the threads of the scheduler */
+	GTaskScheduler::SetThreadCount(options.jobs);
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	unsigned int jobs = min(options.jobs, (unsigned int)files.size());
+	MemoryBudget budget(options.memoryBudget);
+	atomic<int> failed(0);
+	mutex outputMutex;
+	GTaskGroup group(TASK_BATCH);
+
+	/* A task per file, taken in order, the lines are written as the files are done */
+	for (size_t index = 0; index < files.size(); index++) {
+		group.Run([&, index]() {
+			long long memory = options.stream? STREAM_MEMORY_BYTES : FileSize(files[index]) * LOAD_MEMORY_PER_FILE_BYTE;
+			bool ok;
+
+			budget.Acquire(memory);
+			string line = ProcessFile(files[index], options, ok);
+			budget.Release(memory);
+
+			if (!ok)
+				failed++;
+
+			lock_guard<mutex> lock(outputMutex);
+
+			fprintf(json, "%s\n", line.c_str());
+			fflush(json);
+		});
+	}
+
+	group.Wait();
+
+	fprintf(json, "{\"files\":%u,\"failed\":%d,\"jobs\":%u,\"total_ms\":%ld}\n",
+			(unsigned int)files.size(), (int)failed, jobs, ElapsedMs(start));
+
+	if (json != stdout)
+		fclose(json);
+
+	return (failed == 0)? 0 : 1;
+}
@@ -23,12 +23,13 @@
 #include <string>
 #include <cmath>
 #include <sstream>
+#include <QMutexLocker>
 #include "qrenderarea.h"
+#include "GCodeLoader.h"
+#include "gcode-arc.h"
 
 using namespace std;
 
-extern stringstream out_err;
-
 QRenderArea::QRenderArea(QWidget *parent)
 	: QWidget(parent)
 {
@@ -40,6 +41,8 @@ QRenderArea::QRenderArea(QWidget *parent)
 
 QRenderArea::~QRenderArea()
 {
+	for (int i = 0; i < m_listPlot.size(); i++)
+		delete m_listPlot[i].arcCache;
 }
 
 void QRenderArea::ZoomToFit()
@@ -55,13 +58,9 @@ void QRenderArea::ZoomToFit()
     mill_dx = (gi.BoardMaxX - gi.BoardMinX);
     mill_dy = (gi.BoardMaxY - gi.BoardMinY);
 
-	if (gi.UnitType == UNIT_INCHES) {
-		mill_dx += 0.4;
-		mill_dy += 0.4;
-	} else if (gi.UnitType == UNIT_MM) {
-		mill_dx += 10.0;
-		mill_dy += 10.0;
-	}
+	/* The files and the preview are in mm, see GCodeLoader */
+	mill_dx += 10.0;
+	mill_dy += 10.0;
 
 	scaleX = (epx - spx) / (mill_dx * m_currPlot.m_dpuX);
 	scaleY = (epy - spy) / (mill_dy * m_currPlot.m_dpuY);
@@ -86,24 +85,24 @@ GPlotterInfo &QRenderArea::GetPlotInfo(GCodeInt *ginter, int &index)
 	}
 }
 
+/* Dots per mm */
+void QRenderArea::GetDotsPerUnit(double &dpuX, double &dpuY)
+{
+	dpuX = QWidget::physicalDpiX() / MM_PER_INCH;
+	dpuY = QWidget::physicalDpiY() / MM_PER_INCH;
+}
+
 void QRenderArea::AddFileToPlot(GCodeInt *ginter)
 {
-	int dpiX = QWidget::physicalDpiX();
-	int dpiY = QWidget::physicalDpiY();
 	GPlotterInfo gp;
 
 	gp.ginter = ginter;
 	gp.ginfo = ginter->GetGCodeInfo();
 	gp.showProbePoints = true;
 	gp.showDrillSpots = true;
+	gp.arcCache = new GArcCache();
 
-	if (gp.ginfo->UnitType == UNIT_INCHES) {
-		gp.m_dpuX = (double)dpiX;
-		gp.m_dpuY = (double)dpiY;
-	} else if (gp.ginfo->UnitType == UNIT_MM) {
-		gp.m_dpuX = dpiX / 25.4;
-		gp.m_dpuY = dpiY / 25.4;
-	}
+	GetDotsPerUnit(gp.m_dpuX, gp.m_dpuY);
 
 	m_listPlot.append(gp);
 	m_currPlot = gp;
@@ -118,6 +117,7 @@ void QRenderArea::RemoveFileFromPlot(GCodeInt *ginter)
 	if (index == -1)
 		return;
 
+	delete gp.arcCache;
 	m_listPlot.removeAt(index);
 
 	if (!m_listPlot.isEmpty())
@@ -126,6 +126,42 @@ void QRenderArea::RemoveFileFromPlot(GCodeInt *ginter)
 	update();
 }
 
+void QRenderArea::AddPreviewToPlot(GCodeLoader *loader)
+{
+	m_listPreview.append(loader);
+	connect(loader, SIGNAL(previewUpdated()), this, SLOT(PreviewUpdated()));
+}
+
+void QRenderArea::RemovePreviewFromPlot(GCodeLoader *loader)
+{
+	disconnect(loader, SIGNAL(previewUpdated()), this, SLOT(PreviewUpdated()));
+	m_listPreview.removeAll(loader);
+	update();
+}
+
+void QRenderArea::PreviewUpdated()
+{
+	/* With nothing else on screen, follow the board of the file being loaded */
+	if (m_listPlot.isEmpty() && !m_listPreview.isEmpty()) {
+		GCodeLoader *loader = m_listPreview.last();
+
+		{
+			QMutexLocker locker(loader->GetPreviewMutex());
+
+			m_previewInfo = loader->GetPreviewInfo();
+		}
+
+		if (m_previewInfo.BoardMinX <= m_previewInfo.BoardMaxX) {
+			m_currPlot.ginfo = &m_previewInfo;
+			GetDotsPerUnit(m_currPlot.m_dpuX, m_currPlot.m_dpuY);
+			ZoomToFit();
+			return;
+		}
+	}
+
+	update();
+}
+
 void QRenderArea::mousePressEvent(QMouseEvent *e)
 {
 	qDebug() << "mousePress" << e->button() << ":" << e->pos();
@@ -196,63 +232,16 @@ void QRenderArea::wheelEvent(QWheelEvent *e)
 
 void QRenderArea::PlotGCode(QPainter &painter, GPlotterInfo &gp)
 {
-	bool doPlot = false;
-	Position pos1, pos2;
 	double s_dpuX = gp.m_dpuX * m_scale;
 	double s_dpuY = gp.m_dpuY * m_scale;
 	GCodeInt *gint = gp.ginter;
+	GPhaseTimer timer(gint->GetPhaseTimes(), PHASE_RENDER);
 
 	//painter.setRenderHint(QPainter::Antialiasing);
 	painter.setPen(Qt::white);
 
-	pos2.z = 2.54; //Z safe
 	if (gint->HasStatements()) {
-
-		gint->Init();
-		int count = 0;
-		while (gint->ExecuteNextStatement()) {
-			int x1, y1, x2, y2;
-			GCodeCommand *cmd = gint->GetCurrentCommand();
-				
-			if (cmd == NULL)
-				continue;
-
-			if ( cmd->IsMotionCommand() ) {
-				pos2 = gint->GetCurrentPos();
-
-				if (pos2.z >= 0) doPlot = false;
-
-				if (doPlot) {
-					x1 = qRound(pos1.x * s_dpuX) + m_originX;
-					y1 = m_originY - qRound(pos1.y * s_dpuY);
-					x2 = qRound(pos2.x * s_dpuX) + m_originX;
-					y2 = m_originY - qRound(pos2.y * s_dpuY);
-
-                    /*switch (count) {
-						case 0: painter.setPen(Qt::white); break;
-						case 1: painter.setPen(Qt::magenta); break;
-						case 2: painter.setPen(Qt::green); break;
-						case 3: painter.setPen(Qt::red); break;
-                    }*/
-
-					painter.drawLine(x1, y1, x2, y2);
-					pos1 = pos2;
-
-					count = (count + 1) & 0x03;
-
-				} else if (pos2.z < 0.0) {
-					pos1 = pos2;
-					doPlot = true;
-				}
-            } else if (gp.showDrillSpots && ( cmd->IsA( G82 ) || cmd->IsA( G81 ) )) {
-				pos2 = gint->GetCurrentPos();
-
-				x1 = qRound(pos2.x * s_dpuX) + m_originX;
-				y1 = m_originY - qRound(pos2.y * s_dpuY);
-
-				painter.fillRect(x1-1, y1-1, 3, 3, Qt::green);
-			}
-		} 
+		PlotTrajectory(painter, gint->GetTrajectory(), *gp.arcCache, s_dpuX, s_dpuY, gp.showDrillSpots);
 
 		if (gp.showProbePoints) {
 			list<Position> *probePoints = gint->GetProbePoints();
@@ -280,6 +269,129 @@ void QRenderArea::PlotGCode(QPainter &painter, GPlotterInfo &gp)
 	}
 }
 
+/*
+ * Draws the cuts (the moves below Z 0) and, if asked, the drill spots of a
+ * trajectory.  The arcs are drawn with a chord error under half a pixel, only
+ * the ones on screen are tessellated, by the tasks of the GTaskScheduler.
+ */
+void QRenderArea::PlotTrajectory(QPainter &painter, const GTrajectory &trajectory, GArcCache &arcCache, double s_dpuX, double s_dpuY, bool showDrillSpots)
+{
+	bool doPlot = false;
+	Position pos1, pos2;
+	GSpan<Real> xs = trajectory.GetX();
+	GSpan<Real> ys = trajectory.GetY();
+	GSpan<Real> zs = trajectory.GetZ();
+	GSpan<unsigned char> kinds = trajectory.GetKind();
+	GSpan<GArc> arcs = trajectory.GetArcs();
+	unsigned int arc = 0;
+	int count = 0;
+
+	Real tolerance = 0.5 / qMax(s_dpuX, s_dpuY);
+	Real viewMinX = -m_originX / s_dpuX;
+	Real viewMaxX = (this->size().width() - m_originX) / s_dpuX;
+	Real viewMinY = (m_originY - this->size().height()) / s_dpuY;
+	Real viewMaxY = m_originY / s_dpuY;
+
+	/* The arcs below Z 0 on screen are tessellated together first, ahead of the batch work */
+	vector<unsigned int> visibleArcs;
+
+	for (unsigned int i = 0; i < arcs.Size(); i++) {
+		const GArc &a = arcs[i];
+		Position start = trajectory.GetStartPosition(a.point);
+		Position end = trajectory.GetPosition(a.point);
+		Real r = qMax(hypot(start.x - a.cx, start.y - a.cy), hypot(end.x - a.cx, end.y - a.cy));
+
+		if (end.z < 0 && a.cx + r >= viewMinX && a.cx - r <= viewMaxX && a.cy + r >= viewMinY && a.cy - r <= viewMaxY)
+			visibleArcs.push_back(i);
+	}
+
+	arcCache.Prepare(trajectory, visibleArcs, tolerance, TASK_INTERACTIVE);
+
+	for (unsigned int i = 0; i < kinds.Size(); i++) {
+		int x1, y1, x2, y2;
+
+		if (kinds[i] == SEG_ARC) {
+			pos2.x = xs[i];
+			pos2.y = ys[i];
+			pos2.z = zs[i];
+
+			if (pos2.z >= 0) doPlot = false;
+
+			if (doPlot) {
+				const GArc &a = arcs[arc];
+				Real r = qMax(hypot(pos1.x - a.cx, pos1.y - a.cy), hypot(pos2.x - a.cx, pos2.y - a.cy));
+
+				if (a.cx + r >= viewMinX && a.cx - r <= viewMaxX && a.cy + r >= viewMinY && a.cy - r <= viewMaxY) {
+					GSpan<double> axs(NULL, 0), ays(NULL, 0);
+					QPolygon polyline(1);
+
+					arcCache.GetPoints(trajectory, arc, tolerance, axs, ays);
+					polyline[0] = QPoint(qRound(pos1.x * s_dpuX) + m_originX, m_originY - qRound(pos1.y * s_dpuY));
+
+					for (unsigned int j = 0; j < axs.Size(); j++)
+						polyline.append(QPoint(qRound(axs[j] * s_dpuX) + m_originX, m_originY - qRound(ays[j] * s_dpuY)));
+
+					painter.drawPolyline(polyline);
+				}
+
+				pos1 = pos2;
+			} else if (pos2.z < 0.0) {
+				pos1 = pos2;
+				doPlot = true;
+			}
+
+			arc++;
+		} else if (kinds[i] == SEG_PROBE) {
+			continue; //Drawn with the probe points
+		} else if (kinds[i] != SEG_DRILL) {
+			pos2.x = xs[i];
+			pos2.y = ys[i];
+			pos2.z = zs[i];
+
+			if (pos2.z >= 0) doPlot = false;
+
+			if (doPlot) {
+				x1 = qRound(pos1.x * s_dpuX) + m_originX;
+				y1 = m_originY - qRound(pos1.y * s_dpuY);
+				x2 = qRound(pos2.x * s_dpuX) + m_originX;
+				y2 = m_originY - qRound(pos2.y * s_dpuY);
+
+				/*switch (count) {
+					case 0: painter.setPen(Qt::white); break;
+					case 1: painter.setPen(Qt::magenta); break;
+					case 2: painter.setPen(Qt::green); break;
+					case 3: painter.setPen(Qt::red); break;
+				}*/
+
+				painter.drawLine(x1, y1, x2, y2);
+				pos1 = pos2;
+
+				count = (count + 1) & 0x03;
+
+			} else if (pos2.z < 0.0) {
+				pos1 = pos2;
+				doPlot = true;
+			}
+		} else if (showDrillSpots) {
+			x1 = qRound(xs[i] * s_dpuX) + m_originX;
+			y1 = m_originY - qRound(ys[i] * s_dpuY);
+
+			painter.fillRect(x1-1, y1-1, 3, 3, Qt::green);
+		}
+	}
+}
+
+void QRenderArea::PlotPreview(QPainter &painter, GCodeLoader *loader)
+{
+	QMutexLocker locker(loader->GetPreviewMutex());
+	GArcCache arcCache; //The preview changes all the time, nothing to keep
+	double dpuX, dpuY;
+
+	GetDotsPerUnit(dpuX, dpuY);
+	painter.setPen(Qt::gray);
+	PlotTrajectory(painter, loader->GetPreview(), arcCache, dpuX * m_scale, dpuY * m_scale, false);
+}
+
 void QRenderArea::paintEvent(QPaintEvent *e)
 {
 	QPainter painter(this);
@@ -297,6 +409,9 @@ void QRenderArea::paintEvent(QPaintEvent *e)
 		GPlotterInfo gp = it.next();
 		PlotGCode(painter, gp);
 	}
+
+	for (int i = 0; i < m_listPreview.size(); i++)
+		PlotPreview(painter, m_listPreview[i]);
 }
 
 void QRenderArea::resizeEvent(QResizeEvent *e)
@@ -0,0 +1,851 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Regression checks of the GCode engine, no QT.  The programs are written to
+ * the directory given (the current one by default), every check prints a line
+ * and the exit status is the number of failures.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "gcode-int.h"
+#include "gcode-arc.h"
+#include "gcode-emitter.h"
+#include "gcode-estimator.h"
+#include "gcode-stats.h"
+#include "gcode-export.h"
+#include "gcode-autoleveller.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void Check(bool ok, const string &what)
+{
+    printf("%s %s\n", ok? "ok  " : "FAIL", what.c_str());
+
+    if (!ok)
+        failures++;
+}
+
+static string WriteProgram(const string &dir, const string &name, const string &text)
+{
+    string path = dir + "/" + name;
+    FILE *file = fopen(path.c_str(), "w");
+
+    if (file != NULL) {
+        fputs(text.c_str(), file);
+        fclose(file);
+    }
+
+    return path;
+}
+
+/* The points, arcs and statistics are computed the same way either way, they have to be equal */
+static bool SameTrajectory(GCodeInt &a, GCodeInt &b)
+{
+    const GTrajectory &ta = a.GetTrajectory(), &tb = b.GetTrajectory();
+
+    if (ta.Size() != tb.Size() || ta.GetArcs().Size() != tb.GetArcs().Size())
+        return false;
+
+    for (size_t i = 0; i < ta.Size(); i++) {
+        Position p = ta.GetPosition(i), q = tb.GetPosition(i);
+
+        if (p.x != q.x || p.y != q.y || p.z != q.z || ta.GetFeed()[i] != tb.GetFeed()[i] || ta.GetKind()[i] != tb.GetKind()[i])
+            return false;
+    }
+
+    for (size_t i = 0; i < ta.GetArcs().Size(); i++) {
+        const GArc &x = ta.GetArcs()[i], &y = tb.GetArcs()[i];
+
+        if (x.cx != y.cx || x.cy != y.cy || x.sweep != y.sweep || x.point != y.point)
+            return false;
+    }
+
+    list<Position> *pa = a.GetProbePoints(), *pb = b.GetProbePoints();
+
+    if (pa->size() != pb->size())
+        return false;
+
+    for (list<Position>::iterator it = pa->begin(), jt = pb->begin(); it != pa->end(); it++, jt++) {
+        if (it->x != jt->x || it->y != jt->y)
+            return false;
+    }
+
+    GCodeInfo *ga = a.GetGCodeInfo(), *gb = b.GetGCodeInfo();
+
+    return ga->CutLength == gb->CutLength && ga->MinZ == gb->MinZ && ga->MaxZ == gb->MaxZ &&
+           ga->MillRouteDepth == gb->MillRouteDepth && ga->BoardMaxX == gb->BoardMaxX;
+}
+
+/* The evaluated arguments of the commands */
+static bool SameArguments(GCodeInt &a, GCodeInt &b)
+{
+    if (a.GetStatementCount() != b.GetStatementCount())
+        return false;
+
+    for (int i = 0; i < a.GetStatementCount(); i++) {
+        GCodeCommand *ca = StmtCast<GCodeCommand>(a.GetStatement(i)), *cb = StmtCast<GCodeCommand>(b.GetStatement(i));
+
+        if ((ca == NULL) != (cb == NULL))
+            return false;
+
+        if (ca == NULL)
+            continue;
+
+        vector<GArgument> &xs = ca->GetArguments(), &ys = cb->GetArguments();
+
+        if (xs.size() != ys.size())
+            return false;
+
+        for (size_t k = 0; k < xs.size(); k++) {
+            if (xs[k].name != ys[k].name || xs[k].value != ys[k].value)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * SetParameter(var, value) on 'program' has to give what loading it with
+ * 'var = value' gives, 'changed' is that program.  If SetParameter refuses,
+ * nothing may change.
+ */
+static void CheckSetParameter(const string &dir, const string &name, const string &program, const string &changed,
+                              const string &var, Real value, bool accepted)
+{
+    GCodeInt ginter(WriteProgram(dir, name + ".ngc", program));
+    GCodeInt original(WriteProgram(dir, name + ".ngc", program));
+    GCodeInt reloaded(WriteProgram(dir, name + ".new.ngc", changed));
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics) || !original.LoadFile(diagnostics) || !reloaded.LoadFile(diagnostics)) {
+        Check(false, name + ": load");
+        return;
+    }
+
+    bool ok = ginter.SetParameter(var, value, diagnostics);
+
+    Check(ok == accepted, name + ": SetParameter " + (accepted? "accepted" : "refused"));
+
+    if (ok)
+        Check(SameTrajectory(ginter, reloaded) && SameArguments(ginter, reloaded), name + ": same as loading the changed file");
+    else
+        Check(SameTrajectory(ginter, original) && SameArguments(ginter, original), name + ": unchanged");
+}
+
+static void TestSetParameter(const string &dir)
+{
+    CheckSetParameter(dir, "set-simple",
+                      "#1=1\n#3=-0.1\nG00 X1 Y1\nG01 Z[#3-#1] F100\nG01 X5 Z[#3]\n",
+                      "#1=1\n#3=-0.5\nG00 X1 Y1\nG01 Z[#3-#1] F100\nG01 X5 Z[#3]\n",
+                      "#3", -0.5, true);
+
+    CheckSetParameter(dir, "set-derived",
+                      "#3=-0.1\n#4=[#3*2]\n#5=[#4+1]\nG01 X1 Z[#4] F100\nG01 X2 Z[#5]\n",
+                      "#3=-0.4\n#4=[#3*2]\n#5=[#4+1]\nG01 X1 Z[#4] F100\nG01 X2 Z[#5]\n",
+                      "#3", -0.4, true);
+
+    CheckSetParameter(dir, "set-arc",
+                      "#5=1\nG01 X[#5] Y0 Z-0.1 F100\nG02 X[#5+2] Y0 I1 J0\nG01 X10\n",
+                      "#5=4\nG01 X[#5] Y0 Z-0.1 F100\nG02 X[#5+2] Y0 I1 J0\nG01 X10\n",
+                      "#5", 4, true);
+
+    /* The traverse height of the probe cycles, their points move */
+    CheckSetParameter(dir, "set-probe",
+                      "#2=0.5\n#6=60\nO100 call [1] [2] [#2] [-1] [400] [#6]\nG01 X1 Z-0.1 F100\n",
+                      "#2=2\n#6=60\nO100 call [1] [2] [#2] [-1] [400] [#6]\nG01 X1 Z-0.1 F100\n",
+                      "#2", 2, true);
+
+    /* The first cut reads #1 before it's assigned again, the reload would give Z-2.5 there */
+    CheckSetParameter(dir, "set-reassigned",
+                      "#3=-0.1\n#1=1\nG01 Z[#3-#1]\n#1=2\nG01 Z[#3-#1]\n",
+                      "#3=-0.5\n#1=1\nG01 Z[#3-#1]\n#1=2\nG01 Z[#3-#1]\n",
+                      "#3", -0.5, false);
+
+    /* #4 is computed from #3 and then overwritten, a reader of the first value is left */
+    CheckSetParameter(dir, "set-overwritten",
+                      "#3=-0.1\n#4=#3\nG01 Z[#4]\n#4=-1\nG01 Z[#4]\n",
+                      "#3=-0.5\n#4=#3\nG01 Z[#4]\n#4=-1\nG01 Z[#4]\n",
+                      "#3", -0.5, false);
+
+    CheckSetParameter(dir, "set-read-before",
+                      "G01 Z[#3]\n#3=-0.1\nG01 Z[#3]\n",
+                      "G01 Z[#3]\n#3=-0.5\nG01 Z[#3]\n",
+                      "#3", -0.5, false);
+
+    /* The chord gets longer than the diameter, the arc would become a line */
+    CheckSetParameter(dir, "set-arc-invalid",
+                      "#5=1\nG01 X0 Y0 Z-0.1 F100\nG02 X[#5] Y0 R1\nG01 X10\n",
+                      "#5=3\nG01 X0 Y0 Z-0.1 F100\nG02 X[#5] Y0 R1\nG01 X10\n",
+                      "#5", 3, false);
+
+    /* Not a parameter name */
+    CheckSetParameter(dir, "set-unknown",
+                      "#3=-0.1\nG01 Z[#3]\n",
+                      "#3=-0.1\nG01 Z[#3]\n",
+                      "3", -0.5, false);
+}
+
+/* Loading a file again, streamed or not, keeps nothing of the previous load */
+static void TestReload(const string &dir)
+{
+    string program = "#2=0.5\n#3=-0.1\nO100 call [1] [2] [#2] [-1] [400] [60]\n"
+                     "G01 X1 Z[#3] F100\nG02 X3 Y0 I1 J0\n";
+    GCodeInt ginter(WriteProgram(dir, "reload.ngc", program));
+    GCodeInt fresh(WriteProgram(dir, "reload.ngc", program));
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics) || !ginter.StreamFile(diagnostics) || !ginter.LoadFile(diagnostics) ||
+        !ginter.LoadFile(diagnostics) || !fresh.LoadFile(diagnostics)) {
+        Check(false, "reload: load");
+        return;
+    }
+
+    Check(SameTrajectory(ginter, fresh) && SameArguments(ginter, fresh), "reload: same as a fresh load");
+
+    bool changed = ginter.SetParameter("#2", 2, diagnostics), expected = fresh.SetParameter("#2", 2, diagnostics);
+
+    Check(changed && expected && SameTrajectory(ginter, fresh) && SameArguments(ginter, fresh),
+          "reload: SetParameter same as after a fresh load");
+}
+
+static bool Near(double a, double b)
+{
+    return fabs(a - b) <= 1e-9 * max(1.0, fabs(b));
+}
+
+/* Estimate of 'program' with the default machine (1000 mm/min cuts, 2000 mm/min rapids, 100 mm/s2) */
+static bool EstimateProgram(const string &dir, const string &name, const string &program, GTimeEstimate &estimate)
+{
+    GCodeInt ginter(WriteProgram(dir, name + ".ngc", program));
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics))
+        return false;
+
+    GCodeTimeEstimator estimator(&ginter);
+
+    estimator.Estimate(estimate);
+
+    return Near(estimate.Total, estimate.Rapid + estimate.Cutting + estimate.Drilling + estimate.Probing + estimate.ToolChanges);
+}
+
+static void TestEstimator(const string &dir)
+{
+    GTimeEstimate line, shortLine, collinear, corner, rapid, toolChange;
+
+    /* 10 mm/s reached after 0.5 mm, 10 s at full speed plus 0.1 s for the ramps */
+    Check(EstimateProgram(dir, "estimate-line", "G01 X100 F600\n", line) && Near(line.Cutting, 10.1),
+          "estimator: cut from rest to rest");
+
+    /* Too short for the feed, it accelerates half way and decelerates */
+    Check(EstimateProgram(dir, "estimate-short", "G01 X0.04 F600\n", shortLine) && Near(shortLine.Cutting, 0.04),
+          "estimator: cut too short for its feed");
+
+    Check(EstimateProgram(dir, "estimate-collinear", "G01 X50 F600\nG01 X100\n", collinear) &&
+          Near(collinear.Total, line.Total), "estimator: no slowdown between collinear cuts");
+    Check(EstimateProgram(dir, "estimate-corner", "G01 X50 F600\nG01 Y50\n", corner) &&
+          corner.Total > line.Total && corner.Total < line.Total + 0.1, "estimator: slowdown at a corner");
+
+    Check(EstimateProgram(dir, "estimate-rapid", "G00 X100\n", rapid) && Near(rapid.Rapid, 3 + 1 / 3.0) &&
+          rapid.Cutting == 0, "estimator: rapid");
+
+    Check(EstimateProgram(dir, "estimate-tools", "G01 X10 F600\nM06 T2\nG01 X20\n", toolChange) &&
+          toolChange.ToolChanges == 30 && toolChange.ToolTime.size() == 2 &&
+          Near(toolChange.ToolTime[0] + toolChange.ToolTime[2], toolChange.Cutting), "estimator: tool change");
+}
+
+/* The tessellations of the arcs moved by SetParameter are dropped */
+static void TestArcCache(const string &dir)
+{
+    GCodeInt ginter(WriteProgram(dir, "arc-cache.ngc", "#5=1\nG01 X[#5] Y0 F100\nG02 X[#5+2] Y0 I1 J0\n"));
+    GArcCache cache;
+    GSpan<double> xs(NULL, 0), ys(NULL, 0);
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics)) {
+        Check(false, "arc-cache: load");
+        return;
+    }
+
+    cache.GetPoints(ginter.GetTrajectory(), 0, 0.01, xs, ys);
+    Check(xs.Size() > 0 && xs[xs.Size() - 1] == 3, "arc-cache: tessellated");
+
+    ginter.SetParameter("#5", 4, diagnostics);
+    cache.GetPoints(ginter.GetTrajectory(), 0, 0.01, xs, ys);
+    Check(xs.Size() > 0 && xs[xs.Size() - 1] == 6, "arc-cache: tessellated again after SetParameter");
+}
+
+/* Every job reports to its own diagnostics, a failed export doesn't show up in the next one */
+static void TestDiagnostics(const string &dir)
+{
+    GCodeInt ginter(WriteProgram(dir, "diagnostics.ngc", "G01 X1 Y1 F100\n"));
+    GDiagnostics load, failed, exported;
+
+    Check(ginter.LoadFile(load) && !load.HasMessages(), "diagnostics: load");
+    Check(!ExportTrajectory(&ginter, dir + "/no-such-dir/diagnostics.", failed) && failed.HasMessages(),
+          "diagnostics: failed export reported");
+    Check(ExportTrajectory(&ginter, dir + "/diagnostics.", exported) && !exported.HasMessages() && !load.HasMessages(),
+          "diagnostics: next export clean");
+}
+
+static string ReadText(const string &path)
+{
+    ifstream file(path.c_str(), ios::binary);
+    ostringstream text;
+
+    text << file.rdbuf();
+
+    return text.str();
+}
+
+static void SetAutolevellerInfo(GCodeAutoleveller &gal, GCodeInt &ginter)
+{
+    AutolevellerInfo *ainfo = gal.GetAutolevellerInfo();
+
+    ainfo->GridSize = 5;
+    ainfo->EngravingDepth = ginter.GetGCodeInfo()->MillRouteDepth / ginter.GetGCodeInfo()->UnitScale;
+    ainfo->TraverseHeight = 0.5;
+    ainfo->ProbeMaxDepth = -1;
+    ainfo->TraverseSpeed = 400;
+    ainfo->ProbeSpeed = 60;
+}
+
+/* Autolevelled output of 'path' with the statements split in 'tasks' parts, loaded in 'units' */
+static string SplitOutput(const string &path, unsigned int tasks, int units = UNIT_FILE)
+{
+    GCodeInt ginter(path);
+    GDiagnostics diagnostics;
+    ostringstream outfile;
+
+    outfile << path << ".split" << tasks << ".ngc";
+    ginter.SetCanonicalUnits(units);
+
+    if (!ginter.LoadFile(diagnostics))
+        return "";
+
+    /* Its defaults depend on the units of the file */
+    GCodeAutoleveller gal(&ginter);
+
+    SetAutolevellerInfo(gal, ginter);
+    gal.SplitSegments(NULL, tasks);
+
+    if (!gal.GenerateAutolevellingGCode(outfile.str().c_str(), diagnostics))
+        return "";
+
+    string text = ReadText(outfile.str());
+
+    remove(outfile.str().c_str());
+
+    return text;
+}
+
+/* Autolevelled output of 'path' streamed, see GCodeInt::StreamFile */
+static string StreamOutput(const string &path)
+{
+    GCodeInt ginter(path);
+    GDiagnostics diagnostics;
+    string outfile = path + ".stream.ngc";
+
+    if (!ginter.StreamFile(diagnostics))
+        return "";
+
+    GCodeAutoleveller gal(&ginter);
+
+    SetAutolevellerInfo(gal, ginter);
+
+    if (!gal.StreamAutolevellingGCode(outfile.c_str(), diagnostics))
+        return "";
+
+    string text = ReadText(outfile);
+
+    remove(outfile.c_str());
+
+    return text;
+}
+
+/* Enough statements for 7 parts of AL_SPLIT_MIN_STMTS_PER_TASK */
+static string SplitProgram(int kind)
+{
+    ostringstream program;
+    int count = 8 * AL_SPLIT_MIN_STMTS_PER_TASK;
+
+    program << "#1=-0.1\n#2=1.5\nG21 G90\nG00 Z1\nG00 X0 Y0\nG01 Z[#1] F100\n";
+
+    for (int i = 0; i < count; i++) {
+        double x = (i % 200) * 0.25, y = (i / 200) % 40 * 0.5;
+
+        if (kind == 0)
+            program << "G01 X" << x << " Y" << y << "\n";
+        else if (kind == 1)
+            program << ((i % 3 == 0)? "G02" : "G01") << " X" << x << " Y" << y << ((i % 3 == 0)? " R20" : "") << "\n";
+        else if (kind == 3 && i % 11 == 0)
+            program << "G82 X" << x << " Y" << y << " Z-1 R1 P0.5\n";
+        else if (kind == 3 && i % 13 == 0)
+            program << "O100 call [" << x << "] [" << y << "] [0.5] [-1] [400] [60]\nM05\n";
+        else if (kind == 3)
+            program << "G01 X" << x << " Y" << y << "\n";
+        else if (i % 50 == 0)
+            program << "G00 Z[#2]\nG00 X" << x << " Y" << y << "\nG01 Z[#1-" << (i % 7) * 0.01 << "] F" << 100 + i % 3 * 50 << "\n";
+        else
+            program << "G01 X[" << x << "+#2] Y" << y << "\n";
+    }
+
+    program << "G00 Z1\nM02\n";
+
+    return program.str();
+}
+
+/* The output doesn't depend on the parts the statements were split in, nor on the file being streamed */
+static void TestSplitTasks(const string &dir)
+{
+    const char *names[] = { "split-lines", "split-arcs", "split-parameters", "split-cycles" };
+
+    for (int kind = 0; kind < 4; kind++) {
+        string path = WriteProgram(dir, string(names[kind]) + ".ngc", SplitProgram(kind));
+        string one = SplitOutput(path, 1);
+
+        Check(!one.empty(), string(names[kind]) + ": split in one part");
+        Check(SplitOutput(path, 4) == one, string(names[kind]) + ": same output in 4 parts");
+        Check(SplitOutput(path, 7) == one, string(names[kind]) + ": same output in 7 parts");
+        Check(StreamOutput(path) == one, string(names[kind]) + ": same output streamed");
+    }
+}
+
+static bool SameMotionStats(const GMotionStats &a, const GMotionStats &b)
+{
+    if (memcmp(a.Count, b.Count, sizeof(a.Count)) != 0 || a.FeedLength.size() != b.FeedLength.size())
+        return false;
+
+    for (map<float, Real>::const_iterator it = a.FeedLength.begin(), jt = b.FeedLength.begin(); it != a.FeedLength.end(); it++, jt++) {
+        if (it->first != jt->first || !Near(it->second, jt->second))
+            return false;
+    }
+
+    /* The lengths are added in another order */
+    return a.BoardMinX == b.BoardMinX && a.BoardMinY == b.BoardMinY && a.BoardMaxX == b.BoardMaxX &&
+           a.BoardMaxY == b.BoardMaxY && a.RouteDepth == b.RouteDepth && a.MinZ == b.MinZ && a.MaxZ == b.MaxZ &&
+           Near(a.CutLength, b.CutLength) && Near(a.RapidLength, b.RapidLength);
+}
+
+static void TestMotionStats(const string &dir)
+{
+    GCodeInt ginter(WriteProgram(dir, "stats.ngc", "G00 X10 Y10\nG01 Z-0.1 F100\nG01 X20 F200\nG01 Y30\n"
+                                                   "G02 X30 Y20 I0 J-10\nG00 Z1\n"));
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics)) {
+        Check(false, "stats: load");
+        return;
+    }
+
+    GCodeInfo *gi = ginter.GetGCodeInfo();
+
+    /* The arc is a quarter of a circle of radius 10, its top is the end of the cut before it */
+    Check(Near(gi->CutLength, 30.1 + 5 * acos(-1.0)) && Near(gi->RapidLength, sqrt(200.0) + 1.1), "stats: lengths");
+    Check(gi->RapidCount == 2 && gi->CutCount == 3 && gi->ArcCount == 1 && gi->DrillCount == 0, "stats: moves");
+    Check(gi->BoardMinX == 10 && gi->BoardMinY == 10 && gi->BoardMaxX == 30 && gi->BoardMaxY == 30 &&
+          Near(gi->MillRouteDepth, -0.1) && Near(gi->MinZ, -0.1) && gi->MaxZ == 1, "stats: board and depths");
+    Check(gi->FeedHistogram.size() == 2 && Near(gi->FeedHistogram[100], 0.1) && Near(gi->FeedHistogram[200], 30 + 5 * acos(-1.0)),
+          "stats: feed histogram");
+
+    /* The reduction doesn't depend on the ranges of the tasks */
+    GCodeInt big(WriteProgram(dir, "stats-big.ngc", SplitProgram(2)));
+
+    if (!big.LoadFile(diagnostics)) {
+        Check(false, "stats: load the big file");
+        return;
+    }
+
+    GMotionStats one, many;
+
+    ComputeMotionStats(big.GetTrajectory(), one, 1);
+    ComputeMotionStats(big.GetTrajectory(), many, 8);
+    Check(SameMotionStats(one, many), "stats: same in 1 and 8 tasks");
+}
+
+/* The cuts go over the same cells again and again, their compensations are shared, also when streaming */
+static void TestZCompensationDedup(const string &dir)
+{
+    string path = WriteProgram(dir, "zcomp-dedup.ngc", SplitProgram(0));
+    GCodeInt loaded(path), streamed(path);
+    GDiagnostics diagnostics;
+
+    if (!loaded.LoadFile(diagnostics) || !streamed.StreamFile(diagnostics)) {
+        Check(false, "zcomp-dedup: load");
+        return;
+    }
+
+    GCodeAutoleveller loadedAl(&loaded), streamedAl(&streamed);
+
+    loadedAl.GetAutolevellerInfo()->GridSize = 5;
+    streamedAl.GetAutolevellerInfo()->GridSize = 5;
+
+    loadedAl.SplitSegments();
+    Check(loadedAl.GenerateAutolevellingGCode((path + ".loaded.ngc").c_str(), diagnostics) &&
+          loadedAl.GetZCompensationDedupRatio() > 1, "zcomp-dedup: shared when loaded");
+    Check(streamedAl.StreamAutolevellingGCode((path + ".streamed.ngc").c_str(), diagnostics) &&
+          streamedAl.GetZCompensationDedupRatio() > 1, "zcomp-dedup: shared when streamed");
+
+    remove((path + ".loaded.ngc").c_str());
+    remove((path + ".streamed.ngc").c_str());
+}
+
+/* A file replaced by one of the same size or truncated isn't copied from */
+static void TestSource(const string &dir)
+{
+    string path = WriteProgram(dir, "source.ngc", "G01 X1 Y1 F100\n");
+    GCodeInt ginter(path);
+    GCodeSource source;
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics)) {
+        Check(false, "source: load");
+        return;
+    }
+
+    Check(ginter.OpenSource(source) && source.Get(0, 14) != NULL, "source: unchanged file read");
+    source.Close();
+
+    rename(WriteProgram(dir, "source.new.ngc", "G01 X2 Y2 F100\n").c_str(), path.c_str());
+    Check(!ginter.OpenSource(source), "source: replaced by a file of the same size");
+
+    source.Open(path.c_str());
+    WriteProgram(dir, "source.ngc", "G01\n");
+    Check(source.Get(0, 14) == NULL, "source: truncated while open");
+}
+
+/* Values of a uint32 column written by ExportTrajectory */
+static vector<unsigned int> ReadUIntColumn(const string &path)
+{
+    string text = ReadText(path);
+    vector<unsigned int> values;
+
+    if (text.size() < 10)
+        return values;
+
+    size_t start = 10 + (unsigned char)text[8] + ((unsigned char)text[9] << 8);
+
+    for (size_t offset = start; offset + sizeof(unsigned int) <= text.size(); offset += sizeof(unsigned int)) {
+        unsigned int value;
+
+        memcpy(&value, text.data() + offset, sizeof(value));
+        values.push_back(value);
+    }
+
+    return values;
+}
+
+/* The probe cycles have no line, the last one is the last statement of the file */
+static void TestExportLines(const string &dir)
+{
+    GCodeInt ginter(WriteProgram(dir, "export-lines.ngc",
+                                 "G01 X1 Y1 F100\nO100 call [1] [2] [0.5] [-1] [400] [60]\nG01 X2\nO100 call [3] [4] [0.5] [-1] [400] [60]\n"));
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics) || !ExportTrajectory(&ginter, dir + "/export-lines.", diagnostics)) {
+        Check(false, "export-lines: export");
+        return;
+    }
+
+    vector<unsigned int> lines = ReadUIntColumn(dir + "/export-lines.line.npy");
+    GSpan<unsigned char> kinds = ginter.GetTrajectory().GetKind();
+    bool ok = (lines.size() == kinds.Size());
+    unsigned int expected[] = { 1, 3 };
+    unsigned int cut = 0;
+
+    for (size_t i = 0; ok && i < lines.size(); i++) {
+        if (kinds[i] == SEG_PROBE)
+            ok = (lines[i] == 0);
+        else
+            ok = (cut < 2 && lines[i] == expected[cut++]);
+    }
+
+    Check(ok && cut == 2, "export-lines: lines of the moves, 0 for the probe cycles");
+}
+
+/* Moves of every kind, probe cycles and statements without a point */
+static string CursorProgram()
+{
+    ostringstream program;
+
+    program << "#1=-0.1\nG21 G90\nO100 call [0] [0] [0.5] [-1] [400] [60]\nG00 Z1\n";
+
+    for (int i = 0; i < 2000; i++) {
+        double x = (i % 50) * 0.5, y = (i / 50) * 0.5;
+
+        if (i % 7 == 0)
+            program << "G02 X" << x << " Y" << y << " R20\n";
+        else if (i % 11 == 0)
+            program << "G82 X" << x << " Y" << y << " Z-1 R1 P0.5\n";
+        else if (i % 13 == 0)
+            program << "O100 call [" << x << "] [" << y << "] [0.5] [-1] [400] [60]\nM05\n";
+        else
+            program << "G01 X" << x << " Y" << y << " Z[#1-" << (i % 5) * 0.01 << "] F100\n";
+    }
+
+    program << "G00 Z1\nM02\n";
+
+    return program.str();
+}
+
+struct CursorStep
+{
+    GCodeCommand *cmd;
+    int kind;
+    Position pos;
+};
+
+static bool SameStep(const CursorStep &a, const CursorStep &b)
+{
+    return a.cmd == b.cmd && a.kind == b.kind && a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.pos.z == b.pos.z;
+}
+
+static void WalkCursor(GCodeCursor &cursor, vector<CursorStep> &steps)
+{
+    while (cursor.Next()) {
+        CursorStep step = { cursor.GetCommand(), cursor.GetKind(), cursor.GetPosition() };
+
+        steps.push_back(step);
+    }
+}
+
+/* Threads walking one file at the same time with cursors of their own see the same program */
+static void TestCursorThreads(const string &dir)
+{
+    GCodeInt ginter(WriteProgram(dir, "cursor.ngc", CursorProgram()));
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics)) {
+        Check(false, "cursor-threads: load");
+        return;
+    }
+
+    vector<CursorStep> expected;
+    GCodeCursor cursor(&ginter);
+
+    WalkCursor(cursor, expected);
+    Check(expected.size() == (size_t)ginter.GetStatementCount() && expected.back().pos.z == 1,
+          "cursor-threads: every statement walked");
+
+    vector<vector<CursorStep> > walks(6);
+    vector<thread> threads;
+
+    for (size_t t = 0; t < walks.size(); t++) {
+        threads.push_back(thread([&ginter, &walks, t]() {
+            GCodeCursor cursor(&ginter);
+
+            WalkCursor(cursor, walks[t]);
+        }));
+    }
+
+    bool same = true;
+
+    for (size_t t = 0; t < walks.size(); t++) {
+        threads[t].join();
+
+        same = same && walks[t].size() == expected.size();
+        for (size_t i = 0; same && i < expected.size(); i++)
+            same = SameStep(walks[t][i], expected[i]);
+    }
+
+    Check(same, "cursor-threads: same steps in 6 threads");
+}
+
+/* A seek to any statement gives what walking the statements before it gives */
+static void TestCursorSeek(const string &dir)
+{
+    GCodeInt ginter(WriteProgram(dir, "cursor.ngc", CursorProgram()));
+    GDiagnostics diagnostics;
+
+    if (!ginter.LoadFile(diagnostics)) {
+        Check(false, "cursor-seek: load");
+        return;
+    }
+
+    vector<CursorStep> expected;
+    GCodeCursor replay(&ginter), cursor(&ginter);
+    bool same = true;
+
+    WalkCursor(replay, expected);
+
+    /* Forwards and then backwards, the same cursor */
+    for (size_t k = 0; same && k < 2 * expected.size(); k++) {
+        size_t index = (k < expected.size())? k : 2 * expected.size() - 1 - k;
+        Position before, pos;
+
+        if (index == 0)
+            before.reset();
+        else
+            before = expected[index - 1].pos;
+
+        same = cursor.Seek(index);
+        pos = cursor.GetPosition();
+        same = same && pos.x == before.x && pos.y == before.y && pos.z == before.z && cursor.Next();
+
+        CursorStep step = { cursor.GetCommand(), cursor.GetKind(), cursor.GetPosition() };
+
+        same = same && SameStep(step, expected[index]);
+    }
+
+    Check(same, "cursor-seek: every statement, same as the replay");
+    Check(cursor.Seek(expected.size()) && !cursor.Next() && !cursor.Seek(expected.size() + 1), "cursor-seek: end of the program");
+}
+
+static string StreamReal(Real value, int precision, bool fixedFormat)
+{
+    ostringstream ss;
+
+    ss.precision(precision);
+    if (fixedFormat)
+        ss << fixed;
+    ss << value;
+
+    return ss.str();
+}
+
+static string FormatReal(Real value, int format, int precision)
+{
+    char out[64];
+    int len = GCodeEmitter::FormatReal(out, value, format, precision);
+
+    return string(out, len);
+}
+
+/* The emitter writes what the stringstreams it replaced wrote */
+static void TestEmitter(const string &dir)
+{
+    Real values[] = { 0, -0.0L, 0.5, -0.5, 1, 0.1, 0.0005, 0.00049999, 0.125, 2.675, 9.9999995, 99999.95,
+                      999999.5, 1234567, 0.0001, 0.00001234, 1e-7L, 1e20L, -273.15L, 1 / 3.0L, 2 / 3.0L };
+    vector<Real> numbers(values, values + sizeof(values) / sizeof(values[0]));
+    bool general = true, fixedFormat = true, expressions = true;
+
+    for (int i = 0; i < 20000; i++)
+        numbers.push_back((Real)((i * 7919L) % 200001 - 100000) / powl(10, i % 8));
+
+    for (size_t i = 0; i < numbers.size(); i++) {
+        GNumberExpr number(numbers[i]);
+        GCodeEmitter emitter;
+
+        emitter << numbers[i];
+        expressions = expressions && emitter.ToString() == number.ToString();
+
+        for (int precision = 1; precision <= 8; precision++)
+            general = general && FormatReal(numbers[i], NUMFMT_GENERAL, precision) == StreamReal(numbers[i], precision, false);
+
+        for (int precision = 0; precision <= 6; precision++)
+            fixedFormat = fixedFormat && FormatReal(numbers[i], NUMFMT_FIXED, precision) == StreamReal(numbers[i], precision, true);
+    }
+
+    Check(expressions, "emitter: numbers like GNumberExpr::ToString");
+    Check(general, "emitter: general format like a stringstream");
+    Check(fixedFormat, "emitter: fixed format like a stringstream");
+
+    /* The weights were written with 3 fixed decimals */
+    bool zcomps = true;
+
+    for (int weight = -1000; weight <= 1000; weight++) {
+        ZCompensation zcomp;
+        GCodeEmitter emitter;
+        ostringstream ss;
+
+        zcomp.depth = (weight % 2 == 0)? ZDEPTH_ENGRAVING : ZDEPTH_DRILLSPOT;
+        ss.precision(3);
+        ss << fixed;
+
+        for (int i = 0; i < 4; i++) {
+            zcomp.params[i] = 2000 + i * 37 + (weight & 0xff);
+            zcomp.weights[i] = (short)((weight + i * 250 + 1000) % 2001 - 1000);
+            ss << zcomp.weights[i] / 1000.0 << "*#" << zcomp.params[i] << " + ";
+        }
+        ss << "#" << zcomp.GetDepthParameter();
+
+        emitter.EmitZCompensation(zcomp);
+        zcomps = zcomps && emitter.ToString() == ss.str();
+    }
+
+    Check(zcomps, "emitter: Z compensations like a stringstream");
+
+    /* The name, then every argument with its expression */
+    GCodeInt ginter(WriteProgram(dir, "emitter.ngc", CursorProgram() + "G01 X[0.1+#1] Y[#1*3] Z[#1/7-0.25] F[100/3]\n"));
+    GDiagnostics diagnostics;
+    bool commands = ginter.LoadFile(diagnostics);
+
+    for (int i = 0; i < ginter.GetStatementCount() && commands; i++) {
+        GCodeCommand *cmd = StmtCast<GCodeCommand>(ginter.GetStatement(i));
+
+        if (cmd == NULL)
+            continue;
+
+        vector<GArgument> &args = cmd->GetArguments();
+        ostringstream ss;
+
+        ss << cmd->GetName();
+        for (size_t k = 0; k < args.size(); k++)
+            ss << " " << args[k].name << args[k].expr->ToString();
+
+        commands = cmd->ToString() == ss.str();
+    }
+
+    Check(commands, "emitter: commands like a stringstream");
+}
+
+/* The autoleveller writes in the units of the program, whatever the units the file is loaded in */
+static void TestUnitsOutput(const string &dir)
+{
+    string program = CursorProgram();
+    string inches = WriteProgram(dir, "units-inches.ngc", program.replace(program.find("G21"), 3, "G20"));
+    string millimetres = WriteProgram(dir, "units-mm.ngc", CursorProgram());
+    string inchesOutput = SplitOutput(inches, 1), millimetresOutput = SplitOutput(millimetres, 1);
+
+    Check(!inchesOutput.empty() && !millimetresOutput.empty(), "units: autolevelled");
+    Check(SplitOutput(inches, 1, UNIT_MM) == inchesOutput, "units: inch file loaded in mm, same output");
+    Check(SplitOutput(millimetres, 1, UNIT_INCHES) == millimetresOutput, "units: mm file loaded in inches, same output");
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = (argc > 1)? argv[1] : ".";
+
+    TestSetParameter(dir);
+    TestReload(dir);
+    TestEstimator(dir);
+    TestArcCache(dir);
+    TestDiagnostics(dir);
+    TestSplitTasks(dir);
+    TestZCompensationDedup(dir);
+    TestMotionStats(dir);
+    TestSource(dir);
+    TestExportLines(dir);
+    TestCursorThreads(dir);
+    TestCursorSeek(dir);
+    TestUnitsOutput(dir);
+    TestEmitter(dir);
+
+    printf("%d failures\n", failures);
+
+    return failures;
+}